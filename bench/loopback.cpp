@@ -0,0 +1,542 @@
+
+#include "loopback.hh"
+#include "memfile.hh"
+#include "pattern.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+using namespace TPC;
+
+
+namespace {
+
+// Most bytes a connection moves at once.
+const size_t piece_size = 64*1024;
+
+}
+
+
+namespace TPC {
+
+/**
+ * One accepted connection, plain or TLS, with its traffic paced to the
+ * configured rate: each direction behaves as a link that is busy for
+ * size / rate seconds after every piece of data, with no burst allowance.
+ */
+class Connection {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    Connection(int fd, SSL *ssl, size_t rate) :
+        m_fd(fd),
+        m_ssl(ssl),
+        m_rate(rate)
+    {}
+
+    ~Connection() {
+        if (m_ssl) {
+            if (!m_reset) {SSL_shutdown(m_ssl);}
+            SSL_free(m_ssl);
+        }
+    }
+
+    Connection(const Connection&) = delete;
+
+    ssize_t Recv(char *buffer, size_t size) {
+        size = std::min(size, piece_size);
+        ssize_t retval;
+        do {
+            retval = m_ssl ? SSL_read(m_ssl, buffer, size) : recv(m_fd, buffer, size, 0);
+        } while (!m_ssl && (retval < 0) && (errno == EINTR));
+        if (retval > 0) {Pace(m_recv_free, retval);}
+        return retval;
+    }
+
+    bool Send(const char *data, size_t size) {
+        while (size) {
+            size_t len = std::min(size, piece_size);
+            Pace(m_send_free, len);
+            if (m_ssl) {
+                if (SSL_write(m_ssl, data, len) <= 0) {return false;}
+            } else {
+                ssize_t retval = send(m_fd, data, len, MSG_NOSIGNAL);
+                if (retval < 0) {
+                    if (errno == EINTR) {continue;}
+                    return false;
+                }
+                len = retval;
+            }
+            data += len;
+            size -= len;
+        }
+        return true;
+    }
+
+    bool Send(const std::string &data) {return Send(data.c_str(), data.size());}
+
+    // Abort the connection: closing it now sends a reset.
+    void Reset() {
+        struct linger linger;
+        linger.l_onoff = 1;
+        linger.l_linger = 0;
+        setsockopt(m_fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        m_reset = true;
+    }
+
+private:
+    void Pace(Clock::time_point &free, size_t bytes) {
+        if (!m_rate) {return;}
+        Clock::time_point now = Clock::now();
+        if (free < now) {free = now;}
+        free += std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(static_cast<double>(bytes) / m_rate));
+        std::this_thread::sleep_until(free);
+    }
+
+    const int m_fd;
+    SSL *m_ssl;
+    const size_t m_rate;
+    bool m_reset{false};
+    Clock::time_point m_send_free;  // When the outgoing link is idle again.
+    Clock::time_point m_recv_free;  // Likewise, incoming.
+};
+
+}
+
+
+namespace {
+
+// Value of header `name` in the request `head`; empty if absent.
+std::string HeaderValue(const std::string &head, const char *name)
+{
+    size_t len = strlen(name);
+    size_t pos = head.find("\r\n");
+    while (pos != std::string::npos) {
+        size_t start = pos + 2;
+        pos = head.find("\r\n", start);
+        size_t end = (pos == std::string::npos) ? head.size() : pos;
+        if ((end - start > len) && (head[start + len] == ':') &&
+            !strncasecmp(head.c_str() + start, name, len))
+        {
+            start += len + 1;
+            while ((start < end) && (head[start] == ' ')) {start++;}
+            return head.substr(start, end - start);
+        }
+    }
+    return "";
+}
+
+// Parse "bytes=<first>-[<last>]" against a file of `size` bytes.
+bool ParseRange(const std::string &value, off_t size, off_t &first, off_t &last)
+{
+    if (value.compare(0, 6, "bytes=")) {return false;}
+    const char *ptr = value.c_str() + 6;
+    char *end;
+    first = strtoll(ptr, &end, 10);
+    if ((end == ptr) || (*end != '-')) {return false;}
+    ptr = end + 1;
+    last = *ptr ? strtoll(ptr, &end, 10) : size - 1;
+    if (*ptr && *end) {return false;}
+    if (last >= size) {last = size - 1;}
+    return (first >= 0) && (first <= last);
+}
+
+// Parse "bytes <first>-<last>/<total>", as sent with a partial PUT.
+bool ParseContentRange(const std::string &value, off_t &first, off_t &last)
+{
+    if (value.compare(0, 6, "bytes ")) {return false;}
+    const char *ptr = value.c_str() + 6;
+    char *end;
+    first = strtoll(ptr, &end, 10);
+    if ((end == ptr) || (*end != '-')) {return false;}
+    ptr = end + 1;
+    last = strtoll(ptr, &end, 10);
+    return (end != ptr) && (*end == '/') && (first <= last);
+}
+
+// Size of the synthetic file at `path` ("/gen/<size>"); false if it is not one.
+bool ParseSynthetic(const std::string &path, off_t &size)
+{
+    if (path.compare(0, 5, "/gen/")) {return false;}
+    const char *ptr = path.c_str() + 5;
+    char *end;
+    size = strtoll(ptr, &end, 10);
+    return (end != ptr) && !*end && (size >= 0);
+}
+
+std::string SslError(const char *what)
+{
+    char buf[256];
+    ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+    return std::string(what) + ": " + buf;
+}
+
+bool AddExtension(X509 *cert, int nid, const char *value)
+{
+    X509V3_CTX ctx;
+    X509V3_set_ctx_nodb(&ctx);
+    X509V3_set_ctx(&ctx, cert, cert, nullptr, nullptr, 0);
+    // Older versions of OpenSSL take the value as mutable.
+    std::vector<char> copy(value, value + strlen(value) + 1);
+    X509_EXTENSION *ext = X509V3_EXT_conf_nid(nullptr, &ctx, nid, copy.data());
+    if (!ext) {return false;}
+    bool ok = X509_add_ext(cert, ext, -1);
+    X509_EXTENSION_free(ext);
+    return ok;
+}
+
+/**
+ * A TLS server context with a fresh, self-signed certificate for
+ * 127.0.0.1, which is written into `ca_dir` under its subject hash (the
+ * layout of a CA path).
+ */
+SSL_CTX *MakeContext(const std::string &ca_dir)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    SSL_library_init();
+    SSL_load_error_strings();
+#endif
+    EVP_PKEY *key = nullptr;
+    EVP_PKEY_CTX *key_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr);
+    if (!key_ctx || (EVP_PKEY_keygen_init(key_ctx) <= 0) ||
+        (EVP_PKEY_CTX_set_rsa_keygen_bits(key_ctx, 2048) <= 0) ||
+        (EVP_PKEY_keygen(key_ctx, &key) <= 0))
+    {
+        EVP_PKEY_CTX_free(key_ctx);
+        throw std::runtime_error(SslError("Failed to generate a key"));
+    }
+    EVP_PKEY_CTX_free(key_ctx);
+
+    X509 *cert = X509_new();
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), time(nullptr));
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    X509_gmtime_adj(X509_get_notBefore(cert), -3600);
+    X509_gmtime_adj(X509_get_notAfter(cert), 7*86400);
+#else
+    X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 7*86400);
+#endif
+    X509_set_pubkey(cert, key);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "O", MBSTRING_ASC,
+                               reinterpret_cast<const unsigned char *>("xrootd-tpc benchmark"), -1, -1, 0);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               reinterpret_cast<const unsigned char *>("127.0.0.1"), -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    SSL_CTX *ctx = nullptr;
+    if (AddExtension(cert, NID_basic_constraints, "critical,CA:TRUE") &&
+        AddExtension(cert, NID_subject_alt_name, "IP:127.0.0.1,DNS:localhost") &&
+        X509_sign(cert, key, EVP_sha256()))
+    {
+        ctx = SSL_CTX_new(SSLv23_server_method());
+    }
+    if (!ctx || !SSL_CTX_use_certificate(ctx, cert) || !SSL_CTX_use_PrivateKey(ctx, key)) {
+        if (ctx) {SSL_CTX_free(ctx);}
+        X509_free(cert);
+        EVP_PKEY_free(key);
+        throw std::runtime_error(SslError("Failed to create a self-signed certificate"));
+    }
+
+    char hash[16];
+    snprintf(hash, sizeof(hash), "%08lx", X509_subject_name_hash(cert));
+    std::string path = ca_dir + "/" + hash + ".0";
+    FILE *fp = fopen(path.c_str(), "w");
+    bool written = fp && PEM_write_X509(fp, cert);
+    if (fp) {fclose(fp);}
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    if (!written) {
+        SSL_CTX_free(ctx);
+        throw std::runtime_error("Failed to write the certificate to " + path);
+    }
+    return ctx;
+}
+
+}
+
+
+LoopbackServer::LoopbackServer(std::shared_ptr<MemData> data, const LoopbackOptions &options) :
+    m_data(std::move(data)),
+    m_options(options)
+{
+    if (!options.m_ca_dir.empty()) {
+        m_ssl_ctx = MakeContext(options.m_ca_dir);
+    }
+    m_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (m_listen_fd < 0) {
+        if (m_ssl_ctx) {SSL_CTX_free(m_ssl_ctx);}
+        throw std::runtime_error("Failed to create loopback socket");
+    }
+    int one = 1;
+    setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(options.m_port);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(m_listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) ||
+        listen(m_listen_fd, 128) ||
+        getsockname(m_listen_fd, reinterpret_cast<struct sockaddr*>(&addr), &addr_len))
+    {
+        close(m_listen_fd);
+        if (m_ssl_ctx) {SSL_CTX_free(m_ssl_ctx);}
+        throw std::runtime_error("Failed to listen on the loopback interface");
+    }
+    m_port = ntohs(addr.sin_port);
+    m_acceptor = std::thread(&LoopbackServer::Accept, this);
+}
+
+LoopbackServer::~LoopbackServer()
+{
+    m_shutdown = true;
+    // Wakes up the acceptor, as well as any thread blocked on a connection.
+    shutdown(m_listen_fd, SHUT_RDWR);
+    m_acceptor.join();
+    {
+        std::unique_lock<std::mutex> guard(m_mutex);
+        for (int fd : m_connections) {shutdown(fd, SHUT_RDWR);}
+    }
+    for (auto &thread : m_threads) {thread.join();}
+    close(m_listen_fd);
+    if (m_ssl_ctx) {SSL_CTX_free(m_ssl_ctx);}
+}
+
+std::string LoopbackServer::URL(const std::string &path) const
+{
+    return std::string(m_ssl_ctx ? "https" : "http") + "://127.0.0.1:" + std::to_string(m_port) + path;
+}
+
+void LoopbackServer::Accept()
+{
+    while (!m_shutdown) {
+        int fd = accept(m_listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) {continue;}
+            break;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        std::unique_lock<std::mutex> guard(m_mutex);
+        if (m_shutdown) {
+            close(fd);
+            break;
+        }
+        m_connections.insert(fd);
+        m_threads.emplace_back(&LoopbackServer::Serve, this, fd);
+    }
+}
+
+void LoopbackServer::Delay() const
+{
+    if (m_options.m_latency_ms) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(m_options.m_latency_ms));
+    }
+}
+
+bool LoopbackServer::NextReset()
+{
+    return m_options.m_reset_every && !(++m_transfers % m_options.m_reset_every);
+}
+
+void LoopbackServer::Serve(int fd)
+{
+    // A round trip for the TCP handshake, and another for TLS.
+    Delay();
+    SSL *ssl = nullptr;
+    if (m_ssl_ctx) {
+        Delay();
+        ssl = SSL_new(m_ssl_ctx);
+        if (ssl && (!SSL_set_fd(ssl, fd) || (SSL_accept(ssl) <= 0))) {
+            SSL_free(ssl);
+            ssl = nullptr;
+        }
+    }
+    if (ssl || !m_ssl_ctx) {
+        Connection conn(fd, ssl, m_options.m_rate);
+        std::string pending;
+        char buffer[16*1024];
+        while (!m_shutdown) {
+            size_t end = pending.find("\r\n\r\n");
+            if (end == std::string::npos) {
+                ssize_t retval = conn.Recv(buffer, sizeof(buffer));
+                if (retval <= 0) {break;}
+                pending.append(buffer, retval);
+                continue;
+            }
+            std::string head = pending.substr(0, end);
+            pending.erase(0, end + 4);
+            if (!Respond(conn, head, pending)) {break;}
+        }
+    }
+    {
+        std::unique_lock<std::mutex> guard(m_mutex);
+        m_connections.erase(fd);
+    }
+    close(fd);
+}
+
+bool LoopbackServer::Respond(Connection &conn, const std::string &head, std::string &pending)
+{
+    m_requests++;
+    size_t method_end = head.find(' ');
+    size_t target_end = (method_end == std::string::npos) ? method_end : head.find(' ', method_end + 1);
+    if (target_end == std::string::npos) {
+        conn.Send("HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        return false;
+    }
+    std::string method = head.substr(0, method_end);
+    std::string target = head.substr(method_end + 1, target_end - method_end - 1);
+    std::string path = target.substr(0, target.find('?'));
+
+    if (!path.compare(0, 10, "/redirect/")) {
+        Delay();
+        // The body of a PUT, if it was sent regardless, is not read.
+        conn.Send("HTTP/1.1 307 Temporary Redirect\r\nLocation: " + URL(target.substr(9)) +
+                  "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        return false;
+    }
+    bool keep_alive = strcasecmp(HeaderValue(head, "Connection").c_str(), "close");
+    if ((method == "GET") || (method == "HEAD")) {
+        return Get(conn, path, head, method == "GET") && keep_alive;
+    } else if (method == "PUT") {
+        return Put(conn, path, head, pending) && keep_alive;
+    }
+    conn.Send("HTTP/1.1 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    return false;
+}
+
+bool LoopbackServer::Get(Connection &conn, const std::string &path, const std::string &head, bool body)
+{
+    off_t size;
+    bool synthetic = ParseSynthetic(path, size);
+    if (!synthetic) {
+        if (!m_data) {
+            Delay();
+            return conn.Send("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        }
+        // The file must not change while it is being served.
+        size = m_data->m_bytes.size();
+    }
+
+    off_t first = 0, last = size - 1;
+    std::stringstream ss;
+    std::string range = HeaderValue(head, "Range");
+    if (range.empty() || m_options.m_ignore_range) {
+        ss << "HTTP/1.1 200 OK\r\n";
+    } else if (ParseRange(range, size, first, last)) {
+        ss << "HTTP/1.1 206 Partial Content\r\n"
+           << "Content-Range: bytes " << first << "-" << last << "/" << size << "\r\n";
+    } else {
+        ss << "HTTP/1.1 416 Range Not Satisfiable\r\n"
+           << "Content-Range: bytes */" << size << "\r\n"
+           << "Content-Length: 0\r\n\r\n";
+        Delay();
+        return conn.Send(ss.str());
+    }
+    off_t length = last - first + 1;
+    ss << "Content-Length: " << length << "\r\n"
+       << "Accept-Ranges: bytes\r\n\r\n";
+    Delay();
+    if (!conn.Send(ss.str())) {return false;}
+    if (!body) {return true;}
+
+    bool reset = length && NextReset();
+    off_t end = first + (reset ? length / 2 : length);
+    if (synthetic) {
+        std::vector<char> buffer(256*1024);
+        for (off_t offset = first; offset < end; offset += buffer.size()) {
+            size_t len = std::min(static_cast<off_t>(buffer.size()), end - offset);
+            FillPattern(offset, buffer.data(), len);
+            if (!conn.Send(buffer.data(), len)) {return false;}
+        }
+    } else if (!conn.Send(m_data->m_bytes.data() + first, end - first)) {
+        return false;
+    }
+    if (reset) {
+        m_resets++;
+        conn.Reset();
+        return false;
+    }
+    return true;
+}
+
+bool LoopbackServer::Put(Connection &conn, const std::string &path, const std::string &head,
+                         std::string &pending)
+{
+    std::string length_value = HeaderValue(head, "Content-Length");
+    if (length_value.empty()) {
+        Delay();
+        conn.Send("HTTP/1.1 411 Length Required\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        return false;
+    }
+    off_t length = strtoll(length_value.c_str(), nullptr, 10);
+    off_t first = 0, last = length - 1;
+    std::string range = HeaderValue(head, "Content-Range");
+    if (!range.empty() && (!ParseContentRange(range, first, last) || (last - first + 1 != length))) {
+        Delay();
+        conn.Send("HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        return false;
+    }
+    off_t size;
+    bool synthetic = ParseSynthetic(path, size);
+    bool match = !synthetic || (first + length <= size);
+
+    if (!strcasecmp(HeaderValue(head, "Expect").c_str(), "100-continue")) {
+        Delay();
+        if (!conn.Send("HTTP/1.1 100 Continue\r\n\r\n")) {return false;}
+    }
+    bool reset = length && NextReset();
+    off_t received = 0;
+    char buffer[64*1024];
+    while (received < length) {
+        if (reset && (received >= length / 2)) {
+            m_resets++;
+            conn.Reset();
+            return false;
+        }
+        const char *data = buffer;
+        size_t len;
+        if (!pending.empty()) {
+            len = std::min(static_cast<off_t>(pending.size()), length - received);
+            data = pending.data();
+        } else {
+            ssize_t retval = conn.Recv(buffer, std::min(static_cast<off_t>(sizeof(buffer)), length - received));
+            if (retval <= 0) {return false;}
+            len = retval;
+        }
+        if (synthetic && match) {
+            match = CheckPattern(first + received, data, len);
+        }
+        if (data != buffer) {pending.erase(0, len);}
+        received += len;
+    }
+    Delay();
+    if (!match) {
+        m_mismatches++;
+        return conn.Send("HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n");
+    }
+    return conn.Send("HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n");
+}
@@ -0,0 +1,98 @@
+/**
+ * loopback.hh:
+ *
+ * A minimal HTTP/1.1 server on 127.0.0.1, standing in for the remote side
+ * of a transfer in the benchmarks.  It answers GET (with or without a byte
+ * Range), HEAD and PUT (with or without a Content-Range) over persistent
+ * connections; each connection gets a thread of its own.
+ *
+ * Paths of the form /gen/<size> are synthetic files of <size> bytes (see
+ * pattern.hh): GETs produce them and PUTs are checked against them, so that
+ * transfers of any size need no storage.  Any other path is the in-memory
+ * file given to the server, if any; data PUT there is discarded.  A path
+ * prefixed with /redirect is redirected to the same path without it.
+ *
+ * To emulate a wide-area link, each connection may be limited to a rate
+ * (each way) and each response held back for a round-trip time; every n-th
+ * transfer of data may be cut short by a connection reset.  The server may
+ * also ignore Range headers, to check that clients notice.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+
+typedef struct ssl_ctx_st SSL_CTX;
+
+namespace TPC {
+class Connection;
+struct MemData;
+
+struct LoopbackOptions {
+    unsigned short m_port{0};  // 0 for an ephemeral port.
+    unsigned m_latency_ms{0};  // Round-trip time added to each connection and response.
+    size_t m_rate{0};  // Bytes per second per connection, each way; 0 for no limit.
+    unsigned m_reset_every{0};  // Reset every n-th GET or PUT halfway through its data; 0 never.
+    bool m_ignore_range{false};  // Answer GETs with the whole file, as a server without range support.
+    // If set, serve HTTPS with a self-signed certificate, which is written
+    // (as <hash>.0) into this directory so clients can use it as a CA path.
+    std::string m_ca_dir;
+};
+
+class LoopbackServer {
+public:
+    // Start listening; throws std::runtime_error on failure.
+    explicit LoopbackServer(std::shared_ptr<MemData> data,
+                            const LoopbackOptions &options = LoopbackOptions());
+    ~LoopbackServer();
+
+    LoopbackServer(const LoopbackServer&) = delete;
+
+    // URL of `path` on this server.
+    std::string URL(const std::string &path = "/file") const;
+
+    // Number of requests answered, connections reset on purpose, and PUTs
+    // whose data did not match the synthetic file, so far.
+    unsigned Requests() const {return m_requests;}
+    unsigned Resets() const {return m_resets;}
+    unsigned Mismatches() const {return m_mismatches;}
+
+private:
+    void Accept();
+    void Serve(int fd);
+    // Answer one request; returns false if the connection must be closed.
+    bool Respond(Connection &conn, const std::string &head, std::string &pending);
+    bool Get(Connection &conn, const std::string &path, const std::string &head, bool body);
+    bool Put(Connection &conn, const std::string &path, const std::string &head,
+             std::string &pending);
+    // Whether the next transfer of data is to be cut short.
+    bool NextReset();
+    // Hold back for a round-trip time, if any.
+    void Delay() const;
+
+    std::shared_ptr<MemData> m_data;
+    const LoopbackOptions m_options;
+    SSL_CTX *m_ssl_ctx{nullptr};
+    int m_listen_fd{-1};
+    unsigned short m_port{0};
+    std::atomic<bool> m_shutdown{false};
+    std::atomic<unsigned> m_requests{0};
+    std::atomic<unsigned> m_transfers{0};
+    std::atomic<unsigned> m_resets{0};
+    std::atomic<unsigned> m_mismatches{0};
+
+    std::mutex m_mutex;
+    std::set<int> m_connections;  // Open connections, to shut down on exit.
+    std::vector<std::thread> m_threads;
+    std::thread m_acceptor;
+};
+
+}
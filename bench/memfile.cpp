@@ -0,0 +1,111 @@
+
+#include "memfile.hh"
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/stat.h>
+
+using namespace TPC;
+
+
+MemFile::MemFile(std::shared_ptr<MemData> data, const char *user, int monid) :
+    XrdSfsFile(user, monid),
+    m_data(std::move(data))
+{}
+
+int MemFile::open(const char *, XrdSfsFileOpenMode mode, mode_t, const XrdSecEntity *, const char *)
+{
+    if (mode & SFS_O_TRUNC) {
+        std::unique_lock<std::mutex> guard(m_data->m_mutex);
+        m_data->m_bytes.clear();
+    }
+    return SFS_OK;
+}
+
+int MemFile::close()
+{
+    return SFS_OK;
+}
+
+int MemFile::fctl(const int, const char *, XrdOucErrInfo &info)
+{
+    info.setErrInfo(ENOTSUP, "Not supported by in-memory files");
+    return SFS_ERROR;
+}
+
+int MemFile::getMmap(void **addr, off_t &size)
+{
+    *addr = nullptr;
+    size = 0;
+    return SFS_OK;
+}
+
+int MemFile::read(XrdSfsFileOffset, XrdSfsXferSize)
+{
+    return SFS_OK;
+}
+
+XrdSfsXferSize MemFile::read(XrdSfsFileOffset offset, char *buffer, XrdSfsXferSize size)
+{
+    std::unique_lock<std::mutex> guard(m_data->m_mutex);
+    const auto &bytes = m_data->m_bytes;
+    if ((offset < 0) || (size < 0)) {
+        error.setErrInfo(EINVAL, "Invalid read");
+        return SFS_ERROR;
+    }
+    if (static_cast<size_t>(offset) >= bytes.size()) {return 0;}
+    size_t count = std::min(static_cast<size_t>(size), bytes.size() - static_cast<size_t>(offset));
+    memcpy(buffer, bytes.data() + offset, count);
+    return count;
+}
+
+int MemFile::read(XrdSfsAio *)
+{
+    error.setErrInfo(ENOTSUP, "Asynchronous I/O is not supported by in-memory files");
+    return SFS_ERROR;
+}
+
+XrdSfsXferSize MemFile::write(XrdSfsFileOffset offset, const char *buffer, XrdSfsXferSize size)
+{
+    if ((offset < 0) || (size < 0)) {
+        error.setErrInfo(EINVAL, "Invalid write");
+        return SFS_ERROR;
+    }
+    std::unique_lock<std::mutex> guard(m_data->m_mutex);
+    auto &bytes = m_data->m_bytes;
+    size_t end = static_cast<size_t>(offset) + size;
+    if (end > bytes.size()) {bytes.resize(end);}
+    memcpy(bytes.data() + offset, buffer, size);
+    return size;
+}
+
+int MemFile::write(XrdSfsAio *)
+{
+    error.setErrInfo(ENOTSUP, "Asynchronous I/O is not supported by in-memory files");
+    return SFS_ERROR;
+}
+
+int MemFile::stat(struct stat *buf)
+{
+    memset(buf, 0, sizeof(*buf));
+    std::unique_lock<std::mutex> guard(m_data->m_mutex);
+    buf->st_mode = S_IFREG | 0644;
+    buf->st_size = m_data->m_bytes.size();
+    buf->st_blksize = 4096;
+    return SFS_OK;
+}
+
+int MemFile::truncate(XrdSfsFileOffset size)
+{
+    std::unique_lock<std::mutex> guard(m_data->m_mutex);
+    m_data->m_bytes.resize(size);
+    return SFS_OK;
+}
+
+int MemFile::getCXinfo(char cxtype[4], int &cxrsz)
+{
+    memset(cxtype, 0, 4);
+    cxrsz = 0;
+    return SFS_OK;
+}
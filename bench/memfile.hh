@@ -0,0 +1,55 @@
+/**
+ * memfile.hh:
+ *
+ * An XrdSfsFile kept entirely in memory.  The benchmarks use it in place of
+ * the storage, so that they measure the plugin rather than a disk.
+ */
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "XrdSfs/XrdSfsInterface.hh"
+
+namespace TPC {
+
+// The contents of an in-memory file; shared by all handles opened on it,
+// and kept after they are closed.
+struct MemData {
+    std::mutex m_mutex;
+    std::vector<char> m_bytes;
+};
+
+class MemFile : public XrdSfsFile {
+public:
+    explicit MemFile(std::shared_ptr<MemData> data, const char *user = nullptr, int monid = 0);
+
+    // The path is ignored: the handle is bound to its data from the start.
+    virtual int open(const char *path, XrdSfsFileOpenMode mode, mode_t create_mode,
+                     const XrdSecEntity *client = nullptr, const char *opaque = nullptr);
+    virtual int close();
+
+    // No file descriptor or memory mapping is available.
+    virtual int fctl(const int cmd, const char *args, XrdOucErrInfo &info);
+    virtual const char *FName() {return "memory";}
+    virtual int getMmap(void **addr, off_t &size);
+
+    virtual int read(XrdSfsFileOffset offset, XrdSfsXferSize size);
+    virtual XrdSfsXferSize read(XrdSfsFileOffset offset, char *buffer, XrdSfsXferSize size);
+    virtual int read(XrdSfsAio *aio);
+    virtual XrdSfsXferSize write(XrdSfsFileOffset offset, const char *buffer, XrdSfsXferSize size);
+    virtual int write(XrdSfsAio *aio);
+
+    virtual int stat(struct stat *buf);
+    virtual int sync() {return SFS_OK;}
+    virtual int sync(XrdSfsAio *) {return SFS_OK;}
+    virtual int truncate(XrdSfsFileOffset size);
+    virtual int getCXinfo(char cxtype[4], int &cxrsz);
+
+private:
+    std::shared_ptr<MemData> m_data;
+};
+
+}
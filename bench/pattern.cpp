@@ -0,0 +1,48 @@
+
+#include "pattern.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+using namespace TPC;
+
+
+namespace {
+
+// Distinct, incompressible-looking words; a multiplication is cheap enough
+// not to slow down the stand-in server.
+inline uint64_t Word(uint64_t index)
+{
+    return (index + 1) * UINT64_C(0x9E3779B97F4A7C15);
+}
+
+}
+
+
+void TPC::FillPattern(off_t offset, char *buffer, size_t size)
+{
+    while (size) {
+        uint64_t value = Word(offset / sizeof(value));
+        size_t skip = offset % sizeof(value);
+        size_t len = std::min(size, sizeof(value) - skip);
+        memcpy(buffer, reinterpret_cast<const char *>(&value) + skip, len);
+        buffer += len;
+        offset += len;
+        size -= len;
+    }
+}
+
+bool TPC::CheckPattern(off_t offset, const char *buffer, size_t size)
+{
+    while (size) {
+        uint64_t value = Word(offset / sizeof(value));
+        size_t skip = offset % sizeof(value);
+        size_t len = std::min(size, sizeof(value) - skip);
+        if (memcmp(buffer, reinterpret_cast<const char *>(&value) + skip, len)) {return false;}
+        buffer += len;
+        offset += len;
+        size -= len;
+    }
+    return true;
+}
@@ -0,0 +1,22 @@
+/**
+ * pattern.hh:
+ *
+ * Contents of the synthetic files moved by the end-to-end benchmark.  The
+ * 64-bit word at each 8-byte aligned offset is a function of that offset
+ * alone, so any range of a file can be produced, or checked, on its own;
+ * files of any size can be served and verified without being stored.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+namespace TPC {
+
+// Fill `buffer` with the `size` bytes of the pattern at `offset`.
+void FillPattern(off_t offset, char *buffer, size_t size);
+
+// Whether `buffer` holds the `size` bytes of the pattern at `offset`.
+bool CheckPattern(off_t offset, const char *buffer, size_t size);
+
+}
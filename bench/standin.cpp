@@ -0,0 +1,192 @@
+/**
+ * standin.cpp:
+ *
+ * The remote side of the transfers run by the end-to-end benchmark
+ * (tpc-e2e-bench), and helpers to prepare and check its local files:
+ *
+ *     tpc-standin serve [--port <n>] [--latency <ms>] [--rate <size>]
+ *                       [--reset-every <n>] [--ignore-range] [--tls <ca dir>]
+ *     tpc-standin generate <path> <size>
+ *     tpc-standin check <path> <size>
+ *
+ * `serve` runs a LoopbackServer (see loopback.hh) until interrupted; it
+ * prints its base URL on the first line of its output and, once it exits,
+ * its statistics as a JSON object.  `generate` writes the synthetic file of
+ * the given size (see pattern.hh) to a local path, and `check` verifies that
+ * a local file is one.
+ */
+
+#include "loopback.hh"
+#include "pattern.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace TPC;
+
+
+namespace {
+
+// Parse a size with an optional k, m or g suffix (powers of 1024).
+bool ParseSize(const char *value, off_t &size)
+{
+    char *end;
+    long long result = strtoll(value, &end, 10);
+    if ((end == value) || (result < 0)) {return false;}
+    switch (*end) {
+    case 'k': case 'K': result <<= 10; end++; break;
+    case 'm': case 'M': result <<= 20; end++; break;
+    case 'g': case 'G': result <<= 30; end++; break;
+    }
+    size = result;
+    return !*end;
+}
+
+int Usage()
+{
+    fprintf(stderr, "Usage: tpc-standin serve [--port <n>] [--latency <ms>] [--rate <size>]\n"
+                    "                         [--reset-every <n>] [--ignore-range] [--tls <ca dir>]\n"
+                    "       tpc-standin generate <path> <size>\n"
+                    "       tpc-standin check <path> <size>\n");
+    return 2;
+}
+
+int Serve(int argc, char *argv[])
+{
+    LoopbackOptions options;
+    for (int idx = 0; idx < argc; idx++) {
+        std::string arg = argv[idx];
+        off_t value;
+        if (arg == "--ignore-range") {
+            options.m_ignore_range = true;
+        } else if (idx + 1 == argc) {
+            return Usage();
+        } else if (arg == "--tls") {
+            options.m_ca_dir = argv[++idx];
+        } else if (!ParseSize(argv[++idx], value)) {
+            return Usage();
+        } else if (arg == "--port") {
+            options.m_port = value;
+        } else if (arg == "--latency") {
+            options.m_latency_ms = value;
+        } else if (arg == "--rate") {
+            options.m_rate = value;
+        } else if (arg == "--reset-every") {
+            options.m_reset_every = value;
+        } else {
+            return Usage();
+        }
+    }
+
+    // Connections the client drops must not kill the server; termination
+    // requests are picked up below (the server's threads inherit the mask).
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    std::unique_ptr<LoopbackServer> server;
+    try {
+        server.reset(new LoopbackServer(nullptr, options));
+    } catch (std::runtime_error &exc) {
+        fprintf(stderr, "Failed to start the server: %s\n", exc.what());
+        return 1;
+    }
+    printf("%s\n", server->URL("").c_str());
+    fflush(stdout);
+
+    int sig;
+    sigwait(&signals, &sig);
+    unsigned requests = server->Requests(), resets = server->Resets(), mismatches = server->Mismatches();
+    server.reset();
+    printf("{\"requests\": %u, \"resets\": %u, \"mismatches\": %u}\n", requests, resets, mismatches);
+    return 0;
+}
+
+int Generate(const char *path, off_t size)
+{
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    std::vector<char> buffer(1024*1024);
+    for (off_t offset = 0; offset < size; offset += buffer.size()) {
+        size_t len = std::min(static_cast<off_t>(buffer.size()), size - offset);
+        FillPattern(offset, buffer.data(), len);
+        if (pwrite(fd, buffer.data(), len, offset) != static_cast<ssize_t>(len)) {
+            fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+            close(fd);
+            return 1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+int Check(const char *path, off_t size)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat buf;
+    if ((fd < 0) || fstat(fd, &buf)) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {close(fd);}
+        return 1;
+    }
+    if (buf.st_size != size) {
+        fprintf(stderr, "%s has %lld bytes instead of %lld\n", path,
+                static_cast<long long>(buf.st_size), static_cast<long long>(size));
+        close(fd);
+        return 1;
+    }
+    std::vector<char> buffer(1024*1024);
+    for (off_t offset = 0; offset < size; offset += buffer.size()) {
+        size_t len = std::min(static_cast<off_t>(buffer.size()), size - offset);
+        if ((pread(fd, buffer.data(), len, offset) != static_cast<ssize_t>(len)) ||
+            !CheckPattern(offset, buffer.data(), len))
+        {
+            fprintf(stderr, "%s differs from the source in the %lld bytes at offset %lld\n", path,
+                    static_cast<long long>(len), static_cast<long long>(offset));
+            close(fd);
+            return 1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {return Usage();}
+    std::string command = argv[1];
+    if (command == "serve") {
+        return Serve(argc - 2, argv + 2);
+    }
+    off_t size;
+    if ((argc != 4) || !ParseSize(argv[3], size)) {
+        return Usage();
+    } else if (command == "generate") {
+        return Generate(argv[2], size);
+    } else if (command == "check") {
+        return Check(argv[2], size);
+    }
+    return Usage();
+}
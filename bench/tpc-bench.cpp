@@ -0,0 +1,557 @@
+/**
+ * tpc-bench.cpp:
+ *
+ * Microbenchmarks of the hot paths of the plugin, run outside of XRootD:
+ * reordering and writing out the data of multi-stream pulls (Stream::Write),
+ * parsing response headers (State::Header) and scheduling byte ranges over
+ * the transfer engine (MultiCurlHandler, against a loopback server).  The
+ * local file is kept in memory, so that the disk does not dominate.
+ *
+ * The results are printed as a single JSON document, to compare runs:
+ *
+ *     tpc-bench [--quick] [--repeat <n>] [<filter>]
+ *
+ * Only the benchmarks whose name contains <filter> are run; --quick
+ * shrinks the amount of data moved, for a smoke test.
+ */
+
+#include "bufferpool.hh"
+#include "curlpool.hh"
+#include "engine.hh"
+#include "iopool.hh"
+#include "loopback.hh"
+#include "memfile.hh"
+#include "multistream.hh"
+#include "state.hh"
+#include "stream.hh"
+
+#include "XrdSys/XrdSysError.hh"
+#include "XrdSys/XrdSysLogger.hh"
+
+#include <curl/curl.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace TPC;
+
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double Seconds(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+struct Options {
+    bool m_quick{false};
+    unsigned m_repeat{3};
+    std::string m_filter;
+};
+
+/**
+ * One line of the report: the parameters of a benchmark and what it
+ * measured, as the members of a JSON object.  Names and string values are
+ * plain identifiers, so nothing is escaped.
+ */
+class Result {
+public:
+    explicit Result(const std::string &name) {Add("name", name);}
+
+    Result &Add(const char *key, const std::string &value) {
+        Key(key);
+        m_members += "\"" + value + "\"";
+        return *this;
+    }
+
+    Result &Add(const char *key, double value) {
+        std::stringstream ss;
+        ss.precision(12);
+        ss << value;
+        Key(key);
+        m_members += ss.str();
+        return *this;
+    }
+
+    std::string Render() const {return "{" + m_members + "}";}
+
+private:
+    void Key(const char *key) {
+        if (!m_members.empty()) {m_members += ",";}
+        m_members += std::string("\"") + key + "\":";
+    }
+
+    std::string m_members;
+};
+
+// Run `func`, which returns the seconds taken by the part worth timing,
+// `repeat` times; records the median and best times in `result` and
+// returns the median.
+double Measure(unsigned repeat, const std::function<double()> &func, Result &result)
+{
+    std::vector<double> times;
+    for (unsigned idx = 0; idx < repeat; idx++) {
+        times.push_back(func());
+    }
+    std::sort(times.begin(), times.end());
+    double median = times[times.size() / 2];
+    result.Add("seconds", median).Add("best_seconds", times[0]);
+    return median;
+}
+
+// Incompressible contents for a file of `size` bytes.
+std::shared_ptr<MemData> MakeData(size_t size)
+{
+    std::shared_ptr<MemData> data = std::make_shared<MemData>();
+    data->m_bytes.resize(size);
+    std::mt19937_64 rng(42);
+    for (size_t offset = 0; offset < size; offset += sizeof(uint64_t)) {
+        uint64_t value = rng();
+        memcpy(&data->m_bytes[offset], &value, std::min(sizeof(value), size - offset));
+    }
+    return data;
+}
+
+std::unique_ptr<XrdSfsFile> OpenMemFile(std::shared_ptr<MemData> data)
+{
+    std::unique_ptr<XrdSfsFile> fh(new MemFile(std::move(data)));
+    fh->open("/bench", SFS_O_CREAT|SFS_O_TRUNC|SFS_O_RDWR, 0644);
+    return fh;
+}
+
+/**
+ * Stream::Write.  The file is split into ranges one buffer long, handed
+ * out to the streams in order as they finish their previous range (as
+ * MultiCurlHandler does); each stream delivers its range in 16KB chunks,
+ * the size libcurl typically passes to the write callback.  The order in
+ * which the streams deliver their chunks is:
+ *
+ *  - in_order: whole ranges, one after the other, as a single stream would;
+ *  - interleaved: one chunk per stream in turn, as streams of equal speed;
+ *  - shuffled: a random stream at a time, as streams of varying speed.
+ *
+ * A stream whose write is turned away (WriteBlocked) is paused until the
+ * stream signals a wakeup, as the transfer engine does.
+ */
+enum class Pattern {InOrder, Interleaved, Shuffled};
+
+double StreamWrite(const MemData &source, Pattern pattern, size_t streams, BufferPool &pool,
+                   IOPool &io, size_t chunk)
+{
+    const std::vector<char> &bytes = source.m_bytes;
+    const off_t size = bytes.size();
+    std::shared_ptr<MemData> dest = std::make_shared<MemData>();
+    dest->m_bytes.reserve(size);
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool woken = false;
+
+    Clock::time_point start = Clock::now();
+    {
+        Stream stream(OpenMemFile(dest), streams, pool, io, 64*1024*1024);
+        stream.SetAlignment(0);
+        stream.SetWakeup([&] {
+            std::unique_lock<std::mutex> guard(mutex);
+            woken = true;
+            cv.notify_one();
+        });
+
+        struct Range {
+            off_t m_offset;
+            off_t m_end;
+            bool m_paused;
+        };
+        const off_t range_size = stream.BlockSize();
+        off_t next_offset = 0;
+        std::vector<Range> active;
+        while ((active.size() < streams) && (next_offset < size)) {
+            active.push_back(Range{next_offset, std::min(next_offset + range_size, size), false});
+            next_offset = active.back().m_end;
+        }
+        size_t paused = 0, turn = 0;
+        std::mt19937 rng(7);
+        while (!active.empty()) {
+            if (paused == active.size()) {
+                std::unique_lock<std::mutex> guard(mutex);
+                if (!woken) {cv.wait_for(guard, std::chrono::milliseconds(10));}
+                woken = false;
+                for (Range &range : active) {range.m_paused = false;}
+                paused = 0;
+            }
+            size_t first = (pattern == Pattern::InOrder) ? 0 :
+                           (pattern == Pattern::Interleaved) ? turn++ : rng();
+            size_t idx = first % active.size();
+            while (active[idx].m_paused) {idx = (idx + 1) % active.size();}
+
+            Range &range = active[idx];
+            size_t len = std::min(static_cast<off_t>(chunk), range.m_end - range.m_offset);
+            int retval = stream.Write(range.m_offset, &bytes[range.m_offset], len);
+            if (retval == Stream::WriteBlocked) {
+                range.m_paused = true;
+                paused++;
+                continue;
+            } else if (retval < 0) {
+                throw std::runtime_error("Write to the stream failed");
+            }
+            range.m_offset += retval;
+            if (range.m_offset < range.m_end) {continue;}
+            if (next_offset < size) {
+                range = Range{next_offset, std::min(next_offset + range_size, size), false};
+                next_offset = range.m_end;
+            } else {
+                active.erase(active.begin() + idx);
+            }
+        }
+        if (stream.Finalize() != SFS_OK) {
+            throw std::runtime_error("Failed to flush the stream");
+        }
+        stream.SetWakeup(nullptr);
+    }
+    double elapsed = Seconds(start);
+    if (dest->m_bytes != bytes) {
+        throw std::runtime_error("Stream wrote out the wrong data");
+    }
+    return elapsed;
+}
+
+void BenchStreamWrite(const Options &options, IOPool &io, std::vector<Result> &results)
+{
+    static const size_t chunk = 16*1024;
+    size_t size = options.m_quick ? 64*1024*1024 : 512*1024*1024;
+    std::shared_ptr<MemData> source = MakeData(size);
+    const std::pair<Pattern, const char *> patterns[] = {
+        {Pattern::InOrder, "in_order"},
+        {Pattern::Interleaved, "interleaved"},
+        {Pattern::Shuffled, "shuffled"}
+    };
+    for (size_t buffer_size : {1024*1024, 16*1024*1024}) {
+        BufferPool pool(buffer_size, 1024*1024*1024, false);
+        for (const auto &pattern : patterns) {
+            for (size_t streams : {1, 4, 16}) {
+                // A single stream always delivers in order.
+                if ((streams == 1) != (pattern.first == Pattern::InOrder)) {continue;}
+                Result result("stream_write");
+                result.Add("pattern", pattern.second).Add("streams", streams)
+                      .Add("buffer_size", buffer_size).Add("chunk_size", chunk).Add("bytes", size);
+                double seconds = Measure(options.m_repeat, [&] {
+                    return StreamWrite(*source, pattern.first, streams, pool, io, chunk);
+                }, result);
+                result.Add("mb_per_sec", size / seconds / (1024*1024));
+                results.push_back(result);
+            }
+        }
+    }
+}
+
+/**
+ * State::Header, fed canned responses line by line as libcurl would: a
+ * typical response to a Range GET, and the same preceded by a redirect.
+ */
+double ParseHeaders(const std::vector<std::string> &response, size_t count, BufferPool &pool,
+                    IOPool &io)
+{
+    Stream stream(OpenMemFile(std::make_shared<MemData>()), 1, pool, io, 0);
+    CURL *curl = curl_easy_init();
+    if (!curl) {
+        throw std::runtime_error("Failed to initialize a curl handle");
+    }
+    // The callback takes the buffers as mutable.
+    std::vector<std::string> lines(response);
+    Clock::time_point start = Clock::now();
+    off_t resource_size;
+    {
+        State state(0, stream, curl, false);
+        for (size_t idx = 0; idx < count; idx++) {
+            for (std::string &line : lines) {
+                if (State::HeaderCB(&line[0], 1, line.size(), &state) != line.size()) {
+                    throw std::runtime_error("Failed to parse header: " + line);
+                }
+            }
+        }
+        resource_size = state.GetResourceSize();
+    }
+    double elapsed = Seconds(start);
+    curl_easy_cleanup(curl);
+    if (resource_size != 1073741824) {
+        throw std::runtime_error("Headers were parsed incorrectly");
+    }
+    return elapsed;
+}
+
+void BenchStateHeader(const Options &options, IOPool &io, std::vector<Result> &results)
+{
+    const std::vector<std::string> partial = {
+        "HTTP/1.1 206 Partial Content\r\n",
+        "Date: Sat, 17 Oct 2026 12:00:00 GMT\r\n",
+        "Server: Apache/2.4.57 (Unix)\r\n",
+        "Last-Modified: Fri, 16 Oct 2026 08:30:00 GMT\r\n",
+        "ETag: \"1a2b3c4d-40000000\"\r\n",
+        "Accept-Ranges: bytes\r\n",
+        "Content-Length: 16777216\r\n",
+        "Content-Range: bytes 16777216-33554431/1073741824\r\n",
+        "Digest: adler32=0a1b2c3d\r\n",
+        "Content-Type: application/octet-stream\r\n",
+        "\r\n"
+    };
+    std::vector<std::string> redirected = {
+        "HTTP/1.1 307 Temporary Redirect\r\n",
+        "Date: Sat, 17 Oct 2026 12:00:00 GMT\r\n",
+        "Location: https://disk042.example.org:1094/store/data/file.root?authz=token\r\n",
+        "Content-Length: 0\r\n",
+        "\r\n"
+    };
+    redirected.insert(redirected.end(), partial.begin(), partial.end());
+
+    BufferPool pool(1024*1024, 16*1024*1024, false);
+    size_t count = options.m_quick ? 100000 : 1000000;
+    const std::pair<const std::vector<std::string> *, const char *> responses[] = {
+        {&partial, "partial"},
+        {&redirected, "redirected"}
+    };
+    for (const auto &response : responses) {
+        Result result("state_header");
+        result.Add("response", response.second).Add("headers", response.first->size())
+              .Add("responses", count);
+        double seconds = Measure(options.m_repeat, [&] {
+            return ParseHeaders(*response.first, count, pool, io);
+        }, result);
+        result.Add("responses_per_sec", count / seconds)
+              .Add("ns_per_header", seconds * 1e9 / (count * response.first->size()));
+        results.push_back(result);
+    }
+}
+
+#ifdef XRD_CHUNK_RESP
+/**
+ * Pull the file at `url` into `dest` over `streams` streams through the
+ * transfer engine, as MultiCurlHandler does for a COPY.  Ranges are one
+ * buffer long.  The pull starts at `start_offset`, as a resumed one would,
+ * and `content_length` may be known upfront (or -1).  Returns the time
+ * taken; throws if the transfer fails or does not finish within a minute.
+ */
+double Pull(const std::string &url, size_t streams, off_t content_length, off_t start_offset,
+            unsigned max_retries, BufferPool &pool, IOPool &io, CurlPool &curls,
+            TransferEngine &engine, std::shared_ptr<MemData> dest)
+{
+    Clock::time_point start = Clock::now();
+    Stream stream(OpenMemFile(std::move(dest)), streams, pool, io, 64*1024*1024);
+    stream.SetAlignment(0);
+    CURL *curl = curls.Get(url);
+    if (!curl) {
+        throw std::runtime_error("Failed to get a curl handle");
+    }
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    std::vector<State> states;
+    states.reserve(streams);
+    states.emplace_back(start_offset, stream, curl, false);
+    for (size_t idx = 1; idx < streams; idx++) {
+        states.emplace_back(states[0].Duplicate(curls));
+    }
+    size_t range_size = stream.BlockSize();
+    std::unique_ptr<Transfer> xfer = MakeMultiStreamTransfer(states, curls, url, content_length,
+        start_offset, std::min(range_size, static_cast<size_t>(1024*1024)), range_size, false,
+        max_retries);
+    engine.Submit(*xfer, curls.Affinity(curl));
+    if (!xfer->WaitUntil(time(nullptr) + 60)) {
+        xfer->Cancel();
+        xfer->Wait();
+        throw std::runtime_error("Transfer stalled");
+    }
+    if (xfer->GetResult() != CURLE_OK) {
+        throw std::runtime_error("Transfer failed: " + (xfer->GetMessage().empty() ?
+                                 std::string(curl_easy_strerror(xfer->GetResult())) : xfer->GetMessage()));
+    }
+    xfer.reset();
+    if (!states[0].Finalize()) {
+        throw std::runtime_error("Failed to flush the stream");
+    }
+    return Seconds(start);
+}
+
+/**
+ * MultiCurlHandler, pulling a file from the loopback server through the
+ * transfer engine.  Small buffers make for many ranges and put the
+ * emphasis on the scheduling of each request.
+ */
+double ScheduleRanges(LoopbackServer &server, const MemData &source, size_t streams,
+                      BufferPool &pool, IOPool &io, CurlPool &curls, TransferEngine &engine)
+{
+    std::shared_ptr<MemData> dest = std::make_shared<MemData>();
+    dest->m_bytes.reserve(source.m_bytes.size());
+    double elapsed = Pull(server.URL(), streams, -1, 0, 0, pool, io, curls, engine, dest);
+    if (dest->m_bytes != source.m_bytes) {
+        throw std::runtime_error("Transfer wrote out the wrong data");
+    }
+    return elapsed;
+}
+
+void BenchRangeScheduling(const Options &options, IOPool &io, std::vector<Result> &results)
+{
+    size_t size = options.m_quick ? 32*1024*1024 : 256*1024*1024;
+    std::shared_ptr<MemData> source = MakeData(size);
+    LoopbackServer server(source);
+    XrdSysLogger logger;
+    XrdSysError log(&logger, "tpc-bench_");
+    TransferEngine engine(log, 1);
+    CurlPool curls;
+    for (size_t buffer_size : {256*1024, 1024*1024}) {
+        BufferPool pool(buffer_size, 1024*1024*1024, false);
+        for (size_t streams : {1, 4, 16}) {
+            Result result("range_scheduling");
+            result.Add("streams", streams).Add("range_size", buffer_size).Add("bytes", size);
+            unsigned requests = server.Requests();
+            double seconds = Measure(options.m_repeat, [&] {
+                return ScheduleRanges(server, *source, streams, pool, io, curls, engine);
+            }, result);
+            double ranges = static_cast<double>(server.Requests() - requests) / options.m_repeat;
+            result.Add("ranges", ranges).Add("ranges_per_sec", ranges / seconds)
+                  .Add("mb_per_sec", size / seconds / (1024*1024));
+            results.push_back(result);
+        }
+    }
+}
+
+/**
+ * Recovery of a multi-stream pull from connection resets: each reset
+ * costs its range a retry after a backoff, while the ranges after it fill
+ * the reorder window and pause.  Dominated by the backoffs, so mostly a
+ * check that the transfer completes with the right data.
+ */
+void BenchRangeRetry(const Options &options, IOPool &io, std::vector<Result> &results)
+{
+    size_t size = options.m_quick ? 16*1024*1024 : 64*1024*1024;
+    std::shared_ptr<MemData> source = MakeData(size);
+    LoopbackOptions link;
+    link.m_reset_every = 10;
+    LoopbackServer server(source, link);
+    XrdSysLogger logger;
+    XrdSysError log(&logger, "tpc-bench_");
+    TransferEngine engine(log, 1);
+    CurlPool curls;
+    BufferPool pool(1024*1024, 1024*1024*1024, false);
+    size_t streams = 4;
+    Result result("range_retry");
+    result.Add("streams", streams).Add("range_size", pool.BufferSize()).Add("bytes", size)
+          .Add("reset_every", link.m_reset_every);
+    unsigned resets = server.Resets();
+    double seconds = Measure(1, [&] {
+        std::shared_ptr<MemData> dest = std::make_shared<MemData>();
+        double elapsed = Pull(server.URL(), streams, -1, 0, 3, pool, io, curls, engine, dest);
+        if (dest->m_bytes != source->m_bytes) {
+            throw std::runtime_error("Transfer wrote out the wrong data");
+        }
+        return elapsed;
+    }, result);
+    result.Add("resets", server.Resets() - resets).Add("mb_per_sec", size / seconds / (1024*1024));
+    results.push_back(result);
+}
+
+/**
+ * A pull resumed from the middle of a file, from a server that ignores
+ * Range headers: every response carries the file from its first byte,
+ * which must be refused rather than written at the offset of the range.
+ */
+void BenchRangeValidation(const Options &, IOPool &io, std::vector<Result> &results)
+{
+    size_t size = 16*1024*1024;
+    std::shared_ptr<MemData> source = MakeData(size);
+    LoopbackOptions link;
+    link.m_ignore_range = true;
+    LoopbackServer server(source, link);
+    XrdSysLogger logger;
+    XrdSysError log(&logger, "tpc-bench_");
+    TransferEngine engine(log, 1);
+    CurlPool curls;
+    BufferPool pool(1024*1024, 1024*1024*1024, false);
+    Result result("range_validation");
+    result.Add("streams", 4).Add("start_offset", pool.BufferSize()).Add("bytes", size);
+    Clock::time_point start = Clock::now();
+    try {
+        Pull(server.URL(), 4, size, pool.BufferSize(), 3, pool, io, curls, engine,
+             std::make_shared<MemData>());
+    } catch (std::runtime_error &exc) {
+        if (!strstr(exc.what(), "requested offset")) {throw;}
+        result.Add("seconds", Seconds(start));
+        results.push_back(result);
+        return;
+    }
+    throw std::runtime_error("Transfer accepted data from the wrong offset");
+}
+#endif
+
+void Usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [--quick] [--repeat <n>] [<filter>]\n", argv0);
+}
+
+}
+
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    for (int idx = 1; idx < argc; idx++) {
+        std::string arg = argv[idx];
+        if (arg == "--quick") {
+            options.m_quick = true;
+        } else if ((arg == "--repeat") && (idx + 1 < argc)) {
+            options.m_repeat = std::max(1, atoi(argv[++idx]));
+        } else if ((arg[0] != '-') && options.m_filter.empty()) {
+            options.m_filter = arg;
+        } else {
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    typedef void (*Benchmark)(const Options &, IOPool &, std::vector<Result> &);
+    const std::pair<const char *, Benchmark> benchmarks[] = {
+        {"stream_write", &BenchStreamWrite},
+        {"state_header", &BenchStateHeader},
+#ifdef XRD_CHUNK_RESP
+        {"range_scheduling", &BenchRangeScheduling},
+        {"range_retry", &BenchRangeRetry},
+        {"range_validation", &BenchRangeValidation},
+#endif
+    };
+    std::vector<Result> results;
+    try {
+        IOPool io(4);
+        for (const auto &benchmark : benchmarks) {
+            if (std::string(benchmark.first).find(options.m_filter) == std::string::npos) {continue;}
+            fprintf(stderr, "Running %s\n", benchmark.first);
+            benchmark.second(options, io, results);
+        }
+    } catch (std::runtime_error &exc) {
+        fprintf(stderr, "Benchmark failed: %s\n", exc.what());
+        return 1;
+    }
+
+    std::cout << "{\n  \"context\": {\"libcurl\": \"" << curl_version_info(CURLVERSION_NOW)->version
+              << "\", \"quick\": " << (options.m_quick ? "true" : "false")
+              << ", \"repeat\": " << options.m_repeat << "},\n  \"benchmarks\": [";
+    for (size_t idx = 0; idx < results.size(); idx++) {
+        std::cout << (idx ? ",\n    " : "\n    ") << results[idx].Render();
+    }
+    std::cout << "\n  ]\n}\n";
+    curl_global_cleanup();
+    return 0;
+}
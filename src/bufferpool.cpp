@@ -0,0 +1,79 @@
+
+#include "bufferpool.hh"
+
+#include <sys/mman.h>
+
+using namespace TPC;
+
+
+BufferPool::BufferPool(size_t buffer_size, size_t max_bytes, bool huge_pages) :
+    m_buffer_size(buffer_size),
+    m_max_buffers((max_bytes / buffer_size) ? (max_bytes / buffer_size) : 1),
+    m_huge_pages(huge_pages)
+{
+    m_free.reserve(m_max_buffers);
+}
+
+BufferPool::~BufferPool() {
+    for (char *buffer : m_free) {
+        munmap(buffer, m_buffer_size);
+    }
+}
+
+char *BufferPool::Allocate() {
+    void *buffer = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (m_huge_pages) {
+        // Only succeeds if the administrator has reserved huge pages.
+        buffer = mmap(nullptr, m_buffer_size, PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (buffer == MAP_FAILED) {
+        buffer = mmap(nullptr, m_buffer_size, PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED) {return nullptr;}
+#ifdef MADV_HUGEPAGE
+        if (m_huge_pages) {
+            // Fall back to transparent huge pages.
+            madvise(buffer, m_buffer_size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    m_allocated++;
+    return static_cast<char *>(buffer);
+}
+
+char *BufferPool::Lease(size_t reserve) {
+    char *buffer = nullptr;
+    {
+        std::unique_lock<std::mutex> guard(m_mutex);
+        if (m_in_use + reserve >= m_max_buffers) {
+            m_lease_failures++;
+            return nullptr;
+        }
+        if (!m_free.empty()) {
+            buffer = m_free.back();
+            m_free.pop_back();
+        }
+        m_in_use++;
+    }
+    // Buffers are never unmapped once allocated, so the page faults are
+    // only paid the first time a buffer is used.
+    if (!buffer && !(buffer = Allocate())) {
+        m_in_use--;
+        m_lease_failures++;
+        return nullptr;
+    }
+    size_t in_use = m_in_use;
+    size_t peak = m_peak_in_use;
+    while ((in_use > peak) && !m_peak_in_use.compare_exchange_weak(peak, in_use)) {}
+    return buffer;
+}
+
+void BufferPool::Release(char *buffer) {
+    if (!buffer) {return;}
+    std::unique_lock<std::mutex> guard(m_mutex);
+    m_free.push_back(buffer);
+    m_in_use--;
+}
@@ -0,0 +1,63 @@
+/**
+ * bufferpool.hh:
+ *
+ * A process-wide arena of fixed-size transfer buffers.  Streams lease
+ * buffers from the pool instead of allocating their own, so memory is
+ * recycled between transfers and the total used for reordering data is
+ * bounded server-wide.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include <cstddef>
+
+namespace TPC {
+
+class BufferPool {
+public:
+    // At most `max_bytes` will be allocated, rounded down to a whole number
+    // of buffers (but always at least one buffer).  If `huge_pages` is set,
+    // buffers are backed by huge pages when the kernel allows it.
+    BufferPool(size_t buffer_size, size_t max_bytes, bool huge_pages);
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+
+    // Returns a buffer of BufferSize() bytes, or nullptr if the memory
+    // budget is exhausted.  The lease also fails unless `reserve` buffers
+    // would be left for others afterwards.
+    char *Lease(size_t reserve = 0);
+
+    void Release(char *buffer);
+
+    size_t BufferSize() const {return m_buffer_size;}
+
+    // Occupancy counters, in number of buffers.
+    size_t Capacity() const {return m_max_buffers;}
+    size_t InUse() const {return m_in_use;}
+    size_t Available() const {return m_max_buffers - m_in_use;}
+    size_t Allocated() const {return m_allocated;}
+    size_t PeakInUse() const {return m_peak_in_use;}
+    size_t LeaseFailures() const {return m_lease_failures;}
+
+private:
+    char *Allocate();
+
+    const size_t m_buffer_size;
+    const size_t m_max_buffers;
+    const bool m_huge_pages;
+
+    std::atomic<size_t> m_in_use{0};
+    std::atomic<size_t> m_allocated{0};
+    std::atomic<size_t> m_peak_in_use{0};
+    std::atomic<size_t> m_lease_failures{0};
+
+    std::mutex m_mutex;
+    std::vector<char *> m_free;  // Allocated buffers not currently leased.
+};
+
+}
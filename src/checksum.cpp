@@ -0,0 +1,361 @@
+
+#include "checksum.hh"
+
+#include "XrdCks/XrdCksData.hh"
+
+#include <cctype>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+
+#include <strings.h>
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include <openssl/evp.h>
+#include <zlib.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#endif
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+using namespace TPC;
+
+
+namespace {
+
+struct AlgorithmName {
+    Checksum::Algorithm m_algorithm;
+    const char *m_name;  // As used by RFC 3230 and the checksum manager.
+};
+
+const AlgorithmName g_algorithms[] = {
+    {Checksum::Adler32, "adler32"},
+    {Checksum::CRC32C, "crc32c"},
+    {Checksum::MD5, "md5"}
+};
+
+std::string Trim(const std::string &input)
+{
+    size_t start = input.find_first_not_of(" \t");
+    if (start == std::string::npos) {return "";}
+    size_t end = input.find_last_not_of(" \t");
+    return input.substr(start, end - start + 1);
+}
+
+bool NameIs(const std::string &name, const char *expected)
+{
+    return (name.size() == strlen(expected)) && !strcasecmp(name.c_str(), expected);
+}
+
+// CRC32C (Castagnoli), one byte at a time; used where the CPU cannot do better.
+class CRC32CTable {
+public:
+    CRC32CTable() {
+        for (uint32_t idx = 0; idx < 256; idx++) {
+            uint32_t crc = idx;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc & 1) ? ((crc >> 1) ^ 0x82f63b78) : (crc >> 1);
+            }
+            m_table[idx] = crc;
+        }
+    }
+
+    uint32_t Update(uint32_t crc, const unsigned char *data, size_t size) const {
+        crc = ~crc;
+        while (size--) {
+            crc = m_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+private:
+    uint32_t m_table[256];
+};
+
+uint32_t CRC32CSoftware(uint32_t crc, const unsigned char *data, size_t size)
+{
+    static const CRC32CTable table;
+    return table.Update(crc, data, size);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// The SSE4.2 crc32 instruction computes CRC32C eight bytes at a time.
+__attribute__((target("sse4.2")))
+uint32_t CRC32CHardware(uint32_t crc, const unsigned char *data, size_t size)
+{
+    crc = ~crc;
+    while (size && (reinterpret_cast<uintptr_t>(data) & 7)) {
+        crc = _mm_crc32_u8(crc, *data++);
+        size--;
+    }
+    uint64_t crc64 = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = static_cast<uint32_t>(crc64);
+    while (size--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return ~crc;
+}
+#endif
+
+typedef uint32_t (*CRC32CFunc)(uint32_t, const unsigned char *, size_t);
+
+CRC32CFunc ChooseCRC32C()
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return CRC32CHardware;
+    }
+#endif
+    return CRC32CSoftware;
+}
+
+const char g_base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+std::string Base64Encode(const unsigned char *data, size_t size)
+{
+    std::string result;
+    for (size_t idx = 0; idx < size; idx += 3) {
+        uint32_t group = data[idx] << 16;
+        if (idx + 1 < size) {group |= data[idx + 1] << 8;}
+        if (idx + 2 < size) {group |= data[idx + 2];}
+        result += g_base64[(group >> 18) & 0x3f];
+        result += g_base64[(group >> 12) & 0x3f];
+        result += (idx + 1 < size) ? g_base64[(group >> 6) & 0x3f] : '=';
+        result += (idx + 2 < size) ? g_base64[group & 0x3f] : '=';
+    }
+    return result;
+}
+
+bool Base64Decode(const std::string &input, std::string &result)
+{
+    result.clear();
+    uint32_t group = 0;
+    int bits = 0;
+    for (char c : input) {
+        if (c == '=') {break;}
+        const char *found = strchr(g_base64, c);
+        if (!c || !found) {return false;}
+        group = (group << 6) | static_cast<uint32_t>(found - g_base64);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            result += static_cast<char>((group >> bits) & 0xff);
+        }
+    }
+    return true;
+}
+
+std::string HexEncode(const unsigned char *data, size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string result;
+    for (size_t idx = 0; idx < size; idx++) {
+        result += digits[data[idx] >> 4];
+        result += digits[data[idx] & 0xf];
+    }
+    return result;
+}
+
+bool HexDecode(const std::string &input, std::string &result)
+{
+    result.clear();
+    if (input.size() % 2) {return false;}
+    for (size_t idx = 0; idx < input.size(); idx += 2) {
+        if (!isxdigit(input[idx]) || !isxdigit(input[idx + 1])) {return false;}
+        result += static_cast<char>(std::stoi(input.substr(idx, 2), nullptr, 16));
+    }
+    return true;
+}
+
+// RFC 3230 writes MD5 in base64 but the 32-bit checksums in hex; servers
+// are not consistent about it, so a value of either form is accepted.
+bool DecodeValue(const std::string &input, size_t size, std::string &result)
+{
+    if ((input.size() == 2 * size) && HexDecode(input, result)) {
+        return true;
+    }
+    return Base64Decode(input, result) && (result.size() == size);
+}
+
+std::string EncodeValue(Checksum::Algorithm algorithm, const unsigned char *value, size_t size)
+{
+    return (algorithm == Checksum::MD5) ? Base64Encode(value, size) : HexEncode(value, size);
+}
+
+}
+
+
+bool Checksum::ParseAlgorithms(const std::string &names, unsigned &algorithms)
+{
+    algorithms = 0;
+    std::stringstream ss(names);
+    std::string name;
+    while (std::getline(ss, name, ',')) {
+        name = Trim(name);
+        if (name.empty() || NameIs(name, "none")) {continue;}
+        bool found = false;
+        for (const auto &entry : g_algorithms) {
+            if (NameIs(name, entry.m_name)) {
+                algorithms |= entry.m_algorithm;
+                found = true;
+            }
+        }
+        if (!found) {return false;}
+    }
+    return true;
+}
+
+std::string Checksum::WantDigest(unsigned algorithms)
+{
+    std::string result;
+    for (const auto &entry : g_algorithms) {
+        if (algorithms & entry.m_algorithm) {
+            if (!result.empty()) {result += ", ";}
+            result += entry.m_name;
+        }
+    }
+    return result;
+}
+
+Checksum::Checksum(unsigned algorithms) :
+    m_algorithms(algorithms)
+{
+    if (m_algorithms & MD5) {
+        m_md5 = EVP_MD_CTX_new();
+        if (!m_md5 || !EVP_DigestInit_ex(m_md5, EVP_md5(), nullptr)) {
+            m_algorithms &= ~MD5;
+        }
+    }
+}
+
+Checksum::~Checksum()
+{
+    if (m_md5) {EVP_MD_CTX_free(m_md5);}
+}
+
+void Checksum::Update(const char *data, size_t size)
+{
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    if (m_algorithms & Adler32) {
+        // zlib takes at most an unsigned int at a time.
+        const size_t max_chunk = 1 << 30;
+        for (size_t done = 0; done < size; done += max_chunk) {
+            size_t chunk = (size - done < max_chunk) ? (size - done) : max_chunk;
+            m_adler32 = adler32(m_adler32, bytes + done, static_cast<uInt>(chunk));
+        }
+    }
+    if (m_algorithms & CRC32C) {
+        static const CRC32CFunc crc32c = ChooseCRC32C();
+        m_crc32c = crc32c(m_crc32c, bytes, size);
+    }
+    if (m_algorithms & MD5) {
+        EVP_DigestUpdate(m_md5, bytes, size);
+    }
+}
+
+void Checksum::Final()
+{
+    if (m_final) {return;}
+    m_final = true;
+    if (m_algorithms & MD5) {
+        unsigned size = sizeof(m_md5_value);
+        EVP_DigestFinal_ex(m_md5, m_md5_value, &size);
+    }
+}
+
+size_t Checksum::Value(Algorithm algorithm, unsigned char *value) const
+{
+    // The 32-bit checksums are written out big-endian.
+    uint32_t word = 0;
+    switch (algorithm) {
+    case Adler32:
+        word = htonl(m_adler32);
+        break;
+    case CRC32C:
+        word = htonl(m_crc32c);
+        break;
+    case MD5:
+        memcpy(value, m_md5_value, sizeof(m_md5_value));
+        return sizeof(m_md5_value);
+    }
+    memcpy(value, &word, sizeof(word));
+    return sizeof(word);
+}
+
+bool Checksum::Verify(const std::string &digest, std::string &message) const
+{
+    std::stringstream ss(digest);
+    std::string instance;
+    while (std::getline(ss, instance, ',')) {
+        size_t found = instance.find('=');
+        if (found == std::string::npos) {continue;}
+        std::string name = Trim(instance.substr(0, found));
+        std::string remote_value = Trim(instance.substr(found + 1));
+        for (const auto &entry : g_algorithms) {
+            if (!(m_algorithms & entry.m_algorithm) || !NameIs(name, entry.m_name)) {continue;}
+            unsigned char value[16];
+            size_t size = Value(entry.m_algorithm, value);
+            std::string decoded;
+            if (!DecodeValue(remote_value, size, decoded) || memcmp(decoded.data(), value, size)) {
+                message = std::string("Checksum mismatch: ") + entry.m_name +
+                          " of the received data is " + EncodeValue(entry.m_algorithm, value, size) +
+                          " but the remote side reported " + remote_value;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+std::string Checksum::Digest() const
+{
+    std::string result;
+    for (const auto &entry : g_algorithms) {
+        if (!(m_algorithms & entry.m_algorithm)) {continue;}
+        unsigned char value[16];
+        size_t size = Value(entry.m_algorithm, value);
+        if (!result.empty()) {result += ",";}
+        result += std::string(entry.m_name) + "=" + EncodeValue(entry.m_algorithm, value, size);
+    }
+    return result;
+}
+
+bool Checksum::Store(int fd) const
+{
+    // The checksum manager only trusts a checksum computed after the last
+    // modification of the file, so it must be stored once all data is in.
+    struct stat buf;
+    if (fstat(fd, &buf)) {return false;}
+    time_t now = time(nullptr);
+    bool success = true;
+    for (const auto &entry : g_algorithms) {
+        if (!(m_algorithms & entry.m_algorithm)) {continue;}
+        unsigned char value[16];
+        size_t size = Value(entry.m_algorithm, value);
+        XrdCksData cks;
+        cks.Set(entry.m_name);
+        cks.Set(value, size);
+        // The checksum manager keeps these in network byte order.
+        cks.fmTime = htobe64(static_cast<uint64_t>(buf.st_mtime));
+        cks.csTime = htonl(static_cast<uint32_t>(now - buf.st_mtime));
+        std::string attr = std::string("user.XrdCks.") + entry.m_name;
+        if (fsetxattr(fd, attr.c_str(), &cks, sizeof(cks), 0)) {
+            success = false;
+        }
+    }
+    return success;
+}
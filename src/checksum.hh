@@ -0,0 +1,76 @@
+/**
+ * checksum.hh:
+ *
+ * Checksums of the data written by a pull, computed while the data passes
+ * through on its way to storage, so verifying a transfer does not require
+ * reading the destination back afterwards.
+ *
+ * The remote side is asked for its own checksums with a Want-Digest header
+ * and the Digest it answers with (RFC 3230) is compared against ours.  The
+ * result is then stored the way the XRootD checksum manager stores the
+ * checksums it calculates, so later checksum queries are answered without
+ * touching the data.
+ */
+
+#pragma once
+
+#include <string>
+
+#include <cstddef>
+#include <cstdint>
+
+struct evp_md_ctx_st;
+
+namespace TPC {
+
+class Checksum {
+public:
+    enum Algorithm {
+        Adler32 = 1,
+        CRC32C = 2,
+        MD5 = 4
+    };
+
+    // Parse a comma-separated list of algorithm names (e.g. "adler32,md5")
+    // into a mask of Algorithm values; returns false on an unknown name.
+    static bool ParseAlgorithms(const std::string &names, unsigned &algorithms);
+
+    // Value of the Want-Digest header asking for the given algorithms.
+    static std::string WantDigest(unsigned algorithms);
+
+    explicit Checksum(unsigned algorithms);
+    ~Checksum();
+
+    Checksum(const Checksum&) = delete;
+
+    // Data must be fed strictly in file order.
+    void Update(const char *data, size_t size);
+
+    // No more data follows; must be called before Verify or Store.
+    void Final();
+
+    // Compare against the value of the remote Digest header; algorithms we
+    // did not compute (or the remote did not send) are ignored.  Returns
+    // false, with a description in `message`, on a mismatch.
+    bool Verify(const std::string &digest, std::string &message) const;
+
+    // Our checksums in the form of a Digest header, e.g. "adler32=0a1b2c3d".
+    std::string Digest() const;
+
+    // Record the checksums in the extended attributes of the open file `fd`
+    // for the checksum manager; returns false if that is not possible.
+    bool Store(int fd) const;
+
+private:
+    // The raw value of `algorithm`; returns its length in bytes.
+    size_t Value(Algorithm algorithm, unsigned char *value) const;
+
+    unsigned m_algorithms;
+    bool m_final{false};
+    uint32_t m_adler32{1};
+    uint32_t m_crc32c{0};
+    struct evp_md_ctx_st *m_md5{nullptr};
+    unsigned char m_md5_value[16];
+};
+
+}
@@ -1,9 +1,23 @@
 
 #include "tpc.hh"
+#include "bufferpool.hh"
+#include "checksum.hh"
+#include "curlpool.hh"
+#include "engine.hh"
+#include "iopool.hh"
+#include "metrics.hh"
+#include "scheduler.hh"
+#include "trace.hh"
 
 #include <dlfcn.h>
 #include <fcntl.h>
+#include <unistd.h>
 
+#include <cctype>
+#include <sstream>
+#include <stdexcept>
+
+#include "XrdOuc/XrdOuca2x.hh"
 #include "XrdOuc/XrdOucStream.hh"
 #include "XrdOuc/XrdOucPinPath.hh"
 #include "XrdSfs/XrdSfsInterface.hh"
@@ -44,6 +58,67 @@ static XrdSfsFileSystem *load_sfs(void *handle, bool alt, XrdSysError &log, cons
 }
 
 
+static bool parse_number(XrdOucStream &Config, XrdSysError &log, const char *directive,
+                         long long min_val, long long max_val, long long &result) {
+    const char *val;
+    if (!(val = Config.GetWord())) {
+        log.Emsg("Config", directive, "value not specified");
+        return false;
+    }
+    return !XrdOuca2x::a2ll(log, directive, val, &result, min_val, max_val);
+}
+
+
+// Like parse_number, but accepts size suffixes (k, m, g, t).
+static bool parse_size(XrdOucStream &Config, XrdSysError &log, const char *directive,
+                       long long min_val, long long max_val, long long &result) {
+    const char *val;
+    if (!(val = Config.GetWord())) {
+        log.Emsg("Config", directive, "value not specified");
+        return false;
+    }
+    return !XrdOuca2x::a2sz(log, directive, val, &result, min_val, max_val);
+}
+
+
+static bool parse_bool(XrdOucStream &Config, XrdSysError &log, const char *directive,
+                       bool &result) {
+    const char *val;
+    if (!(val = Config.GetWord())) {
+        log.Emsg("Config", directive, "value not specified");
+        return false;
+    }
+    if (!strcmp("1", val) || !strcasecmp("yes", val) || !strcasecmp("true", val)) {
+        result = true;
+    } else if (!strcmp("0", val) || !strcasecmp("no", val) || !strcasecmp("false", val)) {
+        result = false;
+    } else {
+        log.Emsg("Config", directive, "value is invalid", val);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Parse the rest of the line as host name patterns (fnmatch, matched
+ * against lowercase names); at least one is required.
+ */
+static bool parse_hosts(XrdOucStream &Config, XrdSysError &log, const char *directive,
+                        std::vector<std::string> &hosts) {
+    const char *val;
+    if (!(val = Config.GetWord())) {
+        log.Emsg("Config", directive, "host pattern not specified");
+        return false;
+    }
+    do {
+        std::string pattern = val;
+        for (auto &c : pattern) {c = tolower(c);}
+        hosts.push_back(pattern);
+    } while ((val = Config.GetWord()));
+    return true;
+}
+
+
 bool TPCHandler::ConfigureFSLib(XrdOucStream &Config, std::string &path1, bool &path1_alt, std::string &path2, bool &path2_alt) {
     char *val;
     if (!(val = Config.GetWord())) {
@@ -100,6 +175,100 @@ bool TPCHandler::ConfigureFSLib(XrdOucStream &Config, std::string &path1, bool &
     return true;
 }
 
+/**
+ * Parse "tpc.limit host <pattern> [connections <n>] [rate <size>]", or the
+ * same with "path <prefix>", where the rate is in bytes per second.
+ */
+bool TPCHandler::ConfigureLimit(XrdOucStream &Config) {
+    char *val;
+    if (!(val = Config.GetWord()) || (strcmp("host", val) && strcmp("path", val))) {
+        m_log.Emsg("Config", "tpc.limit must be followed by host or path");
+        return false;
+    }
+    bool host = !strcmp("host", val);
+    if (!(val = Config.GetWord())) {
+        m_log.Emsg("Config", "tpc.limit", host ? "host pattern not specified" : "path not specified");
+        return false;
+    }
+    std::string pattern = val;
+    long long connections = 0, rate = 0;
+    while ((val = Config.GetWord())) {
+        if (!strcmp("connections", val)) {
+            if (!parse_number(Config, m_log, "tpc.limit connections", 0, 100000, connections)) {
+                return false;
+            }
+        } else if (!strcmp("rate", val)) {
+            if (!parse_size(Config, m_log, "tpc.limit rate", 0, -1, rate)) {
+                return false;
+            }
+        } else {
+            m_log.Emsg("Config", "tpc.limit has an unknown option:", val);
+            return false;
+        }
+    }
+    if (host) {
+        m_governor.AddHostRule(pattern, connections, rate);
+    } else {
+        m_governor.AddPathRule(pattern, connections, rate);
+    }
+    return true;
+}
+
+/**
+ * Parse "tpc.trace dir <directory> [sample <n>]", which writes the timeline
+ * of each traced transfer to a file in the directory, or "tpc.trace ring
+ * <path> [size <count>] [sample <n>] [allow <host pattern>...]", which
+ * serves the timelines of the last transfers traced at the given path (to
+ * clients on the allowed hosts).  One in every n transfers is traced.
+ */
+bool TPCHandler::ConfigureTrace(XrdOucStream &Config) {
+    char *val;
+    if (!(val = Config.GetWord()) || (strcmp("dir", val) && strcmp("ring", val))) {
+        m_log.Emsg("Config", "tpc.trace must be followed by dir or ring");
+        return false;
+    }
+    bool dir = !strcmp("dir", val);
+    if (!(val = Config.GetWord())) {
+        m_log.Emsg("Config", "tpc.trace", dir ? "directory not specified" : "path not specified");
+        return false;
+    }
+    if (dir) {
+        if (access(val, W_OK|X_OK)) {
+            m_log.Emsg("Config", errno, "use trace directory", val);
+            return false;
+        }
+        m_trace_dir = val;
+    } else {
+        if (*val != '/') {
+            m_log.Emsg("Config", "tpc.trace ring must be an absolute path:", val);
+            return false;
+        }
+        m_trace_path = val;
+    }
+    while ((val = Config.GetWord())) {
+        long long value;
+        if (!strcmp("sample", val)) {
+            if (!parse_number(Config, m_log, "tpc.trace sample", 1, 1000000, value)) {
+                return false;
+            }
+            m_trace_sample = value;
+        } else if (!dir && !strcmp("size", val)) {
+            if (!parse_number(Config, m_log, "tpc.trace size", 1, 100000, value)) {
+                return false;
+            }
+            m_trace_ring = value;
+        } else if (!dir && !strcmp("allow", val)) {
+            if (!parse_hosts(Config, m_log, "tpc.trace allow", m_trace_hosts)) {
+                return false;
+            }
+        } else {
+            m_log.Emsg("Config", "tpc.trace has an unknown option:", val);
+            return false;
+        }
+    }
+    return true;
+}
+
 bool TPCHandler::Configure(const char *configfn, XrdOucEnv *myEnv)
 {
     XrdOucStream Config(&m_log, getenv("XRDINSTANCE"), myEnv, "=====> ");
@@ -127,27 +296,185 @@ bool TPCHandler::Configure(const char *configfn, XrdOucEnv *myEnv)
                 m_log.Emsg("Config", "Chained library:", path2.c_str());
             }
         } else if (!strcmp("http.desthttps", val)) {
+            if (!parse_bool(Config, m_log, "http.desthttps", m_desthttps)) {
+                Config.Close();
+                return false;
+            }
+        } else if (!strcmp("http.cadir", val)) {
+            if (!(val = Config.GetWord())) {
+                Config.Close();
+                m_log.Emsg("Config", "http.cadir value not specified");
+                return false;
+            }
+            m_cadir = val;
+        } else if (!strcmp("tpc.engine_threads", val)) {
+            long long threads;
+            if (!parse_number(Config, m_log, "tpc.engine_threads", 1, 64, threads)) {
+                Config.Close();
+                return false;
+            }
+            m_engine_threads = threads;
+        } else if (!strcmp("tpc.buffer_memory", val)) {
+            long long bytes;
+            if (!parse_size(Config, m_log, "tpc.buffer_memory", m_block_size, -1, bytes)) {
+                Config.Close();
+                return false;
+            }
+            m_buffer_memory = bytes;
+        } else if (!strcmp("tpc.hugepages", val)) {
+            if (!parse_bool(Config, m_log, "tpc.hugepages", m_hugepages)) {
+                Config.Close();
+                return false;
+            }
+        } else if (!strcmp("tpc.io_threads", val)) {
+            long long threads;
+            if (!parse_number(Config, m_log, "tpc.io_threads", 1, 64, threads)) {
+                Config.Close();
+                return false;
+            }
+            m_io_threads = threads;
+        } else if (!strcmp("tpc.write_behind", val)) {
+            long long bytes;
+            if (!parse_size(Config, m_log, "tpc.write_behind", m_block_size, -1, bytes)) {
+                Config.Close();
+                return false;
+            }
+            m_write_behind = bytes;
+        } else if (!strcmp("tpc.read_ahead", val)) {
+            long long blocks;
+            if (!parse_number(Config, m_log, "tpc.read_ahead", 0, 64, blocks)) {
+                Config.Close();
+                return false;
+            }
+            m_read_ahead = blocks;
+        } else if (!strcmp("tpc.max_auto_streams", val)) {
+            long long streams;
+            if (!parse_number(Config, m_log, "tpc.max_auto_streams", 1, 100, streams)) {
+                Config.Close();
+                return false;
+            }
+            m_max_auto_streams = streams;
+        } else if (!strcmp("tpc.stripe_size", val)) {
+            long long bytes;
+            if (!parse_size(Config, m_log, "tpc.stripe_size", 0, m_block_size, bytes)) {
+                Config.Close();
+                return false;
+            }
+            m_stripe_size = bytes;
+        } else if (!strcmp("tpc.range_retries", val)) {
+            long long retries;
+            if (!parse_number(Config, m_log, "tpc.range_retries", 0, 20, retries)) {
+                Config.Close();
+                return false;
+            }
+            m_range_retries = retries;
+        } else if (!strcmp("tpc.push_streams", val)) {
+            if (!parse_hosts(Config, m_log, "tpc.push_streams", m_push_stream_hosts)) {
+                Config.Close();
+                return false;
+            }
+        } else if (!strcmp("tpc.mmap", val)) {
+            if (!parse_bool(Config, m_log, "tpc.mmap", m_mmap)) {
+                Config.Close();
+                return false;
+            }
+        } else if (!strcmp("tpc.journal_dir", val)) {
             if (!(val = Config.GetWord())) {
                 Config.Close();
-                m_log.Emsg("Config", "http.desthttps value not specified");
+                m_log.Emsg("Config", "tpc.journal_dir value not specified");
                 return false;
             }
-            if (!strcmp("1", val) || !strcasecmp("yes", val) || !strcasecmp("true", val)) {
-                m_desthttps = true;
-            } else if (!strcmp("0", val) || !strcasecmp("no", val) || !strcasecmp("false", val)) {
-                m_desthttps = false;
-            } else {
+            if (access(val, W_OK|X_OK)) {
                 Config.Close();
-                m_log.Emsg("Config", "https.desthttps value is invalid", val);
+                m_log.Emsg("Config", errno, "use journal directory", val);
                 return false;
             }
-        } else if (!strcmp("http.cadir", val)) {
+            m_journal_dir = val;
+        } else if (!strcmp("tpc.max_active_transfers", val)) {
+            long long count;
+            if (!parse_number(Config, m_log, "tpc.max_active_transfers", 0, 100000, count)) {
+                Config.Close();
+                return false;
+            }
+            m_max_active_transfers = count;
+        } else if (!strcmp("tpc.max_queued_transfers", val)) {
+            long long count;
+            if (!parse_number(Config, m_log, "tpc.max_queued_transfers", 0, 1000000, count)) {
+                Config.Close();
+                return false;
+            }
+            m_max_queued_transfers = count;
+        } else if (!strcmp("tpc.stage_timeout", val)) {
+            long long seconds;
+            if (!parse_number(Config, m_log, "tpc.stage_timeout", 0, 7*24*3600, seconds)) {
+                Config.Close();
+                return false;
+            }
+            m_stage_timeout = seconds;
+        } else if (!strcmp("tpc.max_stalled_opens", val)) {
+            long long count;
+            if (!parse_number(Config, m_log, "tpc.max_stalled_opens", 0, 100000, count)) {
+                Config.Close();
+                return false;
+            }
+            m_max_stalled_opens = count;
+        } else if (!strcmp("tpc.fairshare", val)) {
             if (!(val = Config.GetWord())) {
                 Config.Close();
-                m_log.Emsg("Config", "http.cadir value not specified");
+                m_log.Emsg("Config", "tpc.fairshare owner not specified");
+                return false;
+            }
+            std::string owner = val;
+            long long weight;
+            if (!parse_number(Config, m_log, "tpc.fairshare", 1, 10000, weight)) {
+                Config.Close();
+                return false;
+            }
+            m_fairshare[owner] = weight;
+        } else if (!strcmp("tpc.limit", val)) {
+            if (!ConfigureLimit(Config)) {
+                Config.Close();
+                return false;
+            }
+        } else if (!strcmp("tpc.trace", val)) {
+            if (!ConfigureTrace(Config)) {
+                Config.Close();
+                return false;
+            }
+        } else if (!strcmp("tpc.metrics", val)) {
+            if (!(val = Config.GetWord())) {
+                Config.Close();
+                m_log.Emsg("Config", "tpc.metrics value not specified");
+                return false;
+            }
+            if (*val != '/') {
+                Config.Close();
+                m_log.Emsg("Config", "tpc.metrics must be an absolute path:", val);
+                return false;
+            }
+            m_metrics_path = val;
+            if ((val = Config.GetWord())) {
+                if (strcmp("allow", val)) {
+                    Config.Close();
+                    m_log.Emsg("Config", "tpc.metrics has an unknown option:", val);
+                    return false;
+                }
+                if (!parse_hosts(Config, m_log, "tpc.metrics allow", m_metrics_hosts)) {
+                    Config.Close();
+                    return false;
+                }
+            }
+        } else if (!strcmp("tpc.checksum", val)) {
+            if (!(val = Config.GetWord())) {
+                Config.Close();
+                m_log.Emsg("Config", "tpc.checksum value not specified");
+                return false;
+            }
+            if (!Checksum::ParseAlgorithms(val, m_checksums)) {
+                Config.Close();
+                m_log.Emsg("Config", "tpc.checksum has an unknown algorithm:", val);
                 return false;
             }
-            m_cadir = val;
         }
     }
     Config.Close();
@@ -192,5 +519,27 @@ bool TPCHandler::Configure(const char *configfn, XrdOucEnv *myEnv)
     }
     m_sfs.reset(chained_sfs ? chained_sfs : base_sfs);
     m_log.Emsg("Config", "Successfully configured the filesystem object for TPC handler");
+
+    try {
+        m_metrics.reset(new Metrics());
+        m_pool.reset(new CurlPool());
+        m_buffer_pool.reset(new BufferPool(m_block_size, m_buffer_memory, m_hugepages));
+        m_io_pool.reset(new IOPool(m_io_threads));
+        m_engine.reset(new TransferEngine(m_log, m_engine_threads));
+        m_scheduler.reset(new Scheduler(m_max_active_transfers, m_max_queued_transfers, *m_metrics));
+        if (!m_trace_dir.empty() || !m_trace_path.empty()) {
+            m_tracer.reset(new Tracer(m_trace_dir, m_trace_path.empty() ? 0 : m_trace_ring, m_trace_sample));
+        }
+    } catch (std::runtime_error &re) {
+        m_log.Emsg("Config", "Failed to start the transfer engine:", re.what());
+        return false;
+    }
+    std::stringstream ss;
+    ss << "Started transfer engine with " << m_engine_threads << " event loop threads and "
+       << m_buffer_pool->Capacity() << " transfer buffers; " << m_io_threads << " I/O threads";
+    m_log.Emsg("Config", ss.str().c_str());
+    for (const auto &entry : m_fairshare) {
+        m_scheduler->SetWeight(entry.first, entry.second);
+    }
     return true;
 }
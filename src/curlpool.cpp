@@ -0,0 +1,118 @@
+
+#include "curlpool.hh"
+
+#include <functional>
+#include <stdexcept>
+
+using namespace TPC;
+
+
+CurlPool::CurlPool() :
+    m_share(curl_share_init())
+{
+    if (!m_share) {
+        throw std::runtime_error("Failed to initialize libcurl share handle");
+    }
+    curl_share_setopt(m_share, CURLSHOPT_LOCKFUNC, &CurlPool::LockCB);
+    curl_share_setopt(m_share, CURLSHOPT_UNLOCKFUNC, &CurlPool::UnlockCB);
+    curl_share_setopt(m_share, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+CurlPool::~CurlPool() {
+    for (auto &entry : m_idle) {
+        for (CURL *curl : entry.second) {
+            curl_easy_cleanup(curl);
+        }
+    }
+    // Any handles still in use at this point are leaked along with the
+    // share, as libcurl refuses to clean up a share that is in use.
+    if (m_endpoints.empty()) {
+        curl_share_cleanup(m_share);
+    }
+}
+
+/**
+ * Reduce a URL to the scheme and authority, which determines whether a
+ * connection can be reused.
+ */
+std::string CurlPool::EndpointKey(const std::string &url) {
+    auto scheme_end = url.find("://");
+    if (scheme_end == std::string::npos) {return url;}
+    auto path_start = url.find_first_of("/?#", scheme_end + 3);
+    return url.substr(0, path_start);
+}
+
+CURL *CurlPool::Get(const std::string &url) {
+    std::string key = EndpointKey(url);
+    CURL *curl = nullptr;
+    {
+        std::unique_lock<std::mutex> guard(m_mutex);
+        auto iter = m_idle.find(key);
+        if ((iter != m_idle.end()) && !iter->second.empty()) {
+            curl = iter->second.back();
+            iter->second.pop_back();
+            m_idle_count--;
+        }
+    }
+    if (curl) {
+        curl_easy_reset(curl);
+    } else if (!(curl = curl_easy_init())) {
+        return nullptr;
+    }
+    curl_easy_setopt(curl, CURLOPT_SHARE, m_share);
+
+    std::unique_lock<std::mutex> guard(m_mutex);
+    m_endpoints[curl] = key;
+    return curl;
+}
+
+CURL *CurlPool::Duplicate(CURL *curl) {
+    // The share handle is copied along with the other options.
+    CURL *dup = curl_easy_duphandle(curl);
+    if (!dup) {return nullptr;}
+
+    std::unique_lock<std::mutex> guard(m_mutex);
+    auto iter = m_endpoints.find(curl);
+    if (iter != m_endpoints.end()) {
+        m_endpoints[dup] = iter->second;
+    }
+    return dup;
+}
+
+void CurlPool::Put(CURL *curl) {
+    if (!curl) {return;}
+    {
+        std::unique_lock<std::mutex> guard(m_mutex);
+        auto iter = m_endpoints.find(curl);
+        if (iter != m_endpoints.end()) {
+            std::string key = std::move(iter->second);
+            m_endpoints.erase(iter);
+            auto &idle = m_idle[key];
+            if ((m_idle_count < m_max_idle) && (idle.size() < m_max_idle_per_endpoint)) {
+                idle.push_back(curl);
+                m_idle_count++;
+                return;
+            }
+        }
+    }
+    curl_easy_cleanup(curl);
+}
+
+size_t CurlPool::Affinity(CURL *curl) {
+    std::unique_lock<std::mutex> guard(m_mutex);
+    auto iter = m_endpoints.find(curl);
+    if (iter == m_endpoints.end()) {return 0;}
+    return std::hash<std::string>()(iter->second);
+}
+
+void CurlPool::LockCB(CURL *, curl_lock_data data, curl_lock_access, void *userptr) {
+    CurlPool *pool = static_cast<CurlPool*>(userptr);
+    pool->m_share_locks[data].lock();
+}
+
+void CurlPool::UnlockCB(CURL *, curl_lock_data data, void *userptr) {
+    CurlPool *pool = static_cast<CurlPool*>(userptr);
+    pool->m_share_locks[data].unlock();
+}
@@ -0,0 +1,68 @@
+/**
+ * curlpool.hh:
+ *
+ * Process-wide sharing of libcurl state between transfers.  All handles
+ * handed out by the pool share a DNS cache and TLS session cache; idle
+ * handles are kept around, keyed by remote endpoint, for reuse by the
+ * next transfer to the same site.
+ *
+ * libcurl does not support sharing a connection cache between threads;
+ * instead, each event loop's multi-handle keeps its connections alive
+ * across transfers and the engine routes transfers for the same endpoint
+ * to the same loop (see Affinity()).
+ */
+
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <curl/curl.h>
+
+namespace TPC {
+
+class CurlPool {
+public:
+    CurlPool();
+    ~CurlPool();
+
+    CurlPool(const CurlPool&) = delete;
+
+    // Returns a freshly-reset handle for the given URL, reusing an idle
+    // one for the same endpoint if available.  Returns nullptr on failure.
+    CURL *Get(const std::string &url);
+
+    // Duplicate an existing handle (including all its options) in a way
+    // that allows the copy to be returned to the pool later.
+    CURL *Duplicate(CURL *curl);
+
+    // Return a handle to the pool; it may be cleaned up immediately if
+    // the pool is full.
+    void Put(CURL *curl);
+
+    // A stable hash of the endpoint a handle was created for, used to route
+    // transfers to the event loop most likely to hold a warm connection.
+    size_t Affinity(CURL *curl);
+
+private:
+    static std::string EndpointKey(const std::string &url);
+
+    static void LockCB(CURL *handle, curl_lock_data data, curl_lock_access access,
+                       void *userptr);
+    static void UnlockCB(CURL *handle, curl_lock_data data, void *userptr);
+
+    static constexpr size_t m_max_idle_per_endpoint = 32;
+    static constexpr size_t m_max_idle = 512;
+
+    CURLSH *m_share{nullptr};
+    std::mutex m_share_locks[CURL_LOCK_DATA_LAST];
+
+    std::mutex m_mutex;
+    size_t m_idle_count{0};
+    std::unordered_map<std::string, std::vector<CURL *>> m_idle;  // Idle handles by endpoint.
+    std::unordered_map<CURL *, std::string> m_endpoints;  // Endpoint of each handle given out.
+};
+
+}
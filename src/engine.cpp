@@ -0,0 +1,412 @@
+
+#include "engine.hh"
+#include "metrics.hh"
+
+#include "XrdSys/XrdSysError.hh"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <stdexcept>
+
+using namespace TPC;
+
+// How often the loop invokes Transfer::Tick.
+static constexpr int g_tick_ms = 1000;
+
+// Idle connections each loop's multi-handle keeps for reuse by later transfers.
+static constexpr long g_max_idle_connections = 256;
+
+
+bool Transfer::WaitUntil(time_t deadline) {
+    std::unique_lock<std::mutex> guard(m_mutex);
+    auto tp = std::chrono::system_clock::from_time_t(deadline);
+    return m_cv.wait_until(guard, tp, [&]{return m_finished;});
+}
+
+void Transfer::Wait() {
+    std::unique_lock<std::mutex> guard(m_mutex);
+    m_cv.wait(guard, [&]{return m_finished;});
+}
+
+void Transfer::Cancel() {
+    if (m_cancel.exchange(true)) {return;}
+    std::unique_lock<std::mutex> guard(m_mutex);
+    if (m_loop && !m_finished) {
+        m_loop->m_pending_cancels++;
+        m_loop->Wake();
+    }
+}
+
+void Transfer::Notify() {
+    if (m_notify.exchange(true)) {return;}
+    std::unique_lock<std::mutex> guard(m_mutex);
+    if (m_loop && !m_finished) {
+        m_loop->m_pending_notifies++;
+        m_loop->Wake();
+    }
+}
+
+std::vector<StripeProgress> Transfer::GetProgress() {
+    std::unique_lock<std::mutex> guard(m_mutex);
+    return m_progress;
+}
+
+void Transfer::UpdateProgress() {
+    std::vector<StripeProgress> stripes;
+    Sample(stripes);
+    auto now = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> guard(m_mutex);
+    double elapsed = std::chrono::duration<double>(now - m_sampled).count();
+    for (size_t idx = 0; (idx < stripes.size()) && (idx < m_progress.size()); idx++) {
+        StripeProgress &stripe = stripes[idx];
+        if ((elapsed > 0) && (stripe.m_bytes >= m_progress[idx].m_bytes)) {
+            stripe.m_rate = (stripe.m_bytes - m_progress[idx].m_bytes) / elapsed;
+        }
+        // Between two requests a stream is not connected; keep reporting
+        // where it last went.
+        if (stripe.m_remote.empty()) {stripe.m_remote = m_progress[idx].m_remote;}
+    }
+    if (m_metrics) {
+        for (size_t idx = 0; idx < stripes.size(); idx++) {
+            off_t before = (idx < m_progress.size()) ? m_progress[idx].m_bytes : 0;
+            // An upload starting a request over rewinds its count.
+            if (stripes[idx].m_bytes > before) {
+                m_metrics->BytesMoved(m_push, stripes[idx].m_remote, stripes[idx].m_bytes - before);
+            }
+        }
+    }
+    m_progress = std::move(stripes);
+    m_sampled = now;
+}
+
+std::string Transfer::RemoteEndpoint(CURL *curl) {
+    char *ip = nullptr;
+    long port = 0;
+    if ((curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &ip) != CURLE_OK) || !ip || !*ip ||
+        (curl_easy_getinfo(curl, CURLINFO_PRIMARY_PORT, &port) != CURLE_OK) || !port)
+    {
+        return "";
+    }
+    std::string address(ip);
+    if (address.find(':') != std::string::npos) {
+        address = "[" + address + "]";
+    }
+    return address + ":" + std::to_string(port);
+}
+
+void Transfer::Finish(EventLoop &loop, CURLcode result, const std::string &msg) {
+    // Account for the bytes moved since the last sample.
+    UpdateProgress();
+    loop.Release(*this);
+    std::unique_lock<std::mutex> guard(m_mutex);
+    m_result = result;
+    m_message = msg;
+    m_finished = true;
+    m_cv.notify_all();
+}
+
+
+EventLoop::EventLoop(XrdSysError &log) :
+    m_log(log)
+{
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll_fd < 0) {
+        throw std::runtime_error("Failed to create epoll instance for transfer engine");
+    }
+    m_event_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (m_event_fd < 0) {
+        close(m_epoll_fd);
+        throw std::runtime_error("Failed to create eventfd for transfer engine");
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = m_event_fd;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_event_fd, &ev) < 0) {
+        close(m_event_fd);
+        close(m_epoll_fd);
+        throw std::runtime_error("Failed to register eventfd for transfer engine");
+    }
+    m_multi = curl_multi_init();
+    if (!m_multi) {
+        close(m_event_fd);
+        close(m_epoll_fd);
+        throw std::runtime_error("Failed to initialize a libcurl multi-handle");
+    }
+    curl_multi_setopt(m_multi, CURLMOPT_SOCKETFUNCTION, &EventLoop::SocketCB);
+    curl_multi_setopt(m_multi, CURLMOPT_SOCKETDATA, this);
+    curl_multi_setopt(m_multi, CURLMOPT_TIMERFUNCTION, &EventLoop::TimerCB);
+    curl_multi_setopt(m_multi, CURLMOPT_TIMERDATA, this);
+    curl_multi_setopt(m_multi, CURLMOPT_MAXCONNECTS, g_max_idle_connections);
+
+    m_thread = std::thread(&EventLoop::Run, this);
+}
+
+EventLoop::~EventLoop() {
+    m_shutdown = true;
+    Wake();
+    if (m_thread.joinable()) {m_thread.join();}
+    curl_multi_cleanup(m_multi);
+    close(m_event_fd);
+    close(m_epoll_fd);
+}
+
+void EventLoop::Submit(Transfer &xfer) {
+    m_active++;
+    Post([this, &xfer] {
+        {
+            std::unique_lock<std::mutex> guard(xfer.m_mutex);
+            xfer.m_loop = this;
+        }
+        m_transfers.insert(&xfer);
+        if (xfer.CancelRequested()) {
+            Fail(xfer, "Transfer cancelled");
+            return;
+        }
+        try {
+            xfer.Start(*this);
+        } catch (std::runtime_error &re) {
+            Fail(xfer, re.what());
+        }
+    });
+}
+
+void EventLoop::AddHandle(CURL *curl, Transfer &xfer) {
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, &xfer);
+    CURLMcode mres = curl_multi_add_handle(m_multi, curl);
+    if (mres) {
+        std::string msg = "Failed to add transfer to libcurl multi-handle: ";
+        msg += curl_multi_strerror(mres);
+        throw std::runtime_error(msg);
+    }
+}
+
+void EventLoop::RemoveHandle(CURL *curl) {
+    CURLMcode mres = curl_multi_remove_handle(m_multi, curl);
+    if (mres) {
+        std::string msg = "Failed to remove transfer from set: ";
+        msg += curl_multi_strerror(mres);
+        throw std::runtime_error(msg);
+    }
+}
+
+void EventLoop::Post(std::function<void()> func) {
+    {
+        std::unique_lock<std::mutex> guard(m_queue_mutex);
+        m_queue.emplace_back(std::move(func));
+    }
+    Wake();
+}
+
+void EventLoop::Wake() {
+    uint64_t val = 1;
+    while ((write(m_event_fd, &val, sizeof(val)) < 0) && (errno == EINTR)) {}
+}
+
+void EventLoop::RunPosted() {
+    uint64_t val;
+    while (read(m_event_fd, &val, sizeof(val)) > 0) {}
+
+    std::vector<std::function<void()>> queue;
+    {
+        std::unique_lock<std::mutex> guard(m_queue_mutex);
+        queue.swap(m_queue);
+    }
+    for (auto &func : queue) {
+        func();
+    }
+}
+
+void EventLoop::Release(Transfer &xfer) {
+    if (m_transfers.erase(&xfer)) {
+        m_active--;
+    }
+}
+
+void EventLoop::Fail(Transfer &xfer, const char *msg) {
+    try {
+        xfer.Abort(*this);
+    } catch (std::runtime_error &re) {
+        m_log.Emsg("EventLoop", "Failed to cleanly abort transfer:", re.what());
+    }
+    xfer.Finish(*this, CURLE_ABORTED_BY_CALLBACK, msg);
+}
+
+void EventLoop::ProcessCancels() {
+    if (!m_pending_cancels) {return;}
+    m_pending_cancels = 0;
+    std::vector<Transfer*> cancelled;
+    for (Transfer *xfer : m_transfers) {
+        if (xfer->CancelRequested()) {cancelled.push_back(xfer);}
+    }
+    for (Transfer *xfer : cancelled) {
+        Fail(*xfer, "Transfer cancelled");
+    }
+}
+
+void EventLoop::ProcessNotifications() {
+    if (!m_pending_notifies) {return;}
+    m_pending_notifies = 0;
+    std::vector<Transfer*> notified;
+    for (Transfer *xfer : m_transfers) {
+        if (xfer->m_notify.exchange(false)) {notified.push_back(xfer);}
+    }
+    for (Transfer *xfer : notified) {
+        if (!m_transfers.count(xfer)) {continue;}
+        try {
+            xfer->Notified(*this);
+        } catch (std::runtime_error &re) {
+            Fail(*xfer, re.what());
+        }
+    }
+}
+
+void EventLoop::ProcessMessages() {
+    CURLMsg *msg;
+    int msgq = 0;
+    while ((msg = curl_multi_info_read(m_multi, &msgq))) {
+        if (msg->msg != CURLMSG_DONE) {continue;}
+        CURL *curl = msg->easy_handle;
+        CURLcode res = msg->data.result;
+        Transfer *xfer = nullptr;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, &xfer);
+        if (!xfer || !m_transfers.count(xfer)) {
+            // Handle belongs to a transfer that already finished.
+            curl_multi_remove_handle(m_multi, curl);
+            continue;
+        }
+        try {
+            xfer->Done(*this, curl, res);
+        } catch (std::runtime_error &re) {
+            Fail(*xfer, re.what());
+        }
+    }
+}
+
+int EventLoop::SocketCB(CURL *, curl_socket_t sock, int what, void *userp, void *) {
+    EventLoop *loop = static_cast<EventLoop*>(userp);
+    if (what == CURL_POLL_REMOVE) {
+        epoll_ctl(loop->m_epoll_fd, EPOLL_CTL_DEL, sock, nullptr);
+        return 0;
+    }
+    struct epoll_event ev;
+    ev.events = 0;
+    if (what & CURL_POLL_IN) {ev.events |= EPOLLIN;}
+    if (what & CURL_POLL_OUT) {ev.events |= EPOLLOUT;}
+    ev.data.fd = sock;
+    if (epoll_ctl(loop->m_epoll_fd, EPOLL_CTL_MOD, sock, &ev) < 0) {
+        if ((errno != ENOENT) || (epoll_ctl(loop->m_epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0)) {
+            loop->m_log.Emsg("EventLoop", errno, "register socket with epoll");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int EventLoop::TimerCB(CURLM *, long timeout_ms, void *userp) {
+    EventLoop *loop = static_cast<EventLoop*>(userp);
+    if (timeout_ms < 0) {
+        loop->m_timer_set = false;
+    } else {
+        loop->m_timer_set = true;
+        loop->m_timer_deadline = std::chrono::steady_clock::now() +
+                                 std::chrono::milliseconds(timeout_ms);
+    }
+    return 0;
+}
+
+void EventLoop::Run() {
+    static constexpr int max_events = 64;
+    struct epoll_event events[max_events];
+    auto next_tick = std::chrono::steady_clock::now() + std::chrono::milliseconds(g_tick_ms);
+    int running_handles = 0;
+
+    while (!m_shutdown) {
+        auto now = std::chrono::steady_clock::now();
+        auto wake_at = next_tick;
+        if (m_timer_set && m_timer_deadline < wake_at) {wake_at = m_timer_deadline;}
+        int timeout = 0;
+        if (wake_at > now) {
+            // Round up so we do not spin on sub-millisecond timeouts.
+            timeout = std::chrono::duration_cast<std::chrono::milliseconds>(wake_at - now).count() + 1;
+        }
+
+        int nfds = epoll_wait(m_epoll_fd, events, max_events, timeout);
+        if (nfds < 0) {
+            if (errno != EINTR) {
+                m_log.Emsg("EventLoop", errno, "wait for socket activity");
+            }
+            nfds = 0;
+        }
+        for (int idx = 0; idx < nfds; idx++) {
+            int fd = events[idx].data.fd;
+            if (fd == m_event_fd) {
+                RunPosted();
+                continue;
+            }
+            int mask = 0;
+            if (events[idx].events & EPOLLIN) {mask |= CURL_CSELECT_IN;}
+            if (events[idx].events & EPOLLOUT) {mask |= CURL_CSELECT_OUT;}
+            if (events[idx].events & (EPOLLERR|EPOLLHUP)) {mask |= CURL_CSELECT_ERR;}
+            curl_multi_socket_action(m_multi, fd, mask, &running_handles);
+        }
+
+        now = std::chrono::steady_clock::now();
+        if (m_timer_set && now >= m_timer_deadline) {
+            m_timer_set = false;
+            curl_multi_socket_action(m_multi, CURL_SOCKET_TIMEOUT, 0, &running_handles);
+        }
+        ProcessMessages();
+        ProcessNotifications();
+        ProcessCancels();
+
+        if (now >= next_tick) {
+            next_tick = now + std::chrono::milliseconds(g_tick_ms);
+            std::vector<Transfer*> xfers(m_transfers.begin(), m_transfers.end());
+            for (Transfer *xfer : xfers) {
+                // A prior Tick may have finished (and released) a transfer.
+                if (!m_transfers.count(xfer)) {continue;}
+                try {
+                    xfer->Tick(*this);
+                    if (m_transfers.count(xfer)) {xfer->UpdateProgress();}
+                } catch (std::runtime_error &re) {
+                    Fail(*xfer, re.what());
+                }
+            }
+        }
+    }
+
+    // Any transfers remaining at shutdown are failed so the waiting threads
+    // are released.
+    RunPosted();
+    std::vector<Transfer*> remaining(m_transfers.begin(), m_transfers.end());
+    for (Transfer *xfer : remaining) {
+        Fail(*xfer, "Transfer engine shutting down");
+    }
+}
+
+
+TransferEngine::TransferEngine(XrdSysError &log, unsigned threads)
+{
+    if (!threads) {threads = 1;}
+    m_loops.reserve(threads);
+    for (unsigned idx = 0; idx < threads; idx++) {
+        m_loops.emplace_back(new EventLoop(log));
+    }
+}
+
+void TransferEngine::Submit(Transfer &xfer, size_t affinity) {
+    EventLoop *preferred = m_loops[affinity % m_loops.size()].get();
+    EventLoop *best = preferred;
+    for (auto &loop : m_loops) {
+        if (loop->ActiveTransfers() < best->ActiveTransfers()) {
+            best = loop.get();
+        }
+    }
+    if (preferred->ActiveTransfers() <= best->ActiveTransfers() + m_affinity_slack) {
+        best = preferred;
+    }
+    best->Submit(xfer);
+}
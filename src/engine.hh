@@ -0,0 +1,206 @@
+/**
+ * engine.hh:
+ *
+ * A process-wide transfer engine.  Rather than each COPY request spinning
+ * its own libcurl multi-handle on an XrdHttp worker thread, all transfers
+ * are driven by a small pool of event loop threads using
+ * curl_multi_socket_action and epoll.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <curl/curl.h>
+
+class XrdSysError;
+
+namespace TPC {
+class EventLoop;
+class Metrics;
+class Trace;
+
+// Progress of one stream of a transfer, as reported in the perf markers.
+struct StripeProgress {
+    off_t m_bytes{0};  // Bytes received (or sent) by this stream so far.
+    off_t m_rate{0};  // Bytes per second since the previous sample.
+    std::string m_remote;  // Remote "ip:port" of its connection; empty if unknown.
+};
+
+/**
+ * A single unit of work driven by the engine.  All the virtual methods
+ * are invoked from the thread of the event loop that owns the transfer;
+ * the remaining public methods are safe to use from the thread that
+ * submitted the transfer.
+ */
+class Transfer {
+public:
+    Transfer() {}
+    virtual ~Transfer() {}
+
+    Transfer(const Transfer&) = delete;
+
+    // Add the initial set of curl handles to the loop.
+    virtual void Start(EventLoop &loop) = 0;
+
+    // Invoked whenever one of the transfer's curl handles completes.
+    virtual void Done(EventLoop &loop, CURL *curl, CURLcode result) = 0;
+
+    // Remove all active curl handles from the loop; invoked on cancellation
+    // or when the transfer throws an exception.
+    virtual void Abort(EventLoop &loop) = 0;
+
+    // Invoked roughly once a second while the transfer is active.
+    virtual void Tick(EventLoop &) {}
+
+    // Invoked on the loop thread some time after Notify() is called.
+    virtual void Notified(EventLoop &) {}
+
+    // Fill in the bytes moved by, and the remote end of, each stream; used
+    // for the perf markers.  Invoked roughly once a second, after Tick.
+    virtual void Sample(std::vector<StripeProgress> &stripes) = 0;
+
+    // Block until the transfer is finished or the deadline passes.  Returns
+    // true if the transfer is finished.
+    bool WaitUntil(time_t deadline);
+    void Wait();
+
+    // Request the owning loop stop the transfer; use Wait() afterward to
+    // know when the loop has released it.
+    void Cancel();
+
+    bool CancelRequested() const {return m_cancel;}
+
+    // Progress of each stream as of the last sample.
+    std::vector<StripeProgress> GetProgress();
+
+    // Account the bytes moved by the transfer (and its per-request
+    // statistics) in `metrics`.  Must be called before the transfer starts.
+    void SetMetrics(Metrics *metrics, bool push) {m_metrics = metrics; m_push = push;}
+
+    // Record the phases of each request in `trace` (if not null).  Must be
+    // called before the transfer starts.
+    void SetTrace(Trace *trace) {m_trace = trace;}
+
+    // Ask the owning loop to invoke Notified(); safe from any thread as
+    // long as the transfer object is alive.
+    void Notify();
+
+    // Valid only after the transfer is finished.
+    CURLcode GetResult() const {return m_result;}
+    const std::string &GetMessage() const {return m_message;}
+
+protected:
+    // Mark the transfer as finished and wake up the waiting thread.  After
+    // this is invoked, the loop no longer references the transfer, and the
+    // object may be destroyed at any time.
+    void Finish(EventLoop &loop, CURLcode result, const std::string &msg = "");
+
+    // The remote "ip:port" a handle is connected to; empty if unknown.
+    static std::string RemoteEndpoint(CURL *curl);
+
+    Metrics *GetMetrics() const {return m_metrics;}
+    Trace *GetTrace() const {return m_trace;}
+    bool IsPush() const {return m_push;}
+
+private:
+    friend class EventLoop;
+
+    // Take a new sample and work out each stream's throughput since the last.
+    void UpdateProgress();
+
+    EventLoop *m_loop{nullptr};
+    std::atomic<bool> m_cancel{false};
+    std::atomic<bool> m_notify{false};
+    bool m_finished{false};
+    CURLcode m_result{CURLE_OK};
+    std::string m_message;
+    Metrics *m_metrics{nullptr};
+    Trace *m_trace{nullptr};
+    bool m_push{false};
+    std::vector<StripeProgress> m_progress;  // Protected by m_mutex.
+    std::chrono::steady_clock::time_point m_sampled;  // When m_progress was taken.
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+};
+
+
+class EventLoop {
+public:
+    EventLoop(XrdSysError &log);
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+
+    // Hand a transfer over to this loop; safe from any thread.
+    void Submit(Transfer &xfer);
+
+    // Number of transfers currently owned by this loop.
+    size_t ActiveTransfers() const {return m_active;}
+
+    // The remaining methods must only be invoked from the loop thread.
+    void AddHandle(CURL *curl, Transfer &xfer);
+    void RemoveHandle(CURL *curl);
+
+private:
+    friend class Transfer;
+
+    void Run();
+    void Post(std::function<void()> func);
+    void Wake();
+    void RunPosted();
+    void ProcessCancels();
+    void ProcessNotifications();
+    void ProcessMessages();
+    void Release(Transfer &xfer);
+    void Fail(Transfer &xfer, const char *msg);
+
+    static int SocketCB(CURL *easy, curl_socket_t sock, int what, void *userp, void *socketp);
+    static int TimerCB(CURLM *multi, long timeout_ms, void *userp);
+
+    XrdSysError &m_log;
+    int m_epoll_fd{-1};
+    int m_event_fd{-1};
+    CURLM *m_multi{nullptr};
+    bool m_timer_set{false};
+    std::chrono::steady_clock::time_point m_timer_deadline;
+    std::atomic<bool> m_shutdown{false};
+    std::atomic<size_t> m_active{0};
+    std::atomic<unsigned> m_pending_cancels{0};
+    std::atomic<unsigned> m_pending_notifies{0};
+    std::unordered_set<Transfer*> m_transfers;
+    std::mutex m_queue_mutex;
+    std::vector<std::function<void()>> m_queue;
+    std::thread m_thread;
+};
+
+
+class TransferEngine {
+public:
+    TransferEngine(XrdSysError &log, unsigned threads);
+
+    TransferEngine(const TransferEngine&) = delete;
+
+    // Assign the transfer to an event loop.  Transfers with the same
+    // affinity go to the same loop (and hence can reuse its connections)
+    // unless that loop is noticeably busier than the others.
+    void Submit(Transfer &xfer, size_t affinity = 0);
+
+private:
+    static constexpr size_t m_affinity_slack = 4;
+
+    std::vector<std::unique_ptr<EventLoop>> m_loops;
+};
+}
@@ -0,0 +1,133 @@
+
+#include "governor.hh"
+
+#include <cctype>
+
+#include <fnmatch.h>
+
+using namespace TPC;
+
+
+Limit::Limit(unsigned max_connections, uint64_t rate) :
+    m_max_connections(max_connections),
+    m_rate(rate),
+    m_tokens(static_cast<double>(rate)),
+    m_refilled(std::chrono::steady_clock::now())
+{}
+
+bool Limit::AcquireConnection()
+{
+    if (!m_max_connections) {return true;}
+    unsigned connections = m_connections.load();
+    do {
+        if (connections >= m_max_connections) {return false;}
+    } while (!m_connections.compare_exchange_weak(connections, connections + 1));
+    return true;
+}
+
+void Limit::ReleaseConnection()
+{
+    if (m_max_connections) {m_connections--;}
+}
+
+bool Limit::HasBudget()
+{
+    if (!m_rate) {return true;}
+    std::unique_lock<std::mutex> guard(m_mutex);
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - m_refilled).count();
+    m_refilled = now;
+    m_tokens += elapsed * m_rate;
+    if (m_tokens > m_rate) {m_tokens = m_rate;}
+    return m_tokens > 0;
+}
+
+void Limit::Consume(size_t bytes)
+{
+    if (!m_rate) {return;}
+    std::unique_lock<std::mutex> guard(m_mutex);
+    m_tokens -= bytes;
+}
+
+
+void Governor::AddHostRule(const std::string &pattern, unsigned max_connections, uint64_t rate)
+{
+    std::string lower;
+    for (char c : pattern) {lower += tolower(c);}
+    m_host_rules.push_back(Rule{lower, max_connections, rate, nullptr});
+}
+
+void Governor::AddPathRule(const std::string &prefix, unsigned max_connections, uint64_t rate)
+{
+    std::string path = prefix;
+    while ((path.size() > 1) && (path[path.size() - 1] == '/')) {path.erase(path.size() - 1);}
+    std::shared_ptr<Limit> limit(new Limit(max_connections, rate));
+    m_path_rules.push_back(Rule{path, max_connections, rate, limit});
+}
+
+std::string Governor::Host(const std::string &url)
+{
+    size_t start = url.find("://");
+    start = (start == std::string::npos) ? 0 : start + 3;
+    size_t end = url.find_first_of("/?#", start);
+    std::string authority = url.substr(start, (end == std::string::npos) ? std::string::npos : end - start);
+    size_t at = authority.rfind('@');
+    if (at != std::string::npos) {authority = authority.substr(at + 1);}
+    std::string host;
+    if (!authority.empty() && (authority[0] == '[')) {
+        size_t bracket = authority.find(']');
+        host = authority.substr(1, (bracket == std::string::npos) ? std::string::npos : bracket - 1);
+    } else {
+        host = authority.substr(0, authority.find(':'));
+    }
+    for (auto &c : host) {c = tolower(c);}
+    return host;
+}
+
+std::shared_ptr<Limit> Governor::ForURL(const std::string &url)
+{
+    if (m_host_rules.empty()) {return nullptr;}
+    std::string host = Host(url);
+    const Rule *rule = nullptr;
+    for (const auto &candidate : m_host_rules) {
+        if (!fnmatch(candidate.m_pattern.c_str(), host.c_str(), 0)) {
+            rule = &candidate;
+            break;
+        }
+    }
+    if (!rule) {return nullptr;}
+
+    std::unique_lock<std::mutex> guard(m_mutex);
+    auto iter = m_hosts.find(host);
+    std::shared_ptr<Limit> limit;
+    if (iter != m_hosts.end()) {
+        limit = iter->second.lock();
+    }
+    if (!limit) {
+        // Drop the hosts nobody is transferring with any more.
+        for (auto entry = m_hosts.begin(); entry != m_hosts.end();) {
+            if (entry->second.expired()) {
+                entry = m_hosts.erase(entry);
+            } else {
+                ++entry;
+            }
+        }
+        limit.reset(new Limit(rule->m_max_connections, rule->m_rate));
+        m_hosts[host] = limit;
+    }
+    return limit;
+}
+
+std::shared_ptr<Limit> Governor::ForPath(const std::string &path) const
+{
+    for (const auto &rule : m_path_rules) {
+        const std::string &prefix = rule.m_pattern;
+        if (!path.compare(0, prefix.size(), prefix) &&
+            ((path.size() == prefix.size()) || (path[prefix.size()] == '/') ||
+             (prefix[prefix.size() - 1] == '/')))
+        {
+            return rule.m_limit;
+        }
+    }
+    return nullptr;
+}
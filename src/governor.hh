@@ -0,0 +1,100 @@
+/**
+ * governor.hh:
+ *
+ * Server-wide limits on what all transfers together may do to one remote
+ * host or one local filesystem: how many connections (or, locally, streams)
+ * they may have open at once, and how many bytes per second they may move.
+ *
+ * Without these, many pulls from one overloaded site all compete blindly,
+ * and may trip the site's own connection limits, causing retries that make
+ * matters worse.  Limits are configured by host pattern (tpc.limit host) or
+ * by path prefix (tpc.limit path).  Transfers waiting for a connection do
+ * not start their next request; transfers over their bandwidth budget pause
+ * their curl handle until the budget is refilled.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+namespace TPC {
+
+/**
+ * The connection slots and token bucket shared by all transfers to one
+ * remote host (or from one local path prefix).  Safe from any thread.
+ */
+class Limit {
+public:
+    // At most `max_connections` connections at once and `rate` bytes per
+    // second; 0 means no limit for either.
+    Limit(unsigned max_connections, uint64_t rate);
+
+    Limit(const Limit&) = delete;
+
+    // Claim a connection slot; returns false if all are taken.
+    bool AcquireConnection();
+    void ReleaseConnection();
+
+    // Whether data may be moved right now.  The bucket holds up to one
+    // second's worth of bytes; a transfer may overdraw it with its last
+    // write, and must then pause until it is refilled.
+    bool HasBudget();
+    void Consume(size_t bytes);
+
+private:
+    const unsigned m_max_connections;
+    const uint64_t m_rate;
+    std::atomic<unsigned> m_connections{0};
+
+    std::mutex m_mutex;
+    double m_tokens;  // In bytes; negative when overdrawn.
+    std::chrono::steady_clock::time_point m_refilled;
+};
+
+class Governor {
+public:
+    Governor() {}
+
+    Governor(const Governor&) = delete;
+
+    // Each remote host matching `pattern` (shell wildcards, e.g.
+    // "*.example.org") gets a limit of its own.  Rules are tried in the
+    // order they were added; the first match wins.
+    void AddHostRule(const std::string &pattern, unsigned max_connections, uint64_t rate);
+
+    // All local files under `prefix` share a single limit.
+    void AddPathRule(const std::string &prefix, unsigned max_connections, uint64_t rate);
+
+    // The limit of the host in `url`, or of the local `path`; nullptr if
+    // no rule applies.
+    std::shared_ptr<Limit> ForURL(const std::string &url);
+    std::shared_ptr<Limit> ForPath(const std::string &path) const;
+
+    // Hostname part of a URL, in lower case.
+    static std::string Host(const std::string &url);
+
+private:
+    struct Rule {
+        std::string m_pattern;
+        unsigned m_max_connections;
+        uint64_t m_rate;
+        std::shared_ptr<Limit> m_limit;  // Path rules only.
+    };
+
+    std::vector<Rule> m_host_rules;
+    std::vector<Rule> m_path_rules;
+
+    // Host limits live as long as some transfer holds them.
+    std::mutex m_mutex;
+    std::map<std::string, std::weak_ptr<Limit>> m_hosts;
+};
+
+}
@@ -0,0 +1,48 @@
+
+#include "iopool.hh"
+
+using namespace TPC;
+
+
+IOPool::IOPool(unsigned threads)
+{
+    if (!threads) {threads = 1;}
+    m_threads.reserve(threads);
+    for (unsigned idx = 0; idx < threads; idx++) {
+        m_threads.emplace_back(&IOPool::Run, this);
+    }
+}
+
+IOPool::~IOPool() {
+    {
+        std::unique_lock<std::mutex> guard(m_mutex);
+        m_shutdown = true;
+    }
+    m_cv.notify_all();
+    for (auto &thread : m_threads) {
+        thread.join();
+    }
+}
+
+void IOPool::Submit(std::function<void()> task) {
+    {
+        std::unique_lock<std::mutex> guard(m_mutex);
+        m_queue.emplace_back(std::move(task));
+    }
+    m_cv.notify_one();
+}
+
+void IOPool::Run() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> guard(m_mutex);
+            m_cv.wait(guard, [&]{return m_shutdown || !m_queue.empty();});
+            // Pending tasks are always run so no stream is left waiting.
+            if (m_queue.empty()) {return;}
+            task = std::move(m_queue.front());
+            m_queue.pop_front();
+        }
+        task();
+    }
+}
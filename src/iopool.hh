@@ -0,0 +1,39 @@
+/**
+ * iopool.hh:
+ *
+ * A small pool of threads dedicated to local storage I/O, so slow
+ * XrdSfsFile operations never run on the event loop threads.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace TPC {
+
+class IOPool {
+public:
+    IOPool(unsigned threads);
+    ~IOPool();
+
+    IOPool(const IOPool&) = delete;
+
+    // Run the task on one of the I/O threads.
+    void Submit(std::function<void()> task);
+
+private:
+    void Run();
+
+    bool m_shutdown{false};
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::function<void()>> m_queue;
+    std::vector<std::thread> m_threads;
+};
+
+}
@@ -0,0 +1,162 @@
+
+#include "journal.hh"
+
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <sstream>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+using namespace TPC;
+
+
+namespace {
+
+// A weak ETag does not promise byte-for-byte equality, so it cannot
+// vouch for data fetched by an earlier attempt.
+std::string StrongETag(const std::string &etag)
+{
+    return etag.compare(0, 2, "W/") ? etag : std::string();
+}
+
+bool WriteAll(int fd, const std::string &data)
+{
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t retval = write(fd, data.data() + written, data.size() - written);
+        if (retval < 0) {
+            if (errno == EINTR) {continue;}
+            return false;
+        }
+        written += retval;
+    }
+    return true;
+}
+
+}
+
+
+Journal::Journal(const std::string &dir, const std::string &source,
+                 const std::string &destination) :
+    m_source(source),
+    m_destination(destination)
+{
+    // The journal itself records the source and destination, so a hash
+    // collision is detected when it is read back.
+    std::stringstream ss;
+    ss << dir << "/" << std::hex << std::hash<std::string>()(source + "\n" + destination)
+       << ".journal";
+    m_path = ss.str();
+}
+
+Journal::~Journal()
+{
+    if (m_fd >= 0) {close(m_fd);}
+}
+
+bool Journal::Exists() const
+{
+    return !access(m_path.c_str(), F_OK);
+}
+
+off_t Journal::Load(off_t size, const std::string &etag, const std::string &last_modified) const
+{
+    std::ifstream input(m_path);
+    std::string line;
+    std::string source, destination, old_etag, old_last_modified;
+    off_t old_size = -1, written = 0;
+    while (std::getline(input, line)) {
+        size_t found = line.find(' ');
+        if (found == std::string::npos) {continue;}
+        std::string key = line.substr(0, found);
+        std::string value = line.substr(found + 1);
+        if (key == "source") {source = value;}
+        else if (key == "destination") {destination = value;}
+        else if (key == "etag") {old_etag = value;}
+        else if (key == "last-modified") {old_last_modified = value;}
+        else if ((key == "size") || (key == "written")) {
+            char *end = nullptr;
+            long long number = strtoll(value.c_str(), &end, 10);
+            if (!end || *end || (number < 0)) {return 0;}
+            if (key == "size") {old_size = number;}
+            else if (number > written) {written = number;}
+        }
+    }
+    if ((source != m_source) || (destination != m_destination) || (old_size != size)) {
+        return 0;
+    }
+    // Without a validator there is no telling whether the source changed.
+    if (etag.empty() && last_modified.empty()) {
+        return 0;
+    }
+    if ((etag != old_etag) || (last_modified != old_last_modified)) {
+        return 0;
+    }
+    return (written <= size) ? written : 0;
+}
+
+off_t Journal::Start(off_t size, const std::string &etag, const std::string &last_modified,
+                     off_t local_size)
+{
+    off_t offset = Exists() ? Load(size, StrongETag(etag), last_modified) : 0;
+    // The prefix recorded is no longer (all) there.
+    if (offset > local_size) {
+        offset = 0;
+    }
+    return Create(size, etag, last_modified, offset) ? offset : 0;
+}
+
+bool Journal::Create(off_t size, const std::string &etag, const std::string &last_modified,
+                     off_t offset)
+{
+    // Replace the old journal atomically, so a crash leaves one or the other.
+    std::stringstream ss;
+    ss << "source " << m_source << "\n"
+       << "destination " << m_destination << "\n"
+       << "size " << size << "\n"
+       << "etag " << StrongETag(etag) << "\n"
+       << "last-modified " << last_modified << "\n";
+    if (offset) {
+        ss << "written " << offset << "\n";
+    }
+    std::string tmp_path = m_path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    if (!WriteAll(fd, ss.str()) || fsync(fd) || rename(tmp_path.c_str(), m_path.c_str())) {
+        close(fd);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    std::unique_lock<std::mutex> guard(m_mutex);
+    if (m_fd >= 0) {close(m_fd);}
+    m_fd = fd;
+    return true;
+}
+
+void Journal::Record(off_t offset)
+{
+    std::unique_lock<std::mutex> guard(m_mutex);
+    if (m_fd < 0) {return;}
+    std::stringstream ss;
+    ss << "written " << offset << "\n";
+    // A record that does not make it to disk only costs a refetch.
+    if (WriteAll(m_fd, ss.str())) {
+        fdatasync(m_fd);
+    }
+}
+
+void Journal::Remove()
+{
+    std::unique_lock<std::mutex> guard(m_mutex);
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+    unlink(m_path.c_str());
+}
@@ -0,0 +1,76 @@
+/**
+ * journal.hh:
+ *
+ * Records how much of a multi-stream pull has been durably written to the
+ * destination, so a retried COPY of the same source to the same destination
+ * can fetch only the data that is still missing.
+ *
+ * The stream writes to the file strictly in order, so the durable part of
+ * the file is always a prefix; the journal stores the source's size and
+ * validators (ETag and Last-Modified) followed by the growing length of
+ * that prefix.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <string>
+
+#include <sys/types.h>
+
+namespace TPC {
+
+class Journal {
+public:
+    // Journal (kept in directory `dir`) for the transfer of the URL `source`
+    // to the local path `destination`.
+    Journal(const std::string &dir, const std::string &source, const std::string &destination);
+    ~Journal();
+
+    Journal(const Journal&) = delete;
+
+    // Whether an earlier attempt left a journal behind; if so, the
+    // destination should not be truncated when it is opened.
+    bool Exists() const;
+
+    // Validate the earlier journal, if any, against the current size and
+    // validators of the source, and against the `local_size` of the
+    // destination (which may have been truncated or replaced since), and
+    // begin a new journal for this attempt.  Returns the number of bytes at
+    // the start of the destination that need not be fetched again (0 if the
+    // journal does not match).
+    off_t Start(off_t size, const std::string &etag, const std::string &last_modified,
+                off_t local_size);
+
+    // Begin a journal for this attempt from scratch, replacing any earlier
+    // one; the first `offset` bytes of the destination are already durable.
+    bool Create(off_t size, const std::string &etag, const std::string &last_modified,
+                off_t offset=0);
+
+    // Whether a journal was created for this attempt.
+    bool Active() const {
+        std::unique_lock<std::mutex> guard(m_mutex);
+        return m_fd >= 0;
+    }
+
+    // The first `offset` bytes of the destination are on stable storage.
+    // Safe from any thread, as are Create and Remove; an offset recorded
+    // before Create is lost, which only costs a refetch.
+    void Record(off_t offset);
+
+    // The transfer succeeded; the journal is no longer needed.
+    void Remove();
+
+private:
+    // Read back the earlier journal; returns the durable prefix it
+    // recorded for a source of the given size and validators, or 0.
+    off_t Load(off_t size, const std::string &etag, const std::string &last_modified) const;
+
+    std::string m_path;
+    std::string m_source;
+    std::string m_destination;
+    int m_fd{-1};  // Protected by m_mutex.
+    mutable std::mutex m_mutex;
+};
+
+}
@@ -0,0 +1,183 @@
+
+#include "metrics.hh"
+#include "bufferpool.hh"
+
+#include <sstream>
+
+using namespace TPC;
+
+
+namespace {
+
+const char *g_direction[] = {"pull", "push"};
+
+// Label values must escape backslashes, quotes and newlines.
+std::string EscapeLabel(const std::string &value)
+{
+    std::string result;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {result += '\\';}
+        if (c == '\n') {result += "\\n"; continue;}
+        result += c;
+    }
+    return result;
+}
+
+std::string FormatDouble(double value)
+{
+    std::stringstream ss;
+    ss << value;
+    return ss.str();
+}
+
+void Header(std::string &out, const char *name, const char *type, const char *help)
+{
+    out += std::string("# HELP ") + name + " " + help + "\n";
+    out += std::string("# TYPE ") + name + " " + type + "\n";
+}
+
+template <typename T>
+void Sample(std::string &out, const char *name, const std::string &labels, T value)
+{
+    out += name;
+    if (!labels.empty()) {out += "{" + labels + "}";}
+    out += " " + std::to_string(value) + "\n";
+}
+
+// The host part of "ip:port" or "[ip]:port".
+std::string RemoteHost(const std::string &remote)
+{
+    size_t colon = remote.rfind(':');
+    std::string host = (colon == std::string::npos) ? remote : remote.substr(0, colon);
+    if ((host.size() > 1) && (host[0] == '[') && (host[host.size() - 1] == ']')) {
+        host = host.substr(1, host.size() - 2);
+    }
+    return host;
+}
+
+}
+
+
+Histogram::Histogram(std::vector<double> bounds) :
+    m_bounds(std::move(bounds)),
+    m_buckets(new std::atomic<uint64_t>[m_bounds.size() + 1])
+{
+    for (size_t idx = 0; idx <= m_bounds.size(); idx++) {
+        m_buckets[idx] = 0;
+    }
+}
+
+void Histogram::Observe(double value)
+{
+    size_t idx = 0;
+    while ((idx < m_bounds.size()) && (value > m_bounds[idx])) {idx++;}
+    m_buckets[idx].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    if (value > 0) {
+        m_sum.fetch_add(static_cast<uint64_t>(value * 1e6), std::memory_order_relaxed);
+    }
+}
+
+void Histogram::Render(std::string &out, const char *name, const char *help) const
+{
+    Header(out, name, "histogram", help);
+    std::string bucket = std::string(name) + "_bucket";
+    uint64_t cumulative = 0;
+    for (size_t idx = 0; idx <= m_bounds.size(); idx++) {
+        cumulative += m_buckets[idx].load(std::memory_order_relaxed);
+        std::string le = (idx < m_bounds.size()) ? FormatDouble(m_bounds[idx]) : "+Inf";
+        Sample(out, bucket.c_str(), "le=\"" + le + "\"", cumulative);
+    }
+    // Read separately from the buckets, so a scrape racing with updates may
+    // be off by a few observations; Prometheus tolerates that.
+    out += std::string(name) + "_sum " +
+           FormatDouble(m_sum.load(std::memory_order_relaxed) / 1e6) + "\n";
+    Sample(out, (std::string(name) + "_count").c_str(), "", m_count.load(std::memory_order_relaxed));
+}
+
+
+Metrics::Metrics() :
+    m_range_duration({0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 300}),
+    m_range_first_byte({0.001, 0.005, 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10}),
+    m_reorder_available({0, 1, 2, 4, 8, 16, 32, 64})
+{
+    for (int push = 0; push < 2; push++) {
+        m_bytes[push] = 0;
+        m_transfers[push][0] = m_transfers[push][1] = 0;
+    }
+}
+
+void Metrics::BytesMoved(bool push, const std::string &remote, uint64_t bytes)
+{
+    if (!bytes) {return;}
+    m_bytes[push].fetch_add(bytes, std::memory_order_relaxed);
+    std::string host = remote.empty() ? "unknown" : RemoteHost(remote);
+    std::unique_lock<std::mutex> guard(m_hosts_mutex);
+    auto &hosts = m_host_bytes[push];
+    auto iter = hosts.find(host);
+    if ((iter == hosts.end()) && (hosts.size() >= m_max_hosts)) {
+        iter = hosts.insert(std::make_pair("other", 0)).first;
+    } else if (iter == hosts.end()) {
+        iter = hosts.insert(std::make_pair(host, 0)).first;
+    }
+    iter->second += bytes;
+}
+
+void Metrics::RangeDone(double seconds, double first_byte)
+{
+    m_range_duration.Observe(seconds);
+    m_range_first_byte.Observe(first_byte);
+}
+
+std::string Metrics::Render(const BufferPool &pool) const
+{
+    std::string out;
+    Header(out, "tpc_transfers_active", "gauge", "Transfers admitted and running.");
+    Sample(out, "tpc_transfers_active", "", m_active.load());
+    Header(out, "tpc_transfers_queued", "gauge", "Transfers waiting to start.");
+    Sample(out, "tpc_transfers_queued", "", m_queued.load());
+    Header(out, "tpc_transfers_total", "counter", "Finished transfers.");
+    for (int push = 0; push < 2; push++) {
+        for (int success = 0; success < 2; success++) {
+            std::string labels = std::string("direction=\"") + g_direction[push] +
+                                 "\",result=\"" + (success ? "success" : "failure") + "\"";
+            Sample(out, "tpc_transfers_total", labels, m_transfers[push][success].load());
+        }
+    }
+
+    Header(out, "tpc_bytes_total", "counter", "Bytes received (pull) or sent (push).");
+    for (int push = 0; push < 2; push++) {
+        Sample(out, "tpc_bytes_total", std::string("direction=\"") + g_direction[push] + "\"",
+               m_bytes[push].load());
+    }
+    Header(out, "tpc_remote_bytes_total", "counter", "Bytes moved, by remote host.");
+    {
+        std::unique_lock<std::mutex> guard(m_hosts_mutex);
+        for (int push = 0; push < 2; push++) {
+            for (const auto &entry : m_host_bytes[push]) {
+                std::string labels = std::string("direction=\"") + g_direction[push] +
+                                     "\",remote=\"" + EscapeLabel(entry.first) + "\"";
+                Sample(out, "tpc_remote_bytes_total", labels, entry.second);
+            }
+        }
+    }
+
+    Header(out, "tpc_range_retries_total", "counter", "Range requests retried.");
+    Sample(out, "tpc_range_retries_total", "", m_range_retries.load());
+    m_range_duration.Render(out, "tpc_range_duration_seconds",
+                            "Time taken by each range request.");
+    m_range_first_byte.Render(out, "tpc_range_first_byte_seconds",
+                              "Time until each range request received its first byte.");
+    m_reorder_available.Render(out, "tpc_reorder_buffers_available",
+                               "Reorder buffers a pull could still lease, sampled every second.");
+
+    Header(out, "tpc_buffer_pool_buffers", "gauge", "Transfer buffers in the shared pool.");
+    Sample(out, "tpc_buffer_pool_buffers", "state=\"in_use\"", pool.InUse());
+    Sample(out, "tpc_buffer_pool_buffers", "state=\"available\"", pool.Available());
+    Sample(out, "tpc_buffer_pool_buffers", "state=\"allocated\"", pool.Allocated());
+    Header(out, "tpc_buffer_pool_peak_buffers", "gauge", "Most transfer buffers ever in use at once.");
+    Sample(out, "tpc_buffer_pool_peak_buffers", "", pool.PeakInUse());
+    Header(out, "tpc_buffer_pool_lease_failures_total", "counter", "Buffer leases refused for lack of memory.");
+    Sample(out, "tpc_buffer_pool_lease_failures_total", "", pool.LeaseFailures());
+    return out;
+}
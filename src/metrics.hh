@@ -0,0 +1,97 @@
+/**
+ * metrics.hh:
+ *
+ * Process-wide counters and histograms describing the transfers handled
+ * by this server, rendered in the Prometheus text exposition format when
+ * the metrics path (tpc.metrics) is fetched.
+ *
+ * Everything on the data path is updated with relaxed atomic operations;
+ * only the per-host byte counters take a lock, and those are updated once
+ * a second per transfer.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+namespace TPC {
+class BufferPool;
+
+class Histogram {
+public:
+    // `bounds` are the (increasing) upper bounds of the buckets; a final
+    // +Inf bucket is implied.
+    explicit Histogram(std::vector<double> bounds);
+
+    Histogram(const Histogram&) = delete;
+
+    void Observe(double value);
+
+    void Render(std::string &out, const char *name, const char *help) const;
+
+private:
+    const std::vector<double> m_bounds;
+    std::unique_ptr<std::atomic<uint64_t>[]> m_buckets;  // Not cumulative.
+    std::atomic<uint64_t> m_count{0};
+    std::atomic<uint64_t> m_sum{0};  // In millionths.
+};
+
+class Metrics {
+public:
+    Metrics();
+
+    Metrics(const Metrics&) = delete;
+
+    // A transfer was admitted by the scheduler, and later let go.
+    void TransferStarted() {m_active++;}
+    void TransferEnded() {m_active--;}
+
+    // A transfer that got under way finished.
+    void TransferResult(bool push, bool success) {
+        m_transfers[push][success].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // A transfer is waiting for its turn to start.
+    void TransferQueued() {m_queued++;}
+    void TransferDequeued() {m_queued--;}
+
+    // Bytes moved from (pull) or to (push) the remote endpoint "ip:port".
+    void BytesMoved(bool push, const std::string &remote, uint64_t bytes);
+
+    // A range request finished after `seconds`, its first byte of data
+    // having arrived after `first_byte` seconds.
+    void RangeDone(double seconds, double first_byte);
+    void RangeRetried() {m_range_retries.fetch_add(1, std::memory_order_relaxed);}
+
+    // Reorder buffers a pull could still lease, sampled once a second.
+    void ReorderSample(size_t available) {m_reorder_available.Observe(available);}
+
+    // The text exposition of all the metrics, including the occupancy of `pool`.
+    std::string Render(const BufferPool &pool) const;
+
+private:
+    // Remote hosts are labels, so their number is capped; the rest are
+    // counted under "other".
+    static constexpr size_t m_max_hosts = 256;
+
+    std::atomic<int64_t> m_active{0};
+    std::atomic<int64_t> m_queued{0};
+    std::atomic<uint64_t> m_transfers[2][2];  // [push][success]
+    std::atomic<uint64_t> m_bytes[2];  // [push]
+    std::atomic<uint64_t> m_range_retries{0};
+    Histogram m_range_duration;
+    Histogram m_range_first_byte;
+    Histogram m_reorder_available;
+
+    mutable std::mutex m_hosts_mutex;
+    std::map<std::string, uint64_t> m_host_bytes[2];  // [push]; by host.
+};
+
+}
@@ -5,35 +5,118 @@
 #ifdef XRD_CHUNK_RESP
 
 #include "tpc.hh"
+#include "curlpool.hh"
+#include "engine.hh"
+#include "journal.hh"
+#include "metrics.hh"
+#include "multistream.hh"
 #include "state.hh"
+#include "stream.hh"
+#include "trace.hh"
 
+#include "XrdSfs/XrdSfsInterface.hh"
 #include "XrdSys/XrdSysError.hh"
 
 #include <curl/curl.h>
 
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <map>
 #include <sstream>
 #include <stdexcept>
 
-using namespace TPC;
+#include <sys/stat.h>
 
-class CurlHandlerSetupError : public std::runtime_error {
-public:
-    CurlHandlerSetupError(const std::string &msg) :
-        std::runtime_error(msg)
-    {}
-    virtual ~CurlHandlerSetupError() {}
-};
+using namespace TPC;
 
 namespace {
-class MultiCurlHandler {
+/**
+ * Pick the initial range size for a transfer: large enough to amortize the
+ * cost of each request, small enough that every stream has work to do, and
+ * a multiple of the storage alignment so ranges (and the buffered writes
+ * they turn into) start on stripe boundaries.
+ */
+size_t ChooseRangeSize(off_t content_length, size_t streams, size_t alignment,
+                       size_t max_size)
+{
+    static const size_t min_size = 1024*1024;
+    size_t size = max_size;
+    if (streams && (content_length / static_cast<off_t>(streams) < static_cast<off_t>(max_size))) {
+        size = std::max(min_size, static_cast<size_t>((content_length + streams - 1) / streams));
+    }
+    size = ((size + alignment - 1) / alignment) * alignment;
+    return std::min(size, max_size);
+}
+
+/**
+ * Whether a range that failed this way is worth another attempt: network
+ * trouble and server-side errors are, anything else (including a failure
+ * to write to local storage) is not.
+ */
+bool IsRetriable(CURLcode result, int status_code)
+{
+    if (status_code >= 400) {
+        return (status_code >= 500) || (status_code == 408) || (status_code == 429);
+    }
+    switch (result) {
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Schedules the byte ranges of a multi-stream transfer across a fixed set
+ * of curl handles; driven by the transfer engine.  Ranges are fetched with
+ * Range GETs when pulling and sent as Content-Range PUTs when pushing.
+ * A range that fails is put back in a queue and retried, on a fresh
+ * connection and after a backoff, up to a fixed number of times.
+ *
+ * Once a response arrives through a redirect, later ranges go straight to
+ * the URL it was redirected to; should that URL fail, the transfer goes
+ * back to the original one for good.
+ */
+class MultiCurlHandler : public Transfer {
 public:
-    MultiCurlHandler(std::vector<State> &states) :
-        m_handle(curl_multi_init()),
+    // If `adaptive` is set, the number of ranges in flight is tuned to the
+    // observed throughput, using at most states.size() streams; otherwise
+    // all the streams are used.  Ranges start out `range_size` bytes long
+    // and may grow (by doubling) up to `max_range_size`.  Each range is
+    // retried at most `max_retries` times.  Bytes before `start_offset` are
+    // already in place and are not transferred.
+    //
+    // A negative `content_length` means the size of the file is not known
+    // yet: only the first range is requested, and the rest are planned once
+    // its response reveals the size.  The `journal`, if any, is started then.
+    MultiCurlHandler(std::vector<State> &states, CurlPool &pool, const std::string &url,
+                     off_t content_length, off_t start_offset, size_t range_size,
+                     size_t max_range_size, bool adaptive, unsigned max_retries,
+                     Journal *journal=nullptr) :
+        m_pool(pool),
+        m_url(url),
+        m_journal(journal),
+        m_max_retries(max_retries),
+        m_adaptive(adaptive),
+        m_stream_limit((adaptive && (states.size() > m_initial_streams)) ? m_initial_streams : states.size()),
+        m_base_limit(m_stream_limit),
+        m_content_length(content_length),
+        m_start_offset(start_offset),
+        m_range_size(range_size),
+        m_max_range_size(max_range_size),
+        m_current_offset(start_offset),
         m_states(states)
     {
-        if (m_handle == nullptr) {
-            throw CurlHandlerSetupError("Failed to initialize a libcurl multi-handle");
-        }
         m_avail_handles.reserve(states.size());
         m_active_handles.reserve(states.size());
         for (State &state : states) {
@@ -41,37 +124,371 @@ public:
         }
     }
 
-    ~MultiCurlHandler()
+    virtual ~MultiCurlHandler()
     {
-        if (!m_handle) {return;}
+        m_states[0].GetStream().SetWakeup(nullptr);
+        for (State &state : m_states) {
+            state.SetHeaderCallback(nullptr);
+        }
+        // By the time the transfer is destroyed, the engine has removed
+        // all handles from its multi-handle.
         for (CURL * easy_handle : m_active_handles) {
-            curl_multi_remove_handle(m_handle, easy_handle);
-            curl_easy_cleanup(easy_handle);
+            m_pool.Put(easy_handle);
         }
         for (auto & easy_handle : m_avail_handles) {
-            curl_easy_cleanup(easy_handle);
+            m_pool.Put(easy_handle);
         }
-        curl_multi_cleanup(m_handle);
     }
 
     MultiCurlHandler(const MultiCurlHandler &) = delete;
 
-    CURLM *Get() const {return m_handle;}
+    virtual void Start(EventLoop &loop) override {
+        m_stripe_bytes.assign(m_states.size(), 0);
+        m_stripe_remote.assign(m_states.size(), "");
+        // All states share the same stream.
+        m_states[0].GetStream().SetWakeup([this]{Notify();});
+        for (State &state : m_states) {
+            State *ptr = &state;
+            state.SetHeaderCallback([this, ptr]{HeadersDone(*ptr);});
+        }
+        StartTransfers(loop);
+        MaybeFinish(loop);
+    }
 
-    void FinishCurlXfer(CURL *curl) {
-        CURLMcode mres = curl_multi_remove_handle(m_handle, curl);
-        if (mres) {
-            std::stringstream ss;
-            ss << "Failed to remove transfer from set: "
-               << curl_multi_strerror(mres);
-            throw std::runtime_error(ss.str());
+    virtual void Done(EventLoop &loop, CURL *curl, CURLcode result) override {
+        if (GetMetrics()) {
+            double total = 0, first_byte = 0;
+            curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+            curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &first_byte);
+            GetMetrics()->RangeDone(total, first_byte);
         }
-        for (auto &state : m_states) {
-            if (curl == state.GetHandle()) {
-                state.ResetAfterRequest();
-                break;
+        State *state = GetState(curl);
+        int status_code = state ? state->GetStatusCode() : -1;
+        off_t received = state ? state->BytesTransferred() : 0;
+        if (GetTrace() && state) {
+            std::stringstream args;
+            auto iter = m_active_ranges.find(curl);
+            if (iter != m_active_ranges.end()) {
+                args << "\"offset\":" << iter->second.m_offset << ",\"size\":" << iter->second.m_size
+                     << ",\"attempt\":" << (iter->second.m_attempts + 1) << ",";
             }
+            args << "\"status\":" << status_code << ",\"bytes\":" << received;
+            if (result != CURLE_OK) {
+                args << ",\"error\":\"" << curl_easy_strerror(result) << "\"";
+            }
+            GetTrace()->Request(curl, state - &m_states[0] + 1, args.str());
+        }
+        long retry_after = state ? state->GetRetryAfter() : -1;
+        // A file that turns out to be empty cannot satisfy any range.
+        bool empty = (status_code == 416) && (m_content_length == 0);
+        // An upload may complete from libcurl's point of view even though
+        // the remote side rejected it.
+        // The body of a response to the wrong range was refused (see
+        // State::UnexpectedRange).  Asking the same server again would not
+        // help; falling back from a redirect target may.
+        bool wrong_range = state && state->UnexpectedRange();
+        if ((result == CURLE_OK) && ((status_code < 400) || empty) && !wrong_range) {
+            if (m_content_length < 0) {
+                if (status_code != 200) {
+                    FinishCurlXfer(loop, curl);
+                    Abort(loop);
+                    Finish(loop, CURLE_HTTP_RETURNED_ERROR, "Remote side did not report the size of the file");
+                    return;
+                }
+                // The whole file arrived, without its size announced upfront.
+                SetContentLength(*state, received);
+            }
+            AdjustRangeSize(curl);
+            FinishCurlXfer(loop, curl);
+            // The range after this one may have been paused for being ahead
+            // of the reorder window; it now fills the gap.
+            ResumePaused();
+            // Issue new transfers if there is still pending work to do.
+            // Otherwise, continue running until there are no handles left.
+            StartTransfers(loop);
+            MaybeFinish(loop);
+            return;
+        }
+        Range range = m_active_ranges[curl];
+        FinishCurlXfer(loop, curl);
+
+        std::stringstream ss;
+        ss << "Range " << range.m_offset << "-" << (range.m_offset + range.m_size - 1)
+           << " failed after " << (range.m_attempts + 1) << " attempt(s): ";
+        if (wrong_range) {
+            ss << "Remote side answered with status code " << status_code
+               << " but not the data at the requested offset";
+        } else if (status_code >= 400) {
+            ss << "Remote side failed with status code " << status_code;
+        } else {
+            ss << curl_easy_strerror(result);
+        }
+        // Whatever went wrong, the URL we were redirected to earlier (which
+        // may have carried a token that since expired) is not to be trusted
+        // any more; retry right away through the original one.
+        bool fall_back = range.m_redirected;
+        if (fall_back) {
+            m_redirect_url.clear();
+            m_redirect_failed = true;
+        } else if (!IsRetriable(result, status_code) || (range.m_attempts >= m_max_retries)) {
+            // Give up on the entire transfer.
+            Abort(loop);
+            Finish(loop, (result == CURLE_OK) ? CURLE_HTTP_RETURNED_ERROR : result, ss.str());
+            return;
+        }
+        // Data already handed to the stream was accepted, so a download
+        // picks up where the failed request left off; an upload starts over.
+        if (!m_states[0].IsPush() && (status_code < 300)) {
+            range.m_offset += received;
+            range.m_size -= received;
         }
+        if (range.m_size) {
+            if (fall_back) {
+                range.m_not_before = std::chrono::steady_clock::time_point();
+            } else {
+                range.m_attempts++;
+                unsigned shift = (range.m_attempts < m_max_backoff_shift) ? range.m_attempts : m_max_backoff_shift;
+                long backoff = 1 << shift;
+                // Honor the remote side's wish (e.g. with a 503), within reason.
+                if (retry_after > backoff) {
+                    backoff = (retry_after < m_max_retry_after) ? retry_after : m_max_retry_after;
+                }
+                range.m_not_before = std::chrono::steady_clock::now() + std::chrono::seconds(backoff);
+            }
+            m_retry_ranges.push_back(range);
+            m_retries++;
+            if (GetMetrics()) {GetMetrics()->RangeRetried();}
+        }
+        StartTransfers(loop);
+        MaybeFinish(loop);
+    }
+
+    // Picks up ranges whose retry backoff expired; also, when the
+    // server-wide buffer pool is exhausted, no range may be in flight, so
+    // periodically retry until buffers free up.
+    virtual void Tick(EventLoop &loop) override {
+        if (GetMetrics() && !IsPush()) {
+            GetMetrics()->ReorderSample(m_states[0].AvailableBuffers());
+        }
+        ResumePaused();
+        if (m_adaptive) {
+            AdjustStreams();
+        }
+        StartTransfers(loop);
+        // Waiting for a connection slot is not starvation; the governor
+        // keeps the remote side from being overrun.
+        if (!m_active_handles.empty() || !m_retry_ranges.empty() || m_waiting_for_slot) {
+            m_starved_ticks = 0;
+        } else if (++m_starved_ticks > m_max_starved_ticks) {
+            Finish(loop, CURLE_OPERATION_TIMEDOUT, "Timed out waiting for transfer buffers");
+        }
+    }
+
+    // The local storage caught up, or the size of the file was learned;
+    // restart any ranges paused on the former, and plan the rest of the
+    // ranges after the latter.
+    virtual void Notified(EventLoop &loop) override {
+        ResumePaused();
+        StartTransfers(loop);
+    }
+
+    virtual void Abort(EventLoop &loop) override {
+        while (!m_active_handles.empty()) {
+            FinishCurlXfer(loop, m_active_handles.back());
+        }
+    }
+
+    // Each state is a stripe; its bytes include those of the request in flight.
+    virtual void Sample(std::vector<StripeProgress> &stripes) override {
+        stripes.resize(m_states.size());
+        for (size_t idx = 0; idx < m_states.size(); idx++) {
+            State &state = m_states[idx];
+            stripes[idx].m_bytes = m_stripe_bytes[idx];
+            stripes[idx].m_remote = m_stripe_remote[idx];
+            if (m_active_ranges.count(state.GetHandle())) {
+                stripes[idx].m_bytes += state.BytesTransferred();
+                stripes[idx].m_remote = RemoteEndpoint(state.GetHandle());
+            }
+        }
+    }
+
+    // End of the ranges scheduled so far.
+    off_t CurrentOffset() const {return m_current_offset;}
+
+    // Current cap on the number of ranges in flight.
+    size_t StreamLimit() const {return m_stream_limit;}
+
+    size_t RangeSize() const {return m_range_size;}
+
+    // Size of the file; negative if it was never learned.
+    off_t ContentLength() const {return m_content_length;}
+
+    // Digest of the whole resource (RFC 3230), from the first successful
+    // response that carried one.
+    const std::string &RemoteDigest() const {return m_remote_digest;}
+
+    // Number of range requests that were retried.
+    unsigned Retries() const {return m_retries;}
+
+private:
+    // A byte range of the file, and how often it has been attempted.
+    struct Range {
+        Range() {}
+        Range(off_t offset, size_t size) : m_offset(offset), m_size(size) {}
+
+        off_t m_offset{0};
+        size_t m_size{0};
+        unsigned m_attempts{0};
+        std::chrono::steady_clock::time_point m_not_before;  // Earliest time for a retry.
+        bool m_redirected{false};  // Sent straight to m_redirect_url.
+    };
+
+    void HeadersDone(State &state) {
+        LearnRedirect(state);
+        LearnSize(state);
+        LearnDigest(state);
+    }
+
+    // Remember where the first successful response through a redirect
+    // actually came from.
+    void LearnRedirect(State &state) {
+        int status_code = state.GetStatusCode();
+        if (m_redirect_failed || !m_redirect_url.empty() || (status_code < 200) || (status_code >= 300)) {
+            return;
+        }
+        long redirects = 0;
+        char *url = nullptr;
+        if ((curl_easy_getinfo(state.GetHandle(), CURLINFO_REDIRECT_COUNT, &redirects) != CURLE_OK) ||
+            !redirects ||
+            (curl_easy_getinfo(state.GetHandle(), CURLINFO_EFFECTIVE_URL, &url) != CURLE_OK) || !url)
+        {
+            return;
+        }
+        m_redirect_url = url;
+    }
+
+
+    void LearnDigest(State &state) {
+        int status_code = state.GetStatusCode();
+        if (m_remote_digest.empty() && (status_code >= 200) && (status_code < 300)) {
+            m_remote_digest = state.GetDigest();
+        }
+    }
+
+    // The first response with a size fixes the size of the file.  This runs
+    // inside a libcurl callback (see HeadersDone), where no handles may be
+    // added, so the new ranges are started from Notified().
+    void LearnSize(State &state) {
+        if (m_content_length >= 0) {return;}
+        off_t size = state.GetResourceSize();
+        if (size < 0) {return;}
+        SetContentLength(state, size);
+        Notify();
+    }
+
+    void SetContentLength(State &state, off_t size) {
+        m_content_length = size;
+        Range &range = m_active_ranges[state.GetHandle()];
+        // A server ignoring the Range header sends the whole file at once.
+        if ((state.GetStatusCode() == 200) || (m_current_offset > size)) {
+            range.m_size = (size > range.m_offset) ? static_cast<size_t>(size - range.m_offset) : 0;
+            m_current_offset = size;
+        }
+        m_range_size = ChooseRangeSize(size - m_current_offset, m_states.size(),
+                                       m_states[0].GetStream().Alignment(), m_max_range_size);
+        if (m_journal) {
+            // Creating the journal syncs it to disk; not on the event loop.
+            Journal *journal = m_journal;
+            std::string etag = state.GetETag(), last_modified = state.GetLastModified();
+            state.GetStream().Submit([journal, size, etag, last_modified] {
+                journal->Create(size, etag, last_modified);
+            });
+        }
+    }
+
+    // If the fixed cost of a request (connection setup and the wait for
+    // the remote side to respond) is a significant part of the time spent
+    // on a range, double the size of the following ranges; this keeps the
+    // alignment, since the range size stays a multiple of it.
+    void AdjustRangeSize(CURL *curl) {
+        double total = 0, overhead = 0;
+        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+        // An upload's response only comes after the body was sent.
+        curl_easy_getinfo(curl, m_states[0].IsPush() ? CURLINFO_PRETRANSFER_TIME : CURLINFO_STARTTRANSFER_TIME,
+                          &overhead);
+        if ((total <= 0) || (overhead < m_max_overhead * total)) {return;}
+        size_t range_size = std::min(2*m_range_size, m_max_range_size);
+        // Do not grow so large that some streams would have nothing left to do.
+        off_t remaining = m_content_length - m_current_offset;
+        if (remaining / static_cast<off_t>(range_size) < static_cast<off_t>(m_stream_limit)) {return;}
+        m_range_size = range_size;
+    }
+
+    // Every few ticks, compare the aggregate throughput against the last
+    // measurement and adjust the stream limit: double it while throughput
+    // keeps improving, undo any increase that did not pay off, probe one
+    // more stream now and then once settled, and shed a stream whenever
+    // the reorder buffers run out.
+    void AdjustStreams() {
+        if (++m_ticks_since_adjust < m_adjust_ticks) {return;}
+        m_ticks_since_adjust = 0;
+
+        off_t total = m_bytes_done;
+        for (CURL *curl : m_active_handles) {
+            State *state = GetState(curl);
+            if (state) {total += state->BytesTransferred();}
+        }
+        double rate = static_cast<double>(total - m_last_total) / m_adjust_ticks;
+        m_last_total = total;
+
+        size_t limit = m_stream_limit;
+        if (!m_states[0].IsPush() && !m_states[0].AvailableBuffers() && (limit > 1)) {
+            m_stream_limit = m_base_limit = limit - 1;
+            m_ramping = false;
+            m_base_rate = rate;
+            return;
+        }
+        if (rate > m_base_rate * (1 + m_min_gain)) {
+            // The last change helped (or the path got faster); keep going.
+            m_base_rate = rate;
+            m_base_limit = limit;
+            m_stream_limit = std::min(m_states.size(), m_ramping ? 2*limit : limit + 1);
+        } else if (limit > m_base_limit) {
+            // More streams did not help; go back.
+            m_stream_limit = m_base_limit;
+            m_ramping = false;
+            m_idle_periods = 0;
+        } else if (++m_idle_periods >= m_probe_periods) {
+            m_idle_periods = 0;
+            m_base_rate = rate;
+            m_stream_limit = std::min(m_states.size(), limit + 1);
+        } else {
+            m_base_rate = rate;
+        }
+    }
+
+    void ResumePaused() {
+        for (auto &state : m_states) {
+            if (state.Paused()) {state.Resume();}
+        }
+    }
+
+    void MaybeFinish(EventLoop &loop) {
+        if (m_active_handles.empty() && m_retry_ranges.empty() &&
+            (m_current_offset == m_content_length))
+        {
+            Finish(loop, CURLE_OK);
+        }
+    }
+
+    State *GetState(CURL *curl) {
+        for (auto &state : m_states) {
+            if (curl == state.GetHandle()) {return &state;}
+        }
+        return nullptr;
+    }
+
+    void FinishCurlXfer(EventLoop &loop, CURL *curl) {
         for (auto iter = m_active_handles.begin();
              iter != m_active_handles.end();
              ++iter)
@@ -82,33 +499,79 @@ public:
             }
         }
         m_avail_handles.push_back(curl);
+        m_active_ranges.erase(curl);
+        State *state = GetState(curl);
+        if (state) {
+            m_bytes_done += state->BytesTransferred();
+            m_stripe_bytes[state - &m_states[0]] += state->BytesTransferred();
+            m_stripe_remote[state - &m_states[0]] = RemoteEndpoint(curl);
+            state->ResetAfterRequest();
+        }
+        loop.RemoveHandle(curl);
+        if (state) {state->ReleaseConnection();}
     }
 
-    off_t StartTransfers(off_t current_offset, off_t content_length, size_t block_size,
-                         int &running_handles) {
-         bool started_new_xfer = false;
+    void StartTransfers(EventLoop &loop) {
+         m_waiting_for_slot = false;
+         // Retries go first.
+         auto now = std::chrono::steady_clock::now();
+         for (auto iter = m_retry_ranges.begin(); iter != m_retry_ranges.end();) {
+             if (iter->m_not_before > now) {
+                 ++iter;
+                 continue;
+             }
+             if (!StartTransfer(loop, *iter, true)) {
+                 return;
+             }
+             iter = m_retry_ranges.erase(iter);
+         }
+         // A download cannot get past a failed range; ranges started while
+         // it backs off would only fill the reorder window and pause, taking
+         // the handles its retry needs.
+         if (!m_retry_ranges.empty() && !m_states[0].IsPush()) {
+             return;
+         }
+         off_t current_offset = m_current_offset;
+         if (m_content_length < 0) {
+             // Until a response reveals the size of the file, only the
+             // first range is requested.
+             if ((current_offset == m_start_offset) &&
+                 StartTransfer(loop, Range{current_offset, m_range_size}))
+             {
+                 m_current_offset = current_offset + static_cast<off_t>(m_range_size);
+             }
+             return;
+         }
          do {
-             size_t xfer_size = std::min(content_length - current_offset, static_cast<off_t>(block_size));
-             if (xfer_size == 0) {return current_offset;}
-             if (!(started_new_xfer = StartTransfer(current_offset, xfer_size))) {
+             size_t xfer_size = std::min(m_content_length - current_offset, static_cast<off_t>(m_range_size));
+             if (xfer_size == 0) {break;}
+             if (!StartTransfer(loop, Range{current_offset, xfer_size})) {
                  break;
-             } else {
-                 running_handles += 1;
              }
              current_offset += xfer_size;
+             m_current_offset = current_offset;
         } while (true);
-        return current_offset;
     }
 
-private:
-
-    bool StartTransfer(off_t offset, size_t size) {
-        if (!CanStartTransfer()) {return false;}
+    bool StartTransfer(EventLoop &loop, const Range &range, bool retry = false) {
+        if (!CanStartTransfer(retry)) {return false;}
         for (auto &handle : m_avail_handles) {
             for (auto &state : m_states) {
                 if (state.GetHandle() == handle) {  // This state object represents an idle handle.
-                    state.SetTransferParameters(offset, size);
-                    ActivateHandle(state);
+                    if (!state.AcquireConnection()) {
+                        // The remote host (or local filesystem) is at its
+                        // connection cap; try again on a later tick.
+                        m_waiting_for_slot = true;
+                        return false;
+                    }
+                    state.SetTransferParameters(range.m_offset, range.m_size, m_content_length);
+                    bool redirected = !m_redirect_url.empty();
+                    curl_easy_setopt(handle, CURLOPT_URL, redirected ? m_redirect_url.c_str() : m_url.c_str());
+                    // Do not retry over a connection that may be what failed.
+                    curl_easy_setopt(handle, CURLOPT_FRESH_CONNECT, range.m_attempts ? 1L : 0L);
+                    m_active_ranges[handle] = range;
+                    m_active_ranges[handle].m_redirected = redirected;
+                    ActivateHandle(loop, state);
                     return true;
                 }
             }
@@ -116,17 +579,10 @@ private:
         return false;
     }
 
-    void ActivateHandle(State &state) {
+    void ActivateHandle(EventLoop &loop, State &state) {
         CURL *curl = state.GetHandle();
+        loop.AddHandle(curl, *this);
         m_active_handles.push_back(curl);
-        CURLMcode mres;
-        mres = curl_multi_add_handle(m_handle, curl);
-        if (mres) {
-            std::stringstream ss;
-            ss << "Failed to add transfer to libcurl multi-handle"
-               << curl_multi_strerror(mres);
-            throw std::runtime_error(ss.str());
-        }
         for (auto iter = m_avail_handles.begin();
              iter != m_avail_handles.end();
              ++iter)
@@ -138,28 +594,68 @@ private:
         }
     }
 
-    bool CanStartTransfer() const {
-        size_t idle_handles = m_avail_handles.size();
-        size_t transfer_in_progress = 0;
-        for (auto &state : m_states) {
-            for (const auto &handle : m_active_handles) {
-                if (handle == state.GetHandle()) {
-                    transfer_in_progress += state.BodyTransferInProgress();
-                    break;
-                }
-            }
-        }
-        if (!idle_handles) {
+    bool CanStartTransfer(bool retry) const {
+        if (m_avail_handles.empty() || (m_active_handles.size() >= m_stream_limit)) {
             return false;
         }
-        ssize_t available_buffers = m_states[0].AvailableBuffers();
-        // To be conservative, set aside buffers for any transfers that have been activated
-        // but don't have their first responses back yet.
-        available_buffers -= (m_active_handles.size() - transfer_in_progress);
-        return available_buffers > 0;
+        // Uploads need no reorder buffers (and fall back to reading the file
+        // directly if read-ahead buffers run out).  Neither does a retry: its
+        // range may be the one filling the gap, with the partial region it
+        // left behind holding the last buffer while the ranges after it are
+        // paused; holding it back would wedge the transfer.
+        if (m_states[0].IsPush() || retry) {
+            return true;
+        }
+        // A range whose data gets ahead of the reorder window pauses until
+        // the window drains (see Stream::Write), so ranges in flight need not
+        // each have a buffer set aside; there just has to be one to start.
+        return m_states[0].AvailableBuffers() > 0;
     }
 
-    CURLM *m_handle;
+    // Matches the low-speed limit set on each handle (see State::InstallHandlers).
+    static constexpr unsigned m_max_starved_ticks = 2*60;
+
+    // Tuning of the adaptive mode.
+    static constexpr size_t m_initial_streams = 2;
+    static constexpr unsigned m_adjust_ticks = 2;  // Ticks between adjustments.
+    static constexpr double m_min_gain = 0.1;  // Throughput gain that justifies more streams.
+    static constexpr unsigned m_probe_periods = 5;  // Stable periods before probing again.
+    // Fraction of a range's time spent on request overhead that justifies larger ranges.
+    static constexpr double m_max_overhead = 0.2;
+
+    // Backoff before a retry is 2^attempts seconds, up to 2^this.
+    static constexpr unsigned m_max_backoff_shift = 5;
+    // Longest Retry-After we are willing to wait for, in seconds.
+    static constexpr long m_max_retry_after = 5*60;
+
+    CurlPool &m_pool;
+    const std::string m_url;  // Where the transfer was sent originally.
+    std::string m_redirect_url;  // Where it was redirected to; empty if it was not.
+    std::string m_remote_digest;
+    bool m_redirect_failed{false};  // Whether a range sent to m_redirect_url failed.
+    Journal *m_journal;
+    const unsigned m_max_retries;
+    unsigned m_retries{0};
+    std::map<CURL *, Range> m_active_ranges;
+    std::list<Range> m_retry_ranges;
+    const bool m_adaptive;
+    size_t m_stream_limit;
+    size_t m_base_limit;  // Stream limit at which m_base_rate was measured.
+    bool m_ramping{true};
+    double m_base_rate{0};  // Bytes per tick.
+    unsigned m_ticks_since_adjust{0};
+    unsigned m_idle_periods{0};
+    off_t m_bytes_done{0};  // Bytes moved by completed ranges.
+    std::vector<off_t> m_stripe_bytes;  // The same, for each state.
+    std::vector<std::string> m_stripe_remote;  // Where each state's last request went.
+    off_t m_last_total{0};
+    unsigned m_starved_ticks{0};
+    bool m_waiting_for_slot{false};  // Whether a range was held back by the governor.
+    off_t m_content_length;  // Negative until known.
+    const off_t m_start_offset;
+    size_t m_range_size;
+    const size_t m_max_range_size;
+    std::atomic<off_t> m_current_offset{0};
     std::vector<CURL *> m_avail_handles;
     std::vector<CURL *> m_active_handles;
     std::vector<State> &m_states;
@@ -167,148 +663,153 @@ private:
 }
 
 
+std::unique_ptr<Transfer> TPC::MakeMultiStreamTransfer(std::vector<State> &states, CurlPool &pool,
+                                                       const std::string &url, off_t content_length,
+                                                       off_t start_offset, size_t range_size,
+                                                       size_t max_range_size, bool adaptive,
+                                                       unsigned max_retries, Journal *journal)
+{
+    return std::unique_ptr<Transfer>(new MultiCurlHandler(states, pool, url, content_length,
+        start_offset, range_size, max_range_size, adaptive, max_retries, journal));
+}
+
+
 int TPCHandler::RunCurlWithStreams(XrdHttpExtReq &req, State &state,
-                                   const char *log_prefix, size_t streams)
+                                   const std::string &url, const char *log_prefix,
+                                   size_t streams, bool adaptive, Journal *journal)
 try
 {
     int result;
     bool success;
     CURL *curl = state.GetHandle();
-    if ((result = DetermineXferSize(curl, req, state, success)) || !success) {
-        return result;
-    }
-    off_t content_size = state.GetContentLength();
-    off_t current_offset = 0;
+    Stream &stream = state.GetStream();
+    off_t content_size = -1;  // Unknown until the first range arrives.
+    off_t start_offset = 0;
+    if (state.IsPush()) {
+        struct stat buf;
+        if (SFS_OK != state.GetStream().Stat(&buf)) {
+            m_pool->Put(curl);
+            char msg[] = "Failed to determine size of local resource";
+            m_log.Emsg(log_prefix, msg);
+            return SendFailure(req, state.ResponseStarted(), 500, msg);
+        }
+        content_size = buf.st_size;
+    } else if (journal && journal->Exists()) {
+        // Deciding whether an earlier attempt can be resumed takes the
+        // size and validators of the source before the first range.
+        if ((result = DetermineXferSize(curl, req, state, success)) || !success) {
+            return result;
+        }
+        content_size = state.GetContentLength();
 
-    {
         std::stringstream ss;
         ss << "Successfully determined remote size for pull request: " << content_size;
         m_log.Emsg("ProcessPullReq", ss.str().c_str());
+
+        struct stat buf;
+        off_t local_size = (stream.Stat(&buf) == SFS_OK) ? buf.st_size : 0;
+        start_offset = journal->Start(content_size, state.GetETag(), state.GetLastModified(),
+                                      local_size);
+        // Keep the ranges, and the writes they turn into, aligned.
+        start_offset -= start_offset % static_cast<off_t>(stream.Alignment());
+        if (start_offset) {
+            std::stringstream ss;
+            ss << "Resuming pull of " << req.resource << " at offset " << start_offset;
+            m_log.Emsg(log_prefix, ss.str().c_str());
+        }
+    }
+    if (journal) {
+        stream.SetWriteOffset(start_offset);
+        stream.SetCheckpoint(m_checkpoint_interval, [journal](off_t offset) {journal->Record(offset);});
     }
-    state.ResetAfterRequest();    
+    // Without a size, this is the size of the first range only; it is small,
+    // so the rest of the ranges can be planned (and spread) soon.
+    size_t range_size = ChooseRangeSize((content_size < 0) ? 0 : content_size - start_offset,
+                                        streams, stream.Alignment(), stream.BlockSize());
+    // Nothing to split up; a plain PUT is all that is needed.
+    if (state.IsPush() && (content_size <= static_cast<off_t>(range_size))) {
+        return RunCurlWithUpdates(curl, req, state, log_prefix);
+    }
+    state.ResetAfterRequest();
 
     std::vector<State> handles;
     handles.reserve(streams);
     handles.emplace_back(std::move(state));
     for (size_t idx = 1; idx < streams; idx++) {
-        handles.emplace_back(handles[0].Duplicate());  // Makes a duplicate of the original state
+        handles.emplace_back(handles[0].Duplicate(*m_pool));  // Makes a duplicate of the original state
     }
 
-    // Create the multi-handle and add in the current transfer to it.
-    MultiCurlHandler mch(handles);
-    CURLM *multi_handle = mch.Get();
+    MultiCurlHandler mch(handles, *m_pool, url, content_size, start_offset, range_size,
+                         stream.BlockSize(), adaptive, m_range_retries, journal);
+    mch.SetMetrics(m_metrics.get(), state.IsPush());
+    Trace *trace = stream.GetTrace();
+    mch.SetTrace(trace);
 
-    // Start response to client prior to the first call to curl_multi_perform
-    int retval = req.StartChunkedResp(201, "Created", "Content-Type: text/plain");
+    // Start response to client prior to handing the transfer to the engine.
+    int retval = handles[0].ResponseStarted() ? 0 :
+                 req.StartChunkedResp(201, "Created", "Content-Type: text/plain");
     if (retval) {
         return retval;
     }
 
-    // Start assigning transfers
-    int running_handles = 0;
-    current_offset = mch.StartTransfers(current_offset, content_size, m_block_size, running_handles);
-
-    // Transfer loop: use curl to actually run the transfer, but periodically
-    // interrupt things to send back performance updates to the client.
-    time_t last_marker = 0;
-    CURLcode res = static_cast<CURLcode>(-1);
-    CURLMcode mres;
-    do {
-        time_t now = time(NULL);
-        time_t next_marker = last_marker + m_marker_period;
-        if (now >= next_marker) {
-            if (SendPerfMarker(req, current_offset)) {
-                return -1;
-            }
-            last_marker = now;
-        }
-
-        mres = curl_multi_perform(multi_handle, &running_handles);
-        if (mres == CURLM_CALL_MULTI_PERFORM) {
-            // curl_multi_perform should be called again immediately.  On newer
-            // versions of curl, this is no longer used.
-            continue;
-        } else if (mres != CURLM_OK) {
-            break;
-        }
-
-        // Harvest any messages, looking for CURLMSG_DONE.
-        CURLMsg *msg;
-        do {
-            int msgq = 0;
-            msg = curl_multi_info_read(multi_handle, &msgq);
-            if (msg && (msg->msg == CURLMSG_DONE)) {
-                CURL *easy_handle = msg->easy_handle;
-                mch.FinishCurlXfer(easy_handle);
-                res = msg->data.result;
-                // If any requests fail, cut off the entire transfer.
-                if (res != CURLE_OK) {
-                    break;
-                }
-            }
-        } while (msg);
-        if (res != -1 && res != CURLE_OK) {
-            break;
-        }
-
-        if (running_handles < static_cast<int>(streams)) {
-            // Issue new transfers if there is still pending work to do.
-            // Otherwise, continue running until there are no handles left.
-            if (current_offset != content_size) {
-                current_offset = mch.StartTransfers(current_offset, content_size,
-                                                    m_block_size, running_handles);
-            } else if (running_handles == 0) {
-                break;
-            }
-        }
-
-        int64_t max_sleep_time = next_marker - time(NULL);
-        if (max_sleep_time <= 0) {
-            continue;
-        }
-        int fd_count;
-        mres = curl_multi_wait(multi_handle, NULL, 0, max_sleep_time*1000, &fd_count);
-        if (mres != CURLM_OK) {
-            break;
-        }
-    } while (running_handles);
-
-    if (mres != CURLM_OK) {
+    m_engine->Submit(mch, m_pool->Affinity(handles[0].GetHandle()));
+    if ((retval = WaitForTransfer(req, mch))) {
+        m_metrics->TransferResult(state.IsPush(), false);
+        return retval;
+    }
+    CURLcode res = mch.GetResult();
+    content_size = mch.ContentLength();
+    if (mch.Retries()) {
         std::stringstream ss;
-        ss << "Internal libcurl multi-handle error: "
-           << curl_multi_strerror(mres);
-        throw std::runtime_error(ss.str());
+        ss << "Transfer retried " << mch.Retries() << " range request(s)";
+        m_log.Emsg(log_prefix, ss.str().c_str());
     }
-
-    // Harvest any messages, looking for CURLMSG_DONE.
-    CURLMsg *msg;
-    do {
-        int msgq = 0;
-        msg = curl_multi_info_read(multi_handle, &msgq);
-        if (msg && (msg->msg == CURLMSG_DONE)) {
-            CURL *easy_handle = msg->easy_handle;
-            mch.FinishCurlXfer(easy_handle);
-            res = msg->data.result;  // Transfer result will be examined below.
-        }
-    } while (msg);
-
-    if (res == -1) { // No transfers returned?!?
-        throw std::runtime_error("Internal state error in libcurl");
+    if (adaptive) {
+        std::stringstream ss;
+        ss << "Adaptive transfer finished using " << mch.StreamLimit() << " of up to "
+           << streams << " streams";
+        m_log.Emsg(log_prefix, ss.str().c_str());
     }
 
     // Generate the final response back to the client.
     std::stringstream ss;
+    std::string message;
+    bool complete = false;
     if (res != CURLE_OK) {
-        m_log.Emsg(log_prefix, "request failed when processing", curl_easy_strerror(res));
-        ss << "failure: " << curl_easy_strerror(res);
-    } else if (current_offset != content_size) {
+        const char *msg = mch.GetMessage().empty() ? curl_easy_strerror(res) : mch.GetMessage().c_str();
+        m_log.Emsg(log_prefix, "request failed when processing", msg);
+        ss << "failure: " << msg;
+    } else if (mch.CurrentOffset() != content_size) {
         ss << "failure: Internal logic error led to early abort";
         m_log.Emsg(log_prefix, "Internal logic error led to early abort");
     } else if (state.GetStatusCode() >= 400) {
         ss << "failure: Remote side failed with status code " << state.GetStatusCode();
         m_log.Emsg(log_prefix, "Remote server failed request", ss.str().c_str());
+    } else if (!handles[0].Finalize() ||
+               // A resumed destination may have been longer than the source.
+               (journal && (stream.Truncate(content_size) != SFS_OK))) {
+        ss << "failure: Failed to write data to local storage";
+        m_log.Emsg(log_prefix, "Failed to write data to local storage");
+    } else if (handles[0].IsPush() &&
+               !VerifyRemoteSize(handles[0], url, content_size, log_prefix, message)) {
+        ss << "failure: " << message;
+    } else if (!VerifyChecksum(stream, mch.RemoteDigest(), log_prefix, message)) {
+        ss << "failure: " << message;
+        // What was written cannot be trusted; do not resume from it.
+        if (journal) {journal->Remove();}
     } else {
         ss << "success: Created";
+        complete = true;
+    }
+    m_metrics->TransferResult(state.IsPush(), complete);
+    if (trace) {trace->SetResult(complete);}
+    if (journal) {
+        if (complete) {
+            journal->Remove();
+        } else {
+            // Flush (and record) whatever did arrive, for the next attempt.
+            handles[0].Finalize();
+        }
     }
 
     if ((retval = req.ChunkResp(ss.str().c_str(), 0))) {
@@ -316,10 +817,7 @@ try
     }
     return req.ChunkResp(nullptr, 0);
 }
-catch (CurlHandlerSetupError e) {
-    m_log.Emsg(log_prefix, e.what());
-    return req.SendSimpleResp(500, nullptr, nullptr, e.what(), 0);
-} catch (std::runtime_error e) {
+catch (std::runtime_error e) {
     m_log.Emsg(log_prefix, e.what());
     std::stringstream ss;
     ss << "failure: " << e.what();
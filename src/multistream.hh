@@ -0,0 +1,32 @@
+/**
+ * multistream.hh:
+ *
+ * Multi-stream transfers outside of a COPY request, for tools (such as the
+ * benchmarks) that drive the range scheduler directly.  The handler itself
+ * is only available when XrdHttp supports chunked responses.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace TPC {
+class CurlPool;
+class Journal;
+class State;
+class Transfer;
+
+// A transfer splitting `url` into byte ranges fetched (or sent) over the
+// curl handles of `states`, all sharing one stream; see MultiCurlHandler in
+// multistream.cpp for the meaning of the parameters.  `states` must outlive
+// the transfer, which returns their handles to `pool` when destroyed.
+std::unique_ptr<Transfer> MakeMultiStreamTransfer(std::vector<State> &states, CurlPool &pool,
+                                                  const std::string &url, off_t content_length,
+                                                  off_t start_offset, size_t range_size,
+                                                  size_t max_range_size, bool adaptive,
+                                                  unsigned max_retries, Journal *journal = nullptr);
+}
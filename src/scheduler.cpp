@@ -0,0 +1,175 @@
+
+#include "scheduler.hh"
+#include "metrics.hh"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace TPC;
+
+
+Scheduler::Ticket::~Ticket()
+{
+    m_scheduler.Release(*this);
+}
+
+bool Scheduler::Ticket::WaitUntil(time_t deadline)
+{
+    std::unique_lock<std::mutex> guard(m_scheduler.m_mutex);
+    m_scheduler.Join(*this);
+    auto tp = std::chrono::system_clock::from_time_t(deadline);
+    return m_scheduler.m_cv.wait_until(guard, tp, [&]{return m_admitted;});
+}
+
+void Scheduler::Ticket::Wait()
+{
+    std::unique_lock<std::mutex> guard(m_scheduler.m_mutex);
+    m_scheduler.Join(*this);
+    m_scheduler.m_cv.wait(guard, [&]{return m_admitted;});
+}
+
+void Scheduler::Ticket::Yield()
+{
+    m_scheduler.Yield(*this);
+}
+
+size_t Scheduler::Ticket::Position() const
+{
+    std::unique_lock<std::mutex> guard(m_scheduler.m_mutex);
+    auto owner = m_scheduler.m_owners.find(m_owner);
+    if (m_admitted || !m_joined || (owner == m_scheduler.m_owners.end())) {return 0;}
+    auto &waiting = owner->second.m_waiting;
+    return std::find(waiting.begin(), waiting.end(), this) - waiting.begin();
+}
+
+
+Scheduler::Scheduler(unsigned max_active, unsigned max_queued, Metrics &metrics) :
+    m_max_active(max_active),
+    m_max_queued(max_queued),
+    m_metrics(metrics)
+{}
+
+void Scheduler::SetWeight(const std::string &owner, unsigned weight)
+{
+    m_weights[owner] = weight ? weight : 1;
+}
+
+unsigned Scheduler::Weight(const std::string &owner) const
+{
+    auto iter = m_weights.find(owner);
+    return (iter == m_weights.end()) ? 1 : iter->second;
+}
+
+std::unique_ptr<Scheduler::Ticket> Scheduler::Enqueue(const std::string &owner, int priority)
+{
+    std::unique_lock<std::mutex> guard(m_mutex);
+    // Transfers not admitted yet may take any free slots; the rest queue.
+    unsigned free_slots = (m_active < m_max_active) ? (m_max_active - m_active) : 0;
+    if (m_max_active && (m_queued >= m_max_queued + free_slots)) {
+        return nullptr;
+    }
+    std::unique_ptr<Ticket> ticket(new Ticket(*this, owner, priority, m_sequence++));
+    m_queued++;
+    m_metrics.TransferQueued();
+    return ticket;
+}
+
+void Scheduler::Join(Ticket &ticket)
+{
+    if (ticket.m_joined) {return;}
+    ticket.m_joined = true;
+    auto &waiting = m_owners[ticket.m_owner].m_waiting;
+    // By arrival among equals, also for a ticket queuing again after Yield.
+    auto iter = std::find_if(waiting.begin(), waiting.end(), [&](const Ticket *other) {
+        return (other->m_priority < ticket.m_priority) ||
+               ((other->m_priority == ticket.m_priority) && (other->m_sequence > ticket.m_sequence));
+    });
+    waiting.insert(iter, &ticket);
+    m_waiting++;
+    Dispatch();
+}
+
+void Scheduler::Dispatch()
+{
+    bool admitted = false;
+    while (m_waiting && (!m_max_active || (m_active < m_max_active))) {
+        // The owner with the fewest running transfers for its weight goes
+        // next; among equals, whoever has waited longest.
+        Owner *next = nullptr;
+        double next_share = 0;
+        for (auto &entry : m_owners) {
+            Owner &owner = entry.second;
+            if (owner.m_waiting.empty()) {continue;}
+            double share = static_cast<double>(owner.m_active) / Weight(entry.first);
+            if (!next || (share < next_share) ||
+                ((share == next_share) &&
+                 (owner.m_waiting.front()->m_sequence < next->m_waiting.front()->m_sequence)))
+            {
+                next = &owner;
+                next_share = share;
+            }
+        }
+        Ticket *ticket = next->m_waiting.front();
+        next->m_waiting.erase(next->m_waiting.begin());
+        next->m_active++;
+        ticket->m_admitted = true;
+        m_active++;
+        m_waiting--;
+        m_queued--;
+        m_metrics.TransferDequeued();
+        m_metrics.TransferStarted();
+        admitted = true;
+    }
+    if (admitted) {
+        m_cv.notify_all();
+    }
+}
+
+void Scheduler::Release(Ticket &ticket)
+{
+    std::unique_lock<std::mutex> guard(m_mutex);
+    if (!ticket.m_joined) {
+        // The transfer failed (or the client went away) before it was ready.
+        m_queued--;
+        m_metrics.TransferDequeued();
+        return;
+    }
+    auto iter = m_owners.find(ticket.m_owner);
+    if (iter == m_owners.end()) {return;}
+    Owner &owner = iter->second;
+    if (ticket.m_admitted) {
+        owner.m_active--;
+        m_active--;
+        m_metrics.TransferEnded();
+    } else {
+        // The client went away while waiting.
+        owner.m_waiting.erase(std::find(owner.m_waiting.begin(), owner.m_waiting.end(), &ticket));
+        m_waiting--;
+        m_queued--;
+        m_metrics.TransferDequeued();
+    }
+    if (!owner.m_active && owner.m_waiting.empty()) {
+        m_owners.erase(iter);
+    }
+    Dispatch();
+}
+
+void Scheduler::Yield(Ticket &ticket)
+{
+    std::unique_lock<std::mutex> guard(m_mutex);
+    if (!ticket.m_admitted) {return;}
+    auto iter = m_owners.find(ticket.m_owner);
+    if (iter == m_owners.end()) {return;}
+    Owner &owner = iter->second;
+    owner.m_active--;
+    m_active--;
+    m_metrics.TransferEnded();
+    ticket.m_admitted = false;
+    ticket.m_joined = false;
+    m_queued++;
+    m_metrics.TransferQueued();
+    if (!owner.m_active && owner.m_waiting.empty()) {
+        m_owners.erase(iter);
+    }
+    Dispatch();
+}
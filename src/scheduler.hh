@@ -0,0 +1,119 @@
+/**
+ * scheduler.hh:
+ *
+ * Admission control for COPY requests.  At most a configured number of
+ * transfers run at once; the rest wait in a queue per owner (the VO of
+ * the client, or its name) and free slots are handed out by weighted fair
+ * share, so a burst of requests from one owner cannot starve the others.
+ * Within one owner, transfers go by priority and then in arrival order.
+ *
+ * A push only lines up for a running slot once its source is open, so one
+ * whose file is still being staged from tape does not hold a slot that a
+ * quick transfer could use.  A pull lines up before opening (and thereby
+ * truncating) its destination, and yields its slot while the storage
+ * stalls that open.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+namespace TPC {
+class Metrics;
+
+class Scheduler {
+public:
+    // A place in the queue and, once admitted, a running slot; both are
+    // given up when the ticket is destroyed.
+    class Ticket {
+    public:
+        ~Ticket();
+
+        Ticket(const Ticket&) = delete;
+
+        // Line up for a running slot (if not done yet) and block until
+        // admitted or the deadline passes; returns true once the transfer
+        // may start.
+        bool WaitUntil(time_t deadline);
+        void Wait();
+
+        // Give the running slot back (if admitted) while the transfer cannot
+        // make use of it; the ticket queues again on the next wait, in its
+        // original place.
+        void Yield();
+
+        // Number of transfers of the same owner ahead of this one (0 once admitted).
+        size_t Position() const;
+
+    private:
+        friend class Scheduler;
+
+        Ticket(Scheduler &scheduler, const std::string &owner, int priority, uint64_t sequence) :
+            m_scheduler(scheduler),
+            m_owner(owner),
+            m_priority(priority),
+            m_sequence(sequence)
+        {}
+
+        Scheduler &m_scheduler;
+        const std::string m_owner;
+        const int m_priority;
+        const uint64_t m_sequence;  // Order of arrival.
+        // Both protected by the scheduler's mutex.
+        bool m_joined{false};  // Whether the ticket is lined up for a slot.
+        bool m_admitted{false};
+    };
+
+    // `max_active` transfers run at once (0 means no limit); beyond that,
+    // up to `max_queued` wait for their turn.
+    Scheduler(unsigned max_active, unsigned max_queued, Metrics &metrics);
+
+    Scheduler(const Scheduler&) = delete;
+
+    // Owners without a weight have a weight of 1; an owner with weight 2
+    // is given twice as many running slots when both have transfers queued.
+    void SetWeight(const std::string &owner, unsigned weight);
+
+    // Queue a transfer on behalf of `owner`; returns nullptr if the queue
+    // is full.  A higher `priority` goes ahead of the owner's other transfers.
+    // The place in the queue counts against its size right away, but the
+    // transfer competes for a slot only once it waits on the ticket.
+    std::unique_ptr<Ticket> Enqueue(const std::string &owner, int priority);
+
+private:
+    struct Owner {
+        std::vector<Ticket*> m_waiting;  // By priority, then in arrival order.
+        unsigned m_active{0};
+    };
+
+    // Admit as many waiting transfers as there are free slots; the mutex
+    // must be held.
+    void Dispatch();
+    void Join(Ticket &ticket);
+    void Release(Ticket &ticket);
+    void Yield(Ticket &ticket);
+    unsigned Weight(const std::string &owner) const;
+
+    const unsigned m_max_active;
+    const unsigned m_max_queued;
+    Metrics &m_metrics;
+    std::map<std::string, unsigned> m_weights;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::map<std::string, Owner> m_owners;
+    unsigned m_active{0};
+    unsigned m_queued{0};  // Tickets not admitted yet, lined up or not.
+    unsigned m_waiting{0};  // Tickets lined up for a slot.
+    uint64_t m_sequence{0};
+};
+
+}
@@ -3,22 +3,31 @@
 #include <sstream>
 #include <stdexcept>
 
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
 #include "XrdHttp/XrdHttpExtHandler.hh"
 #include "XrdSfs/XrdSfsInterface.hh"
 
 #include <curl/curl.h>
 
 #include "XrdTpcVersion.hh"
+#include "curlpool.hh"
+#include "governor.hh"
 #include "state.hh"
 #include "stream.hh"
 
 using namespace TPC;
 
 State::~State() {
+    ReleaseConnection();
+    // The curl handle may already have been returned to the pool (which
+    // resets it before reuse), so it must not be touched here.
     if (m_headers) {
             curl_slist_free_all(m_headers);
             m_headers = nullptr;
-            if (m_curl) {curl_easy_setopt(m_curl, CURLOPT_HTTPHEADER, m_headers);}
     }
 }
 
@@ -26,15 +35,28 @@ State::State(State && other) noexcept :
     m_push(other.m_push),
     m_recv_status_line(other.m_recv_status_line),
     m_recv_all_headers(other.m_recv_all_headers),
-    m_offset(other.m_offset),
+    m_paused(other.m_paused),
+    m_connected(other.m_connected),
+    m_response_started(other.m_response_started),
+    m_offset(other.m_offset.load()),
     m_start_offset(other.m_start_offset),
     m_status_code(other.m_status_code),
     m_content_length(other.m_content_length),
+    m_upload_size(other.m_upload_size),
     m_stream(other.m_stream),
     m_curl(other.m_curl),
     m_headers(other.m_headers),
     m_headers_copy(std::move(other.m_headers_copy)),
-    m_resp_protocol(std::move(m_resp_protocol))
+    m_resp_protocol(std::move(m_resp_protocol)),
+    m_etag(std::move(other.m_etag)),
+    m_last_modified(std::move(other.m_last_modified)),
+    m_digest(std::move(other.m_digest)),
+    m_resource_size(other.m_resource_size),
+    m_range_first(other.m_range_first),
+    m_range_start(other.m_range_start),
+    m_retry_after(other.m_retry_after),
+    m_header_callback(std::move(other.m_header_callback)),
+    m_limit(std::move(other.m_limit))
 {
     curl_easy_setopt(m_curl, CURLOPT_HEADERDATA, this);
     if (m_push) {
@@ -43,6 +65,7 @@ State::State(State && other) noexcept :
         curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, this);
     }
     other.m_headers_copy.clear();
+    other.m_connected = false;
     other.m_curl = nullptr;
     other.m_headers = nullptr;
 }
@@ -96,10 +119,56 @@ void State::CopyHeaders(XrdHttpExtReq &req) {
     }
 }
 
+void State::AddHeader(const std::string &header) {
+    m_headers = curl_slist_append(m_headers, header.c_str());
+    m_headers_copy.push_back(header);
+    curl_easy_setopt(m_curl, CURLOPT_HTTPHEADER, m_headers);
+}
+
+bool State::AcquireConnection() {
+    if (m_connected) {return true;}
+    Limit *local = m_stream.GetLimit();
+    if (m_limit && !m_limit->AcquireConnection()) {return false;}
+    if (local && !local->AcquireConnection()) {
+        if (m_limit) {m_limit->ReleaseConnection();}
+        return false;
+    }
+    m_connected = true;
+    return true;
+}
+
+void State::ReleaseConnection() {
+    if (!m_connected) {return;}
+    m_connected = false;
+    if (m_limit) {m_limit->ReleaseConnection();}
+    Limit *local = m_stream.GetLimit();
+    if (local) {local->ReleaseConnection();}
+}
+
+off_t State::GetResourceSize() const {
+    if (!m_recv_all_headers) {return -1;}
+    // A server that ignores the Range header sends the whole resource.
+    if (m_status_code == 200) {return m_content_length;}
+    return m_resource_size;
+}
+
+bool State::UnexpectedRange() const {
+    if ((m_range_start < 0) || !m_recv_all_headers) {return false;}
+    if (m_status_code == 200) {return m_range_start > 0;}
+    return (m_status_code == 206) && (m_range_first != m_range_start);
+}
+
 void State::ResetAfterRequest() {
+    m_paused = false;
     m_offset = 0;
     m_status_code = -1;
     m_content_length = -1;
+    m_resource_size = -1;
+    m_range_first = -1;
+    m_retry_after = -1;
+    m_etag.clear();
+    m_last_modified.clear();
+    m_digest.clear();
     m_recv_all_headers = false;
     m_recv_status_line = false;
 }
@@ -107,57 +176,124 @@ void State::ResetAfterRequest() {
 size_t State::HeaderCB(char *buffer, size_t size, size_t nitems, void *userdata)
 {
     State *obj = static_cast<State*>(userdata);
-    std::string header(buffer, size*nitems);
-    return obj->Header(header);
+    return obj->Header(buffer, size*nitems);
 }
 
-int State::Header(const std::string &header) {
-    //printf("Recieved remote header (%d, %d): %s", m_recv_all_headers, m_recv_status_line, header.c_str());
+namespace {
+
+// Case-insensitive match of a header name.
+bool HeaderIs(const char *name, size_t len, const char *expected)
+{
+    return (len == strlen(expected)) && !strncasecmp(name, expected, len);
+}
+
+// Parse a non-negative decimal number spanning exactly [begin, end).
+bool ParseNumber(const char *begin, const char *end, off_t &result)
+{
+    if (begin == end) {return false;}
+    off_t value = 0;
+    for (const char *ptr = begin; ptr < end; ptr++) {
+        if ((*ptr < '0') || (*ptr > '9')) {return false;}
+        value = 10*value + (*ptr - '0');
+    }
+    result = value;
+    return true;
+}
+
+}
+
+// Parses the raw header line libcurl hands us, without copying it.
+int State::Header(const char *buffer, size_t size) {
     if (m_recv_all_headers) {  // This is the second request -- maybe processed a redirect?
         m_recv_all_headers = false;
         m_recv_status_line = false;
     }
+    const char *end = buffer + size;
+    while ((end > buffer) && ((end[-1] == '\n') || (end[-1] == '\r'))) {end--;}
+
     if (!m_recv_status_line) {
-        std::stringstream ss(header);
-        std::string item;
-        if (!std::getline(ss, item, ' ')) return 0;
-        m_resp_protocol = item;
-        //printf("\n\nResponse protocol: %s\n", m_resp_protocol.c_str());
-        if (!std::getline(ss, item, ' ')) return 0;
-        try {
-            m_status_code = std::stol(item);
-        } catch (...) {
-            return 0;
-        }
+        // "<protocol> <status code> <reason>"
+        const char *space = static_cast<const char *>(memchr(buffer, ' ', end - buffer));
+        if (!space) return 0;
+        m_resp_protocol.assign(buffer, space - buffer);
+        const char *code = space + 1;
+        const char *code_end = code;
+        while ((code_end < end) && (*code_end != ' ')) {code_end++;}
+        off_t status_code;
+        if ((code_end - code != 3) || !ParseNumber(code, code_end, status_code)) return 0;
+        m_status_code = status_code;
+        // Anything learned from an earlier response (e.g. a redirect) does not apply.
+        m_content_length = -1;
+        m_resource_size = -1;
+        m_range_first = -1;
+        m_retry_after = -1;
+        m_etag.clear();
+        m_last_modified.clear();
+        m_digest.clear();
         m_recv_status_line = true;
-    } else if (header.size() == 0 || header == "\n" || header == "\r\n") {
+        return size;
+    }
+    if (end == buffer) {
         m_recv_all_headers = true;
+        if (m_header_callback) {m_header_callback();}
+        return size;
     }
-    else if (header != "\r\n") {
-        // Parse the header
-        std::size_t found = header.find(":");
-        if (found != std::string::npos) {
-            std::string header_name = header.substr(0, found);
-            std::transform(header_name.begin(), header_name.end(), header_name.begin(), ::tolower);
-            std::string header_value = header.substr(found+1);
-            if (header_name == "content-length")
-            {
-                try {
-                    m_content_length = std::stoll(header_value);
-                } catch (...) {
-                    // Header unparseable -- not a great sign, fail request.
-                    //printf("Content-length header unparseable\n");
-                    return 0;
+
+    const char *colon = static_cast<const char *>(memchr(buffer, ':', end - buffer));
+    if (!colon) {
+        // Non-empty header that isn't the status line, but no ':' present --
+        // malformed request?
+        return 0;
+    }
+    size_t name_len = colon - buffer;
+    const char *value = colon + 1;
+    while ((value < end) && ((*value == ' ') || (*value == '\t'))) {value++;}
+    while ((end > value) && ((end[-1] == ' ') || (end[-1] == '\t'))) {end--;}
+
+    if (HeaderIs(buffer, name_len, "content-length")) {
+        // Header unparseable -- not a great sign, fail request.
+        if (!ParseNumber(value, end, m_content_length)) return 0;
+    } else if (HeaderIs(buffer, name_len, "content-range")) {
+        // Either "bytes first-last/total" or "bytes */total"; the total may
+        // itself be "*" if unknown.
+        const char *slash = end;
+        while ((slash > value) && (slash[-1] != '/')) {slash--;}
+        if ((slash == value) || !ParseNumber(slash, end, m_resource_size)) {
+            m_resource_size = -1;
+        }
+        const char *first = value;
+        if ((end - first > 6) && !strncasecmp(first, "bytes ", 6)) {first += 6;}
+        const char *dash = first;
+        while ((dash < slash) && (*dash != '-')) {dash++;}
+        if ((dash == slash) || !ParseNumber(first, dash, m_range_first)) {
+            m_range_first = -1;
+        }
+    } else if (HeaderIs(buffer, name_len, "etag")) {
+        m_etag.assign(value, end - value);
+    } else if (HeaderIs(buffer, name_len, "last-modified")) {
+        m_last_modified.assign(value, end - value);
+    } else if (HeaderIs(buffer, name_len, "digest")) {
+        m_digest.assign(value, end - value);
+    } else if (HeaderIs(buffer, name_len, "retry-after")) {
+        // Either a number of seconds or an HTTP date.
+        off_t seconds;
+        if (ParseNumber(value, end, seconds)) {
+            m_retry_after = seconds;
+        } else {
+            char date[64];
+            size_t len = end - value;
+            if (len < sizeof(date)) {
+                memcpy(date, value, len);
+                date[len] = '\0';
+                time_t when = curl_getdate(date, nullptr);
+                if (when >= 0) {
+                    time_t now = time(nullptr);
+                    m_retry_after = (when > now) ? (when - now) : 0;
                 }
             }
-        } else {
-            // Non-empty header that isn't the status line, but no ':' present --
-            // malformed request?
-            //printf("Malformed header: %s\n", header.c_str());
-            return 0;
         }
     }
-    return header.size();
+    return size;
 }
 
 size_t State::WriteCB(void *buffer, size_t size, size_t nitems, void *userdata) {
@@ -166,14 +302,22 @@ size_t State::WriteCB(void *buffer, size_t size, size_t nitems, void *userdata)
         return 0;
      }  // malformed request - got body before headers.
     if (obj->GetStatusCode() >= 400) {return 0;}  // Status indicates failure.
+    if (obj->UnexpectedRange()) {return 0;}
     return obj->Write(static_cast<char*>(buffer), size*nitems);
 }
 
 int State::Write(char *buffer, size_t size) {
-    int retval = m_stream.Write(m_start_offset + m_offset, buffer, size);
+    int retval = (m_limit && !m_limit->HasBudget()) ? Stream::WriteBlocked :
+                 m_stream.Write(m_start_offset + m_offset, buffer, size);
+    if (retval == Stream::WriteBlocked) {
+        // libcurl will hand us the same data again once resumed.
+        m_paused = true;
+        return CURL_WRITEFUNC_PAUSE;
+    }
     if (retval == SFS_ERROR) {
             return -1;
     }
+    if (m_limit) {m_limit->Consume(retval);}
     m_offset += retval;
     return retval;
 }
@@ -186,22 +330,33 @@ size_t State::ReadCB(void *buffer, size_t size, size_t nitems, void *userdata) {
 }
 
 int State::Read(char *buffer, size_t size) {
-    int retval = m_stream.Read(m_start_offset + m_offset, buffer, size);
+    if (m_upload_size >= 0) {
+        size = std::min(size, static_cast<size_t>(m_upload_size - m_offset));
+        if (!size) {return 0;}
+    }
+    int retval = (m_limit && !m_limit->HasBudget()) ? Stream::ReadBlocked :
+                 m_stream.Read(m_start_offset + m_offset, buffer, size);
+    if (retval == Stream::ReadBlocked) {
+        m_paused = true;
+        return CURL_READFUNC_PAUSE;
+    }
     if (retval == SFS_ERROR) {
         return -1;
     }
+    if (m_limit) {m_limit->Consume(retval);}
     m_offset += retval;
     //printf("Read a total of %ld bytes.\n", m_offset);
     return retval;
 }
 
-State State::Duplicate() {
-    CURL *curl = curl_easy_duphandle(m_curl);
+State State::Duplicate(CurlPool &pool) {
+    CURL *curl = pool.Duplicate(m_curl);
     if (!curl) {
         throw std::runtime_error("Failed to duplicate existing curl handle.");
     }
 
     State state(0, m_stream, curl, m_push);
+    state.m_limit = m_limit;
 
     if (m_headers) {
         state.m_headers_copy.reserve(m_headers_copy.size());
@@ -216,13 +371,62 @@ State State::Duplicate() {
     return std::move(state);
 }
 
-void State::SetTransferParameters(off_t offset, size_t size) {
+void State::SetTransferParameters(off_t offset, size_t size, off_t total_size) {
     m_start_offset = offset;
     m_offset = 0;
-    m_content_length = size;
-    std::stringstream ss;
-    ss << offset << "-" << (offset+size-1);
-    curl_easy_setopt(m_curl, CURLOPT_RANGE, ss.str().c_str());
+    if (!m_push) {
+        m_content_length = size;
+        m_range_start = offset;
+        char range[64];  // libcurl copies it.
+        snprintf(range, sizeof(range), "%lld-%lld", static_cast<long long>(offset),
+                 static_cast<long long>(offset + size - 1));
+        curl_easy_setopt(m_curl, CURLOPT_RANGE, range);
+        return;
+    }
+
+    // Upload only this range; the remote side must accept partial PUTs.
+    m_upload_size = size;
+    curl_easy_setopt(m_curl, CURLOPT_INFILESIZE_LARGE, static_cast<curl_off_t>(size));
+    char content_range[96];
+    snprintf(content_range, sizeof(content_range), "Content-Range: bytes %lld-%lld/%lld",
+             static_cast<long long>(offset), static_cast<long long>(offset + size - 1),
+             static_cast<long long>(total_size));
+    struct curl_slist *list = nullptr;
+    for (auto &header : m_headers_copy) {
+        list = curl_slist_append(list, header.c_str());
+    }
+    list = curl_slist_append(list, content_range);
+    curl_easy_setopt(m_curl, CURLOPT_HTTPHEADER, list);
+    if (m_headers) {
+        curl_slist_free_all(m_headers);
+    }
+    m_headers = list;
+}
+
+void State::PrepareHead() {
+    ResetAfterRequest();
+    struct curl_slist *list = nullptr;
+    for (auto &header : m_headers_copy) {
+        list = curl_slist_append(list, header.c_str());
+    }
+    curl_easy_setopt(m_curl, CURLOPT_HTTPHEADER, list);
+    if (m_headers) {
+        curl_slist_free_all(m_headers);
+    }
+    m_headers = list;
+    m_upload_size = -1;
+    curl_easy_setopt(m_curl, CURLOPT_UPLOAD, 0L);
+    curl_easy_setopt(m_curl, CURLOPT_NOBODY, 1L);
+}
+
+void State::Resume() {
+    if (!m_paused) {return;}
+    m_paused = false;
+    curl_easy_pause(m_curl, CURLPAUSE_CONT);
+}
+
+bool State::Finalize() {
+    return m_stream.Finalize() != SFS_ERROR;
 }
 
 int State::AvailableBuffers() const
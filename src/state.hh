@@ -4,7 +4,10 @@
  * Helper class for managing the state of a single TPC request.
  */
 
+#include <atomic>
+#include <functional>
 #include <memory>
+#include <string>
 #include <vector>
 
 // Forward dec'ls
@@ -13,6 +16,8 @@ class XrdHttpExtReq;
 typedef void CURL;
 
 namespace TPC {
+class CurlPool;
+class Limit;
 class Stream;
 
 class State {
@@ -32,40 +37,111 @@ public:
 
     ~State();
 
-    void SetTransferParameters(off_t offset, size_t size);
+    // Restrict the next request to `size` bytes starting at `offset`; for
+    // uploads, `total_size` is the size of the whole file.
+    void SetTransferParameters(off_t offset, size_t size, off_t total_size);
 
     void CopyHeaders(XrdHttpExtReq &req);
 
+    // Turn the next request into a HEAD of the resource, with the client's
+    // headers but none of a range; used to check the outcome of a push.
+    void PrepareHead();
+
+    // Send `header` (e.g. "Want-Digest: adler32") with every request.
+    void AddHeader(const std::string &header);
+
+    // Share the connections and bandwidth of the remote host with the other
+    // transfers subject to `limit` (see Governor); null for no limit.  A
+    // transfer over its budget pauses until Resume() is called.
+    void SetLimit(std::shared_ptr<Limit> limit) {m_limit = std::move(limit);}
+
+    // Claim a connection slot, of both the remote host and the local
+    // filesystem, before sending a request; returns false if either is at
+    // its cap.  The slot is kept until released, or the state destroyed.
+    bool AcquireConnection();
+    void ReleaseConnection();
+
     off_t BytesTransferred() const {return m_offset;}
 
     off_t GetContentLength() const {return m_content_length;}
 
+    // Size of the whole remote resource, as revealed by the response to a
+    // Range GET (its Content-Range, or its Content-Length if the server
+    // sent everything); -1 until all headers arrived, or if unknown.
+    off_t GetResourceSize() const;
+
+    // Invoked (from the thread driving the curl handle, inside a libcurl
+    // callback) each time the headers of a response are complete.
+    void SetHeaderCallback(std::function<void()> callback) {m_header_callback = std::move(callback);}
+
+    // Validators of the remote resource, from the last response; empty if
+    // the remote side did not send them.
+    const std::string &GetETag() const {return m_etag;}
+    const std::string &GetLastModified() const {return m_last_modified;}
+
+    // Value of the Digest header of the last response (RFC 3230), if any.
+    const std::string &GetDigest() const {return m_digest;}
+
+    // Seconds the remote side asked us to wait (Retry-After) before trying
+    // again; -1 if it did not say.
+    long GetRetryAfter() const {return m_retry_after;}
+
     int GetStatusCode() const {return m_status_code;}
 
+    // Whether the response carries data from somewhere other than the start
+    // of the range requested: a 200 (the whole resource) to a Range that
+    // does not start at 0, or a 206 whose Content-Range starts elsewhere.
+    // Its body is refused, as writing it at the range's offset would
+    // corrupt the file.
+    bool UnexpectedRange() const;
+
+    bool IsPush() const {return m_push;}
+
     void ResetAfterRequest();
 
     CURL *GetHandle() const {return m_curl;}
 
     int AvailableBuffers() const;
 
+    Stream &GetStream() const {return m_stream;}
+
+    // Whether the (chunked) response to the client was started before the
+    // transfer, e.g. to report on a file being staged; the transfer must not
+    // start it again, and failures go in its body.
+    void SetResponseStarted(bool started) {m_response_started = started;}
+    bool ResponseStarted() const {return m_response_started;}
+
+    // Whether the transfer was paused because the stream could not take
+    // (or provide) more data; Resume() restarts it (must be called from the thread
+    // driving the curl handle).
+    bool Paused() const {return m_paused;}
+    void Resume();
+
+    // Flush any data still buffered in the stream; returns false on failure.
+    bool Finalize();
+
     // Returns true if at least one byte of the response has been received,
     // but not the entire contents of the response.
     bool BodyTransferInProgress() const {return m_offset && (m_offset != m_content_length);}
 
     // Duplicate the current state; all settings are copied over, but those
     // related to the transient state are reset as if from a constructor.
-    State Duplicate();
+    // The new curl handle comes from (and should be returned to) the pool.
+    State Duplicate(CurlPool &pool);
 
     State(const State&) = delete;
     State(State &&) noexcept;
 
+    // libcurl header callback; `userdata` is the State.  Public so that the
+    // benchmarks can feed it canned responses.
+    static size_t HeaderCB(char *buffer, size_t size, size_t nitems,
+                           void *userdata);
+
 private:
     bool InstallHandlers(CURL *curl);
 
     // libcurl callback functions, along with the corresponding class methods.
-    static size_t HeaderCB(char *buffer, size_t size, size_t nitems,
-                           void *userdata);
-    int Header(const std::string &header);
+    int Header(const char *buffer, size_t size);
     static size_t WriteCB(void *buffer, size_t size, size_t nitems, void *userdata);
     int Write(char *buffer, size_t size);
     static size_t ReadCB(void *buffer, size_t size, size_t nitems, void *userdata);
@@ -74,15 +150,28 @@ private:
     bool m_push{true};  // whether we are transferring in "push-mode"
     bool m_recv_status_line{false};  // whether we have received a status line in the response from the remote host.
     bool m_recv_all_headers{false};  // true if we have seen the end of headers.
-    off_t m_offset{0};  // number of bytes we have received.
+    bool m_paused{false};  // true if the curl handle was paused by a read or write callback.
+    bool m_connected{false};  // true if we hold a connection slot of the governor.
+    bool m_response_started{false};  // true if the response to the client was started early.
+    std::atomic<off_t> m_offset{0};  // number of bytes we have received; read by the waiting request thread.
     off_t m_start_offset{0};  // offset where we started in the file.
     int m_status_code{-1};  // status code from HTTP response.
     off_t m_content_length{-1};  // value of Content-Length header, if we received one.
+    off_t m_upload_size{-1};  // number of bytes to upload in this request; -1 for the whole file.
     Stream &m_stream;  // stream corresponding to this transfer.
     CURL *m_curl{nullptr};  // libcurl handle
     struct curl_slist *m_headers{nullptr}; // any headers we set as part of the libcurl request.
     std::vector<std::string> m_headers_copy; // Copies of custom headers.
     std::string m_resp_protocol;  // Response protocol in the HTTP status line.
+    std::string m_etag;  // value of ETag header, if we received one.
+    std::string m_last_modified;  // value of Last-Modified header, if we received one.
+    std::string m_digest;  // value of Digest header, if we received one.
+    off_t m_resource_size{-1};  // total size from the Content-Range header, if we received one.
+    off_t m_range_first{-1};  // first byte from the Content-Range header, if we received one.
+    off_t m_range_start{-1};  // first byte asked for with a Range header; -1 if none.
+    long m_retry_after{-1};  // value of Retry-After header in seconds, if we received one.
+    std::function<void()> m_header_callback;
+    std::shared_ptr<Limit> m_limit;  // Limit of the remote host, if any.
 };
 
 };
@@ -1,12 +1,65 @@
-
 #include "stream.hh"
+#include "checksum.hh"
+#include "governor.hh"
+#include "iopool.hh"
+#include "trace.hh"
 
 #include "XrdSfs/XrdSfsInterface.hh"
 
+#include <cstdint>
+#include <limits>
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Older headers lack it; kernels before 5.14 reject it with EINVAL.
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
 using namespace TPC;
 
+namespace {
+
+const uintptr_t page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+
+// Fault in the pages holding [addr, addr+size) without touching them, so a
+// file truncated underneath us yields an error rather than SIGBUS.
+bool Populate(const char *addr, size_t size)
+{
+    uintptr_t start = reinterpret_cast<uintptr_t>(addr) & ~(page_size - 1);
+    size_t length = reinterpret_cast<uintptr_t>(addr) + size - start;
+    int retval;
+    while (((retval = madvise(reinterpret_cast<void *>(start), length, MADV_POPULATE_READ)) < 0) &&
+           (errno == EINTR)) {}
+    return retval == 0;
+}
+
+}
+
+Stream::Stream(std::unique_ptr<XrdSfsFile> fh, size_t max_blocks, BufferPool &pool,
+               IOPool &io, size_t max_inflight)
+    : m_max_blocks(max_blocks),
+      m_max_inflight(max_inflight),
+      m_block_size(pool.BufferSize()),
+      m_fh(std::move(fh)),
+      m_pool(pool),
+      m_io(io)
+{
+    // Enough slots for every buffer this stream could possibly lease.  (The
+    // ring is unused, but harmless, if the stream is only read from.)
+    if (max_blocks) {
+        m_ring.resize(max_blocks + max_inflight / pool.BufferSize() + 2);
+    }
+}
+
 Stream::~Stream()
 {
+    TraceSpan closing(m_trace, "close");
+    WaitIdle();
+    while (!m_read_ahead.empty()) {ReleaseBlock(m_read_ahead.begin());}
     m_fh->close();
 }
 
@@ -17,74 +70,534 @@ Stream::Stat(struct stat* buf)
     return m_fh->stat(buf);
 }
 
+void
+Stream::SetAlignment(size_t alignment)
+{
+    if (!alignment) {
+        struct stat buf;
+        if ((m_fh->stat(&buf) == SFS_OK) && (buf.st_blksize > 0)) {
+            alignment = buf.st_blksize;
+        }
+    }
+    // An alignment larger than a buffer cannot be honored.
+    if (!alignment || (alignment > m_pool.BufferSize())) {
+        alignment = 1;
+    }
+    m_alignment = alignment;
+    m_block_size = (m_pool.BufferSize() / alignment) * alignment;
+}
+
+void
+Stream::SetWriteOffset(off_t offset)
+{
+    m_queued_offset = m_written_offset = m_checkpoint_offset = offset;
+    if (!m_checksum) {return;}
+    // Nothing is in flight yet, so reading the file back is safe.
+    std::vector<char> buffer(m_pool.BufferSize());
+    for (off_t position = 0; position < offset;) {
+        size_t size = (offset - position < static_cast<off_t>(buffer.size())) ?
+                      static_cast<size_t>(offset - position) : buffer.size();
+        int retval = m_fh->read(position, &buffer[0], size);
+        if (retval <= 0) {
+            // Without those bytes the checksum would be wrong; fail the transfer.
+            m_error = true;
+            return;
+        }
+        m_checksum->Update(&buffer[0], retval);
+        position += retval;
+    }
+}
+
+void
+Stream::SetCheckpoint(size_t interval, std::function<void(off_t)> checkpoint)
+{
+    m_checkpoint_interval = interval;
+    m_checkpoint = std::move(checkpoint);
+}
+
+int
+Stream::Truncate(off_t size)
+{
+    return m_fh->truncate(size);
+}
+
+int
+Stream::Descriptor()
+{
+    XrdOucErrInfo einfo;
+    if ((m_fh->fctl(SFS_FCTL_GETFD, nullptr, einfo) == SFS_OK) && (einfo.getErrInfo() >= 0)) {
+        return einfo.getErrInfo();
+    }
+    return -1;
+}
+
 int
 Stream::Write(off_t offset, const char *buf, size_t size)
 {
-    bool buffer_accepted = false;
-    int retval = size;
-    if (offset < m_offset) {
+    if (m_limit && !m_limit->HasBudget()) {
+        return WriteBlocked;
+    }
+    int retval = WriteUnlimited(offset, buf, size);
+    if (m_limit && (retval > 0)) {
+        m_limit->Consume(retval);
+    }
+    return retval;
+}
+
+int
+Stream::WriteUnlimited(off_t offset, const char *buf, size_t size)
+{
+    if (m_error || (offset < m_queued_offset)) {
+        return SFS_ERROR;
+    }
+
+    // Find the region ending exactly at this offset, if there is one.
+    Entry *entry = nullptr;
+    auto iter = m_buffers.upper_bound(offset);
+    if (iter != m_buffers.begin()) {
+        --iter;
+        if (iter->second.End() == offset) {entry = &iter->second;}
+    }
+    size_t room = entry ? entry->Room() : 0;
+    if (room >= size) {
+        entry->Accept(buf, size);
+        QueueWritable(false);
+        return size;
+    }
+
+    // A fresh buffer is needed for (the rest of) this data.  Claim it before
+    // touching any state so a blocked write leaves nothing half-accepted.
+    if (size - room > m_block_size) {
         return SFS_ERROR;
     }
-    if (offset == m_offset) {
-        retval = m_fh->write(offset, buf, size);
-        buffer_accepted = true;
-        if (retval != SFS_ERROR) {
-            m_offset += retval;
+    size_t in_use = m_buffers.size();
+    if (entry && room && (entry->m_offset == m_queued_offset)) {
+        in_use--;  // The current region fills up and will be queued.
+    }
+    // The last buffer of the reorder window (and of the server-wide pool)
+    // is kept for the data filling the first gap, so that out-of-order data
+    // can never wedge the window: writers ahead of the gap wait for credit
+    // instead of failing.
+    bool in_order = (offset == GapOffset());
+    size_t window = in_order ? m_max_blocks : (m_max_blocks ? m_max_blocks - 1 : 0);
+    // Flag the block before checking, so an I/O completion racing with us
+    // either sees the flag (and wakes us) or has already freed space.
+    m_blocked = true;
+    // Every buffer leased must also fit into the write queue once filled.
+    size_t queued = m_tail - m_head;
+    char *buffer = nullptr;
+    if ((in_use >= window) || (m_inflight >= m_max_inflight) ||
+        (m_buffers.size() + queued >= m_ring.size()) || !(buffer = m_pool.Lease(in_order ? 0 : 1)))
+    {
+        return WriteBlocked;
+    }
+    // The flag is left set even though this write got through: with many
+    // ranges in flight, others may still be paused waiting for credit, and
+    // a spurious wakeup costs little.
+    off_t next_offset = offset + static_cast<off_t>(room);
+    auto result = m_buffers.emplace(next_offset, Entry(next_offset, buffer, m_block_size, m_pool));
+    if (!result.second) {  // Overlaps data we already hold.
+        return SFS_ERROR;
+    }
+    if (room) {
+        entry->Accept(buf, room);
+    }
+    result.first->second.Accept(buf + room, size - room);
+    QueueWritable(false);
+    return size;
+}
+
+off_t
+Stream::GapOffset() const
+{
+    off_t end = m_queued_offset;
+    for (const auto &entry : m_buffers) {
+        if (entry.first != end) {break;}
+        end = entry.second.End();
+    }
+    return end;
+}
+
+bool
+Stream::QueueWritable(bool all)
+{
+    while (!m_buffers.empty()) {
+        auto iter = m_buffers.begin();
+        Entry &entry = iter->second;
+        if (entry.m_offset != m_queued_offset) {
+            return false;
+        }
+        // Hold partially-filled regions back so writes stay large, unless
+        // the following region already starts right after it.
+        auto next = std::next(iter);
+        bool complete = !entry.Room() || ((next != m_buffers.end()) && (next->first == entry.End()));
+        if (!complete && !all) {
+            break;
         }
-        // If there are no in-use buffers, then we don't need to
-        // do any accounting.
-        if (m_avail_count == m_buffers.size()) {
-            return retval;
+        PendingWrite pending{entry.m_offset, entry.m_size, entry.m_buffer};
+        if (!Push(pending)) {
+            break;
         }
+        entry.m_buffer = nullptr;  // Now owned by the queue.
+        m_queued_offset = entry.End();
+        m_inflight += pending.m_size;
+        m_buffers.erase(iter);
+        ScheduleDrain();
     }
-    // Even if we already accepted the current data, always
-    // iterate through available buffers and try to write as
-    // much out to disk as possible.
-    Entry *avail_entry;
-    bool buffer_was_written;
-    size_t avail_count = 0;
-    do {
-        avail_count = 0;
-        avail_entry = nullptr;
-        buffer_was_written = false;
-        for (Entry &entry : m_buffers) {
-            // Always try to dump from memory.
-            if (entry.Write(*this) > 0) {
-                buffer_was_written = true;
-            }
-            if (entry.Available()) { // Empty buffer
-                if (!avail_entry) {avail_entry = &entry;}
-                avail_count ++;
+    return true;
+}
+
+bool
+Stream::Push(const PendingWrite &pending)
+{
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_head.load(std::memory_order_acquire) == m_ring.size()) {
+        return false;
+    }
+    m_ring[tail % m_ring.size()] = pending;
+    // Sequentially consistent so DrainQueue cannot miss this entry after
+    // we observe an I/O task still owning the queue (see ScheduleDrain).
+    m_tail.store(tail + 1);
+    return true;
+}
+
+bool
+Stream::Pop(PendingWrite &pending)
+{
+    size_t head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tail.load(std::memory_order_acquire)) {
+        return false;
+    }
+    pending = m_ring[head % m_ring.size()];
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+void
+Stream::ScheduleDrain()
+{
+    if (!m_scheduled.exchange(true)) {
+        m_io.Submit([this]{DrainQueue();});
+    }
+}
+
+void
+Stream::DrainQueue()
+{
+    while (true) {
+        PendingWrite pending;
+        while (Pop(pending)) {
+            // Once a write fails, the remaining data is discarded.
+            if (!m_error) {
+                int retval = m_fh->write(pending.m_offset, pending.m_buffer, pending.m_size);
+                if (retval != static_cast<int>(pending.m_size)) {
+                    m_error = true;
+                } else {
+                    // Writes are queued in order, so this is a prefix of the file.
+                    m_written_offset = pending.m_offset + pending.m_size;
+                    if (m_checksum) {
+                        m_checksum->Update(pending.m_buffer, pending.m_size);
+                    }
+                    if (m_checkpoint && (m_written_offset - m_checkpoint_offset >=
+                                         static_cast<off_t>(m_checkpoint_interval)))
+                    {
+                        Checkpoint();
+                    }
+                }
             }
-            else if (!buffer_accepted && entry.Accept(offset, buf, size)) {
-                buffer_accepted = true;
+            m_pool.Release(pending.m_buffer);
+            m_inflight -= pending.m_size;
+            if (m_blocked.exchange(false)) {
+                std::unique_lock<std::mutex> guard(m_mutex);
+                if (m_wakeup) {m_wakeup();}
             }
         }
-    } while ((avail_count != m_buffers.size()) && buffer_was_written);
-    m_avail_count = avail_count;
-
-    if (!buffer_accepted) {  // No place for this data in allocated buffers
-        if (!avail_entry) {  // No available buffers to allocate.
-            return SFS_ERROR;
+        std::unique_lock<std::mutex> guard(m_mutex);
+        m_scheduled = false;
+        // Keep going if more data arrived and no other task claimed it.
+        if (QueueEmpty() || m_scheduled.exchange(true)) {
+            m_cv.notify_all();
+            return;
         }
-        if (!avail_entry->Accept(offset, buf, size)) {  // Empty buffer cannot accept?!?
-            return SFS_ERROR;
+    }
+}
+
+void
+Stream::WaitIdle()
+{
+    std::unique_lock<std::mutex> guard(m_mutex);
+    m_cv.wait(guard, [&]{return !m_scheduled && QueueEmpty() && !m_tasks_pending;});
+}
+
+void
+Stream::Checkpoint()
+{
+    m_checkpoint_offset = m_written_offset;
+    if (m_fh->sync() == SFS_OK) {
+        m_checkpoint(m_written_offset);
+    }
+}
+
+int
+Stream::Finalize()
+{
+    TraceSpan flush(m_trace, "flush");
+    bool complete = true;
+    while (true) {
+        if (!QueueWritable(true)) {
+            // A gap remains in the data; the transfer is incomplete.
+            complete = false;
+            break;
         }
-        m_avail_count --;
+        if (m_buffers.empty()) {break;}
+        // The queue was full; let it drain and try again.
+        WaitIdle();
+    }
+    WaitIdle();
+    // The I/O threads are idle, so the checkpoint state is ours to touch.
+    if (m_checkpoint && (m_written_offset > m_checkpoint_offset)) {
+        Checkpoint();
+    }
+    return (m_error || !complete) ? SFS_ERROR : SFS_OK;
+}
+
+void
+Stream::Submit(std::function<void()> task)
+{
+    {
+        std::unique_lock<std::mutex> guard(m_mutex);
+        m_tasks_pending++;
     }
+    m_io.Submit([this, task]{
+        task();
+        std::unique_lock<std::mutex> guard(m_mutex);
+        m_tasks_pending--;
+        m_cv.notify_all();
+    });
+}
+
+void
+Stream::SetWakeup(std::function<void()> wakeup)
+{
+    std::unique_lock<std::mutex> guard(m_mutex);
+    m_wakeup = std::move(wakeup);
+}
 
-    // If we have low buffer occupancy, then release memory.
-    if ((m_buffers.size() > 2) && (m_avail_count * 2 > m_buffers.size())) {
-        for (Entry &entry : m_buffers) {
-            entry.ShrinkIfUnused();
+void
+Stream::EnableMapping()
+{
+    struct stat sbuf;
+    if (!m_max_blocks || (m_fh->stat(&sbuf) != SFS_OK) || !sbuf.st_size) {
+        return;
+    }
+    void *addr = nullptr;
+    off_t size = 0;
+    if ((m_fh->getMmap(&addr, size) == SFS_OK) && addr && size) {
+        m_map_base = static_cast<char *>(addr);
+        m_map_size = size;
+    }
+    m_map_fd = Descriptor();
+    // Try the first page; pages are only ever faulted in this way.
+    if (m_map_base) {
+        m_mapping = Populate(m_map_base, 1);
+    } else if (m_map_fd >= 0) {
+        addr = mmap(nullptr, page_size, PROT_READ, MAP_SHARED, m_map_fd, 0);
+        if (addr != MAP_FAILED) {
+            m_mapping = Populate(static_cast<char *>(addr), 1);
+            munmap(addr, page_size);
         }
     }
+}
 
-    return retval;
+off_t
+Stream::CurrentSize()
+{
+    struct stat sbuf;
+    int retval = (m_map_fd >= 0) ? fstat(m_map_fd, &sbuf) : m_fh->stat(&sbuf);
+    return retval ? -1 : sbuf.st_size;
+}
+
+bool
+Stream::MapBlock(ReadBlock &block)
+{
+    if (m_map_base && (block.End() <= m_map_size)) {
+        block.m_buffer = m_map_base + block.m_offset;
+        block.m_mapped = true;
+        return true;
+    }
+    if (m_map_fd < 0) {
+        return false;
+    }
+    // Mapping only reserves address space; the pages are faulted in by FillBlock.
+    off_t start = block.m_offset - block.m_offset % static_cast<off_t>(page_size);
+    size_t size = static_cast<size_t>(block.End() - start);
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, m_map_fd, start);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+    block.m_map = static_cast<char *>(addr);
+    block.m_map_size = size;
+    block.m_buffer = block.m_map + (block.m_offset - start);
+    block.m_mapped = true;
+    return true;
 }
 
 int
 Stream::Read(off_t offset, char *buf, size_t size)
 {
-    return m_fh->read(offset, buf, size);
+    if (m_limit && !m_limit->HasBudget()) {
+        return ReadBlocked;
+    }
+    int retval = ReadUnlimited(offset, buf, size);
+    if (m_limit && (retval > 0)) {
+        m_limit->Consume(retval);
+    }
+    return retval;
+}
+
+int
+Stream::ReadUnlimited(off_t offset, char *buf, size_t size)
+{
+    if (!m_max_blocks) {
+        return m_fh->read(offset, buf, size);
+    }
+    if (m_read_limit < 0) {
+        struct stat sbuf;
+        m_read_limit = (m_fh->stat(&sbuf) == SFS_OK) ? sbuf.st_size : std::numeric_limits<off_t>::max();
+    }
+
+    auto iter = FindBlock(offset);
+    if (iter == m_read_ahead.end()) {
+        iter = StartBlock(offset);
+    }
+    if (iter == m_read_ahead.end()) {
+        // No buffers to spare (or nothing left to read); go directly to the file.
+        return m_fh->read(offset, buf, size);
+    }
+    ReadBlock &block = *iter->second;
+    Prefetch(block.End());
+
+    if (!block.m_done) {
+        // Flag before re-checking; see Write.
+        m_blocked = true;
+        if (!block.m_done) {
+            return ReadBlocked;
+        }
+        m_blocked = false;
+    }
+    if (block.m_result < 0) {
+        return SFS_ERROR;
+    }
+    off_t avail = block.m_offset + block.m_result - offset;
+    if (avail <= 0) {
+        // A short read, or the end of the file; let the file sort it out.
+        ReleaseBlock(iter);
+        return m_fh->read(offset, buf, size);
+    }
+    size_t count = std::min(size, static_cast<size_t>(avail));
+    memcpy(buf, block.m_buffer + (offset - block.m_offset), count);
+    if (offset + static_cast<off_t>(count) == block.End()) {
+        ReleaseBlock(iter);
+    }
+    return count;
+}
+
+Stream::ReadBlockMap::iterator
+Stream::FindBlock(off_t offset)
+{
+    auto iter = m_read_ahead.upper_bound(offset);
+    if (iter == m_read_ahead.begin()) {
+        return m_read_ahead.end();
+    }
+    --iter;
+    return (iter->second->End() > offset) ? iter : m_read_ahead.end();
+}
+
+Stream::ReadBlockMap::iterator
+Stream::StartBlock(off_t offset)
+{
+    if ((m_read_ahead.size() >= m_max_blocks) || (offset >= m_read_limit)) {
+        return m_read_ahead.end();
+    }
+    off_t size = std::min(static_cast<off_t>(m_block_size), m_read_limit - offset);
+    // Do not overlap the next block, if it is already being read.
+    auto next = m_read_ahead.upper_bound(offset);
+    if (next != m_read_ahead.end()) {
+        size = std::min(size, next->first - offset);
+    }
+    std::unique_ptr<ReadBlock> block(new ReadBlock(offset, size, nullptr));
+    if (m_mapping && !MapBlock(*block)) {
+        // E.g. out of address space; read into buffers from now on.
+        m_mapping = false;
+    }
+    if (!block->m_mapped && !(block->m_buffer = m_pool.Lease())) {
+        return m_read_ahead.end();
+    }
+    ReadBlock *raw = block.get();
+    auto iter = m_read_ahead.emplace_hint(next, offset, std::move(block));
+    {
+        std::unique_lock<std::mutex> guard(m_mutex);
+        m_tasks_pending++;
+    }
+    m_io.Submit([this, raw]{FillBlock(*raw);});
+    return iter;
+}
+
+void
+Stream::Prefetch(off_t offset)
+{
+    while ((m_read_ahead.size() < m_max_blocks) && (offset < m_read_limit)) {
+        auto iter = FindBlock(offset);
+        if (iter == m_read_ahead.end()) {
+            iter = StartBlock(offset);
+            if (iter == m_read_ahead.end()) {break;}
+        }
+        offset = iter->second->End();
+    }
+}
+
+void
+Stream::FillBlock(ReadBlock &block)
+{
+    if (block.m_mapped) {
+        // The file may have shrunk since its size was taken.  Once the pages
+        // are in, they stay readable unless the file is truncated further;
+        // the source of a push is not expected to be.
+        off_t size = CurrentSize();
+        off_t avail = std::min(size, block.End()) - block.m_offset;
+        if (size < 0) {
+            block.m_result = SFS_ERROR;
+        } else if (avail <= 0) {
+            block.m_result = 0;
+        } else {
+            block.m_result = Populate(block.m_buffer, avail) ? static_cast<int>(avail) : SFS_ERROR;
+        }
+    } else {
+        int retval = m_fh->read(block.m_offset, block.m_buffer, block.m_size);
+        block.m_result = (retval < 0) ? SFS_ERROR : retval;
+    }
+    block.m_done = true;
+
+    std::unique_lock<std::mutex> guard(m_mutex);
+    m_tasks_pending--;
+    if (m_blocked.exchange(false) && m_wakeup) {
+        m_wakeup();
+    }
+    m_cv.notify_all();
+}
+
+void
+Stream::ReleaseBlock(ReadBlockMap::iterator iter)
+{
+    // The I/O threads may still be filling it.
+    if (!iter->second->m_done) {
+        WaitIdle();
+    }
+    ReadBlock &block = *iter->second;
+    if (block.m_map) {
+        munmap(block.m_map, block.m_map_size);
+    } else if (!block.m_mapped) {
+        m_pool.Release(block.m_buffer);
+    }
+    m_read_ahead.erase(iter);
 }
@@ -1,114 +1,302 @@
-
 /**
  * The "stream" interface is a simple abstraction of a file handle.
  *
  * The abstraction layer is necessary to do the necessary buffering
  * of multi-stream writes where the underlying filesystem only
  * supports single-stream writes.
+ *
+ * Writes are also decoupled from the network: incoming data is copied
+ * into pooled buffers and complete, in-order buffers are written to the
+ * file by the I/O thread pool ("write-behind"), so a slow storage backend
+ * does not stall the sockets of every transfer on the event loop.
+ *
+ * Conversely, when the file is the source of a transfer, large blocks are
+ * read ahead of the network on the I/O threads ("read-ahead"); if the
+ * file can be memory-mapped, the blocks read ahead are mappings of the file
+ * whose pages the I/O threads fault in, rather than copies in pool buffers.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #include <cstring>
+#include <sys/types.h>
+
+#include "bufferpool.hh"
 
 struct stat;
 
 class XrdSfsFile;
 
 namespace TPC {
+class Checksum;
+class IOPool;
+class Limit;
+class Trace;
+
 class Stream {
 public:
-    Stream(std::unique_ptr<XrdSfsFile> fh, size_t max_blocks, size_t buffer_size)
-        : m_avail_count(max_blocks),
-          m_fh(std::move(fh)),
-          m_offset(0)
-    {
-        //m_buffers.reserve(max_blocks);
-        for (size_t idx=0; idx < max_blocks; idx++) {
-            m_buffers.emplace_back(buffer_size);
-        }
-    }
+    // Reorder buffers (up to `max_blocks` of them) are leased from the
+    // shared pool only while they hold data; at most `max_inflight` bytes
+    // may be queued for the I/O threads at any time.  When the stream is
+    // read from instead, `max_blocks` is the number of blocks kept in
+    // flight ahead of the reader(s) (0 disables read-ahead).
+    Stream(std::unique_ptr<XrdSfsFile> fh, size_t max_blocks, BufferPool &pool,
+           IOPool &io, size_t max_inflight);
 
     ~Stream();
 
+    // Returned by Write when the data cannot be accepted until queued
+    // writes drain, the reorder window has room for out-of-order data, or
+    // the filesystem's bandwidth budget is refilled; the caller should
+    // retry the same data later.
+    static constexpr int WriteBlocked = -2;
+
+    // Returned by Read when the requested data is still being read ahead
+    // (or the filesystem's bandwidth budget is spent); the caller should
+    // retry later.
+    static constexpr int ReadBlocked = -3;
+
     int Stat(struct stat *);
 
+    // Align buffered writes (and read-ahead) to multiples of `alignment`
+    // bytes, e.g. the stripe size of the storage; 0 uses the preferred I/O
+    // size reported by the file.  Must be called before any Read or Write.
+    void SetAlignment(size_t alignment);
+
+    size_t Alignment() const {return m_alignment;}
+
+    // Most bytes held by one buffer; a multiple of the alignment whenever
+    // the alignment fits in a pool buffer.
+    size_t BlockSize() const {return m_block_size;}
+
+    // Feed all data written to the file, in file order, into `checksum`
+    // (from the I/O threads).  Must be called before SetWriteOffset.
+    void SetChecksum(Checksum *checksum) {m_checksum = checksum;}
+
+    Checksum *GetChecksum() const {return m_checksum;}
+
+    // Share the bandwidth (and connection slots, see State) of the local
+    // filesystem with the other transfers subject to `limit`; null for no
+    // limit.  No wakeup is sent when the budget is refilled; blocked
+    // callers must retry periodically.
+    void SetLimit(std::shared_ptr<Limit> limit) {m_limit = std::move(limit);}
+
+    Limit *GetLimit() const {return m_limit.get();}
+
+    // Record the final flush (see Finalize) and close of the file in
+    // `trace`, which must outlive the stream.
+    void SetTrace(Trace *trace) {m_trace = trace;}
+
+    Trace *GetTrace() const {return m_trace;}
+
+    // The first `offset` bytes of the file are already in place (e.g. from
+    // an earlier, interrupted transfer); writes start there.  Those bytes are
+    // read back into the checksum, if any.  Must be called before any Write.
+    void SetWriteOffset(off_t offset);
+
+    // Every `interval` bytes written, flush the file to stable storage and
+    // invoke `checkpoint` (from an I/O thread) with the length of the prefix
+    // of the file that is now durable.  Must be called before any Write.
+    void SetCheckpoint(size_t interval, std::function<void(off_t)> checkpoint);
+
+    int Truncate(off_t size);
+
+    // Descriptor of the underlying file, if the filesystem exposes one
+    // (SFS_FCTL_GETFD); -1 otherwise.  It remains owned by the file.
+    int Descriptor();
+
+    // Read ahead by mapping blocks of the file, if the file provides a
+    // mapping (getMmap) or exposes its descriptor (SFS_FCTL_GETFD) and the
+    // kernel can fault pages in on request (MADV_POPULATE_READ); otherwise
+    // reads work as before.  Has no effect without read-ahead.  Must be
+    // called before any Read.
+    void EnableMapping();
+
     int Read(off_t offset, char *buffer, size_t size);
 
     int Write(off_t offset, const char *buffer, size_t size);
 
-    size_t AvailableBuffers() const {return m_avail_count;}
+    // Queue all remaining buffered data and wait for the I/O threads to
+    // write it out; returns SFS_ERROR if any write failed.  Any data written
+    // in order up to the first gap is checkpointed (see SetCheckpoint).
+    int Finalize();
+
+    // Run `task` on the I/O threads, e.g. bookkeeping that must not block
+    // the event loop; Finalize (and the destructor) wait for it to finish.
+    void Submit(std::function<void()> task);
+
+    // Invoked (from an I/O thread) when a previously blocked Read or Write
+    // may now succeed.  Clearing it guarantees no further invocations.
+    void SetWakeup(std::function<void()> wakeup);
+
+    // Number of additional buffers this stream could fill right now; limited
+    // both by its own allotment and by the server-wide pool.
+    size_t AvailableBuffers() const {
+        size_t avail_count = m_max_blocks - m_buffers.size();
+        return std::min(avail_count, m_pool.Available());
+    }
 
 private:
 
+    // A contiguous region of data waiting to be queued for writing.
     class Entry {
     public:
-        Entry(size_t capacity) :
-            m_capacity(capacity)
+        Entry(off_t offset, char *buffer, size_t capacity, BufferPool &pool) :
+            m_offset(offset),
+            m_capacity(capacity),
+            m_buffer(buffer),
+            m_pool(pool)
         {}
 
+        ~Entry() {m_pool.Release(m_buffer);}
+
         Entry(const Entry&) = delete;
-        Entry(Entry&&) = default;
-
-        bool Available() const {return m_offset == -1;}
-
-        int Write(Stream &stream) {
-            if (Available() || !CanWrite(stream)) {return 0;}
-            // Currently, only full writes are accepted.
-            int size_desired = m_size;
-            int retval = stream.Write(m_offset, &m_buffer[0], size_desired);
-            m_size = 0;
-            m_offset = -1;
-            if (retval != size_desired) {
-                return -1;
-            }
-            return retval;
+        Entry(Entry &&other) :
+            m_offset(other.m_offset),
+            m_capacity(other.m_capacity),
+            m_size(other.m_size),
+            m_buffer(other.m_buffer),
+            m_pool(other.m_pool)
+        {
+            other.m_buffer = nullptr;
         }
 
-        bool Accept(off_t offset, const char *buf, size_t size) {
-            // Validate acceptance criteria.
-            if ((m_offset != -1) && (offset != m_offset + static_cast<ssize_t>(m_size))) {
-                return false;
-            }
-            if (size > m_capacity - m_size) {
-                return false;
-            }
-
-            // Inflate the underlying buffer if needed.
-            ssize_t new_bytes_needed = (m_size + size) - m_buffer.capacity();
-            if (new_bytes_needed > 0) {
-                m_buffer.reserve(m_capacity);
-            }
-
-            // Finally, do the copy.
-            memcpy(&m_buffer[0] + m_size, buf, size);
-            m_size += size;
-            if (m_offset == -1) {
-                m_offset = offset;
-            }
-            return true;
-        }
+        // File offset one past the last byte held.
+        off_t End() const {return m_offset + static_cast<off_t>(m_size);}
 
-        void ShrinkIfUnused() {
-           if (!Available()) {return;}
-           m_buffer.shrink_to_fit();
-        }
+        size_t Room() const {return m_capacity - m_size;}
 
-    private:
-        bool CanWrite(Stream &stream) const {
-            return (m_size > 0) && (m_offset == stream.m_offset);
+        void Accept(const char *buf, size_t size) {
+            memcpy(m_buffer + m_size, buf, size);
+            m_size += size;
         }
 
-        off_t m_offset{-1};  // Offset within file that m_buffer[0] represents.
-        const size_t m_capacity;
+        off_t m_offset;  // Offset within file that m_buffer[0] represents.
+        size_t m_capacity;  // Usable bytes in the buffer.
         size_t m_size{0};  // Number of bytes held in buffer.
-        std::vector<char> m_buffer;
+        char *m_buffer;  // Leased from the pool.
+        BufferPool &m_pool;
+    };
+
+    // A buffer handed over to the I/O threads.
+    struct PendingWrite {
+        off_t m_offset;
+        size_t m_size;
+        char *m_buffer;
+    };
+
+    // A block of the file being read ahead by the I/O threads.
+    struct ReadBlock {
+        ReadBlock(off_t offset, size_t size, char *buffer) :
+            m_offset(offset),
+            m_size(size),
+            m_buffer(buffer)
+        {}
+
+        // File offset one past the last byte requested.
+        off_t End() const {return m_offset + static_cast<off_t>(m_size);}
+
+        off_t m_offset;
+        size_t m_size;  // Number of bytes requested.
+        char *m_buffer;  // Leased from the pool, or within a mapping of the file.
+        bool m_mapped{false};  // Whether m_buffer points into a mapping.
+        char *m_map{nullptr};  // Mapping owned by this block, if any.
+        size_t m_map_size{0};
+        int m_result{0};  // Bytes actually read, or SFS_ERROR; valid once m_done.
+        std::atomic<bool> m_done{false};
     };
 
-    size_t m_avail_count;
+    typedef std::map<off_t, std::unique_ptr<ReadBlock>> ReadBlockMap;
+
+    // Read and Write, without regard to the bandwidth limit.
+    int ReadUnlimited(off_t offset, char *buffer, size_t size);
+    int WriteUnlimited(off_t offset, const char *buffer, size_t size);
+
+    // Size of the file right now (it may shrink while mapped); -1 on error.
+    // A system call, so only for the I/O threads.
+    off_t CurrentSize();
+    // Point `block` at a mapping of its part of the file; false on failure.
+    bool MapBlock(ReadBlock &block);
+
+    // Return the block holding `offset`, or end() if there is none.
+    ReadBlockMap::iterator FindBlock(off_t offset);
+    // Start reading a block at `offset`; returns end() if that is not
+    // possible right now.
+    ReadBlockMap::iterator StartBlock(off_t offset);
+    // Keep up to m_max_blocks reads in flight, starting at `offset`.
+    void Prefetch(off_t offset);
+    void FillBlock(ReadBlock &block);
+    void ReleaseBlock(ReadBlockMap::iterator iter);
+
+    // Where the first gap in the buffered data starts: the end of the
+    // regions contiguous with m_queued_offset.
+    off_t GapOffset() const;
+
+    // Move complete regions contiguous with m_queued_offset to the write
+    // queue.  If `all` is set, partially-filled regions are queued too.
+    bool QueueWritable(bool all);
+
+    // Single-producer, single-consumer ring of pending writes; the producer
+    // is whichever thread is driving the transfer and the consumer is the
+    // (at most one) I/O task draining this stream.
+    bool Push(const PendingWrite &pending);
+    bool Pop(PendingWrite &pending);
+    bool QueueEmpty() const {return m_head == m_tail;}
+
+    void ScheduleDrain();
+    void DrainQueue();
+    void WaitIdle();
+    void Checkpoint();
+
+    const size_t m_max_blocks;
+    const size_t m_max_inflight;
+    size_t m_alignment{1};
+    size_t m_block_size;
     std::unique_ptr<XrdSfsFile> m_fh;
-    off_t m_offset{0};
-    std::vector<Entry> m_buffers;
+    off_t m_queued_offset{0};  // End of the data handed to the I/O threads.
+    // The following are only touched by whichever thread drains the queue.
+    off_t m_written_offset{0};  // End of the data written to the file.
+    off_t m_checkpoint_offset{0};  // End of the data last checkpointed.
+    size_t m_checkpoint_interval{0};
+    std::function<void(off_t)> m_checkpoint;
+    Checksum *m_checksum{nullptr};
+    std::shared_ptr<Limit> m_limit;
+    Trace *m_trace{nullptr};
+    BufferPool &m_pool;
+    IOPool &m_io;
+    // Buffered regions, indexed by their starting offset; the first entry
+    // is always the next one to be queued.
+    std::map<off_t, Entry> m_buffers;
+
+    // Blocks read ahead, indexed by their starting offset.  There may be
+    // several readers (one per range of a multi-stream upload), so blocks
+    // are released once read to their end rather than in order.
+    ReadBlockMap m_read_ahead;
+    off_t m_read_limit{-1};  // Size of the file being read; -1 if not yet known.
+    size_t m_tasks_pending{0};  // Reads and submitted tasks; protected by m_mutex.
+
+    bool m_mapping{false};  // Whether read-ahead blocks are mappings.
+    char *m_map_base{nullptr};  // The whole file, if mapped by the filesystem.
+    off_t m_map_size{0};  // Extent of m_map_base.
+    int m_map_fd{-1};  // Descriptor to map blocks from; -1 if none.
+
+    std::vector<PendingWrite> m_ring;
+    std::atomic<size_t> m_head{0};  // Next slot to pop.
+    std::atomic<size_t> m_tail{0};  // Next slot to push.
+    std::atomic<size_t> m_inflight{0};  // Bytes queued but not yet written.
+    std::atomic<bool> m_scheduled{false};  // Whether an I/O task owns the queue.
+    std::atomic<bool> m_blocked{false};  // Whether a Read or Write was turned away.
+    std::atomic<bool> m_error{false};  // Whether any write to the file failed.
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::function<void()> m_wakeup;
 };
 }
@@ -9,16 +9,26 @@
 
 #include <dlfcn.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <strings.h>
 
 #include <algorithm>
 #include <atomic>
+#include <cctype>
 #include <memory>
 #include <sstream>
 
 #include "XrdTpcVersion.hh"
+#include "checksum.hh"
+#include "curlpool.hh"
+#include "engine.hh"
+#include "iopool.hh"
+#include "journal.hh"
+#include "metrics.hh"
 #include "state.hh"
 #include "stream.hh"
 #include "tpc.hh"
+#include "trace.hh"
 
 using namespace TPC;
 
@@ -27,6 +37,119 @@ std::atomic<uint64_t> TPCHandler::m_monid{0};
 XrdVERSIONINFO(XrdHttpGetExtHandler, HttpTPC);
 
 
+namespace {
+/**
+ * A transfer driven by a single libcurl handle.
+ */
+class SingleTransfer : public Transfer {
+public:
+    SingleTransfer(CURL *curl, State &state) :
+        m_curl(curl),
+        m_state(state)
+    {}
+
+    virtual ~SingleTransfer() {
+        m_state.GetStream().SetWakeup(nullptr);
+    }
+
+    virtual void Start(EventLoop &loop) override {
+        m_state.GetStream().SetWakeup([this]{Notify();});
+        m_waiting = true;
+        Activate(loop);
+    }
+
+    virtual void Done(EventLoop &loop, CURL *, CURLcode result) override {
+        m_active = false;
+        m_remote = RemoteEndpoint(m_curl);
+        if (GetTrace()) {
+            GetTrace()->Request(m_curl, 1, "\"status\":" + std::to_string(m_state.GetStatusCode()) +
+                                           ",\"bytes\":" + std::to_string(m_state.BytesTransferred()));
+        }
+        loop.RemoveHandle(m_curl);
+        m_state.ReleaseConnection();
+        Finish(loop, result);
+    }
+
+    virtual void Abort(EventLoop &loop) override {
+        m_waiting = false;
+        if (!m_active) {return;}
+        m_active = false;
+        loop.RemoveHandle(m_curl);
+        m_state.ReleaseConnection();
+    }
+
+    // Storage caught up with a paused transfer.
+    virtual void Notified(EventLoop &) override {
+        if (m_active) {m_state.Resume();}
+    }
+
+    // Also retry periodically, in case the pause was due to an exhausted
+    // buffer pool rather than this transfer's own backlog.
+    // Likewise for a pause due to the bandwidth limit.  A transfer waiting
+    // for a connection slot keeps trying to get one.
+    virtual void Tick(EventLoop &loop) override {
+        if (GetMetrics() && !IsPush()) {
+            GetMetrics()->ReorderSample(m_state.AvailableBuffers());
+        }
+        if (m_active) {m_state.Resume();}
+        Activate(loop);
+    }
+
+    virtual void Sample(std::vector<StripeProgress> &stripes) override {
+        stripes.resize(1);
+        stripes[0].m_bytes = m_state.BytesTransferred();
+        stripes[0].m_remote = m_active ? RemoteEndpoint(m_curl) : m_remote;
+    }
+
+private:
+    void Activate(EventLoop &loop) {
+        if (!m_waiting || !m_state.AcquireConnection()) {return;}
+        m_waiting = false;
+        loop.AddHandle(m_curl, *this);
+        m_active = true;
+    }
+
+    bool m_active{false};
+    bool m_waiting{false};  // Whether the transfer waits for a connection slot.
+    std::string m_remote;  // Set once the transfer is done.
+    CURL *m_curl;
+    State &m_state;
+};
+}
+
+
+/**
+ * Determine the number of streams requested by the client through the
+ * X-Number-Of-Streams header; returns false if the header is invalid.
+ * The value "auto" leaves the choice to the server (`adaptive` is set and
+ * `streams` is the configured maximum).
+ */
+static bool parse_streams(XrdHttpExtReq &req, int max_auto_streams, int &streams,
+                          bool &adaptive) {
+    streams = 1;
+    adaptive = false;
+    auto streams_header = req.headers.find("X-Number-Of-Streams");
+    if (streams_header == req.headers.end()) {
+        return true;
+    }
+    if (!strcasecmp(streams_header->second.c_str(), "auto")) {
+        streams = max_auto_streams;
+        adaptive = true;
+        return true;
+    }
+    int stream_req = -1;
+    try {
+        stream_req = std::stol(streams_header->second);
+    } catch (...) { // Handled below
+    }
+    if (stream_req < 0 || stream_req > 100) {
+        return false;
+    }
+    streams = stream_req == 0 ? 1 : stream_req;
+    return true;
+}
+
+
 static char *quote(const char *str) {
   int l = strlen(str);
   char *r = (char *) malloc(l*3 + 1);
@@ -69,6 +192,12 @@ static char *quote(const char *str) {
 
 
 bool TPCHandler::MatchesPath(const char *verb, const char *path) {
+    if (!m_metrics_path.empty() && !strcmp(verb, "GET") && (m_metrics_path == path)) {
+        return true;
+    }
+    if (!m_trace_path.empty() && !strcmp(verb, "GET") && (m_trace_path == path)) {
+        return true;
+    }
     return !strcmp(verb, "COPY") || !strcmp(verb, "OPTIONS");
 }
 
@@ -79,25 +208,52 @@ static std::string PrepareURL(const std::string &input) {
     return input;
 }
 
+// The URL without what may carry credentials: the user information and
+// the query string (e.g. an authz token).
+static std::string RedactURL(const std::string &input) {
+    std::string url = input.substr(0, input.find_first_of("?#"));
+    size_t start = url.find("://");
+    start = (start == std::string::npos) ? 0 : start + 3;
+    size_t at = url.substr(0, url.find('/', start)).rfind('@');
+    if ((at != std::string::npos) && (at >= start)) {
+        url.erase(start, at + 1 - start);
+    }
+    return url;
+}
+
 int TPCHandler::ProcessReq(XrdHttpExtReq &req) {
     if (req.verb == "OPTIONS") {
         return ProcessOptionsReq(req);
     }
-    auto header = req.headers.find("Source");
-    if (header != req.headers.end()) {
-        std::string src = PrepareURL(header->second);
-        m_log.Emsg("ProcessReq", "Pull request from", src.c_str());
-        return ProcessPullReq(src, req);
+    if (req.verb == "GET") {
+        return (req.resource == m_trace_path) ? ProcessTraceReq(req) : ProcessMetricsReq(req);
+    }
+    auto source = req.headers.find("Source");
+    auto destination = req.headers.find("Destination");
+    if ((source == req.headers.end()) && (destination == req.headers.end())) {
+        m_log.Emsg("ProcessReq", "COPY verb requested but no source or destination specified.");
+        return req.SendSimpleResp(400, NULL, NULL, "No Source or Destination specified", 0);
     }
-    header = req.headers.find("Destination");
-    if (header != req.headers.end()) {
-        return ProcessPushReq(header->second, req);
+    std::unique_ptr<Scheduler::Ticket> ticket = m_scheduler->Enqueue(GetOwner(req), GetPriority(req));
+    if (!ticket) {
+        m_log.Emsg("ProcessReq", "Transfer queue is full; turning away request from", GetOwner(req).c_str());
+        std::string retry_after = "Retry-After: " + std::to_string(m_queue_retry_after);
+        return req.SendSimpleResp(503, nullptr, const_cast<char *>(retry_after.c_str()),
+                                  const_cast<char *>("Too many transfers queued"), 0);
     }
-    m_log.Emsg("ProcessReq", "COPY verb requested but no source or destination specified.");
-    return req.SendSimpleResp(400, NULL, NULL, "No Source or Destination specified", 0);
+    if (source != req.headers.end()) {
+        std::string src = PrepareURL(source->second);
+        m_log.Emsg("ProcessReq", "Pull request from", src.c_str());
+        return ProcessPullReq(src, req, *ticket);
+    }
+    return ProcessPushReq(destination->second, req, *ticket);
 }
 
 TPCHandler::~TPCHandler() {
+    m_engine = nullptr;
+    m_pool = nullptr;
+    m_io_pool = nullptr;
+    m_buffer_pool = nullptr;
     m_sfs = nullptr;  // NOTE: must delete the SFS here as we may unload the destructor from memory below!
     if (m_handle_base) {
         dlclose(m_handle_base);
@@ -124,6 +280,60 @@ int TPCHandler::ProcessOptionsReq(XrdHttpExtReq &req) {
     return req.SendSimpleResp(200, NULL, (char *) "DAV: 1\r\nDAV: <http://apache.org/dav/propset/fs/1>\r\nAllow: HEAD,GET,PUT,PROPFIND,DELETE,OPTIONS,COPY", NULL, 0);
 }
 
+int TPCHandler::ProcessMetricsReq(XrdHttpExtReq &req) {
+    if (!ClientAllowed(req, m_metrics_hosts)) {
+        const char *host = req.GetSecEntity().host;
+        m_log.Emsg("ProcessMetricsReq", "Refusing metrics to", host ? host : "unknown host");
+        return req.SendSimpleResp(403, nullptr, nullptr, const_cast<char *>("Forbidden"), 0);
+    }
+    std::string body = m_metrics->Render(*m_buffer_pool);
+    return req.SendSimpleResp(200, nullptr, const_cast<char *>("Content-Type: text/plain; version=0.0.4"),
+                              const_cast<char *>(body.c_str()), body.size());
+}
+
+int TPCHandler::ProcessTraceReq(XrdHttpExtReq &req) {
+    if (!ClientAllowed(req, m_trace_hosts)) {
+        const char *host = req.GetSecEntity().host;
+        m_log.Emsg("ProcessTraceReq", "Refusing traces to", host ? host : "unknown host");
+        return req.SendSimpleResp(403, nullptr, nullptr, const_cast<char *>("Forbidden"), 0);
+    }
+    std::string body = m_tracer->Render();
+    return req.SendSimpleResp(200, nullptr, const_cast<char *>("Content-Type: application/json"),
+                              const_cast<char *>(body.c_str()), body.size());
+}
+
+std::unique_ptr<Trace> TPCHandler::StartTrace(const char *verb, XrdHttpExtReq &req,
+                                              const std::string &url) {
+    if (!m_tracer) {
+        return nullptr;
+    }
+    return m_tracer->Start(std::string(verb) + " " + req.resource + (strcmp(verb, "pull") ? " to " : " from ") +
+                           RedactURL(url));
+}
+
+std::string TPCHandler::GetOwner(XrdHttpExtReq &req) {
+    const XrdSecEntity &entity = req.GetSecEntity();
+    if (entity.vorg && *entity.vorg) {
+        return entity.vorg;
+    } else if (entity.name && *entity.name) {
+        return entity.name;
+    }
+    return "anonymous";
+}
+
+int TPCHandler::GetPriority(XrdHttpExtReq &req) {
+    auto priority_header = req.headers.find("X-Transfer-Priority");
+    if (priority_header == req.headers.end()) {
+        return 0;
+    }
+    char *end = nullptr;
+    long priority = strtol(priority_header->second.c_str(), &end, 10);
+    if (!end || *end || (priority < -100) || (priority > 100)) {
+        return 0;
+    }
+    return priority;
+}
+
 std::string TPCHandler::GetAuthz(XrdHttpExtReq &req) {
     std::string authz;
     auto authz_header = req.headers.find("Authorization");
@@ -149,22 +359,134 @@ int TPCHandler::RedirectTransfer(XrdHttpExtReq &req, XrdOucErrInfo &error) {
     return req.SendSimpleResp(307, nullptr, const_cast<char *>(ss.str().c_str()), nullptr, 0);
 }
 
-int TPCHandler::OpenWaitStall(XrdSfsFile &fh, const std::string &resource,
-                      int mode, int openMode, const XrdSecEntity &sec,
-                      const std::string &authz)
+int TPCHandler::OpenWaitStall(XrdSfsFile &fh, XrdHttpExtReq &req, int mode, int openMode,
+                              const std::string &authz, bool &started, Scheduler::Ticket *ticket)
 {
-    int open_result;
-    while (1) {
-        open_result = fh.open(resource.c_str(), mode, openMode, &sec,
-                              authz.empty() ? nullptr : authz.c_str());
-        if ((open_result == SFS_STALL) || (open_result == SFS_STARTED)) {
-            int secs_to_stall = fh.error.getErrInfo();
-            if (open_result == SFS_STARTED) {secs_to_stall = secs_to_stall/2 + 5;}
-            sleep(secs_to_stall);
+    time_t deadline = time(NULL) + m_stage_timeout;
+#ifdef XRD_CHUNK_RESP
+    time_t next_marker = 0;
+#endif
+    int last_wait = 0;
+    // Counts this open against tpc.max_stalled_opens until it returns.
+    struct Parked {
+        std::atomic<unsigned> *m_count{nullptr};
+        ~Parked() {if (m_count) {(*m_count)--;}}
+    } parked;
+    while (true) {
+        int open_result = fh.open(req.resource.c_str(), mode, openMode, &req.GetSecEntity(),
+                                  authz.empty() ? nullptr : authz.c_str());
+        if ((open_result != SFS_STALL) && (open_result != SFS_STARTED)) {
+            return open_result;
+        }
+        // XrdHttp has no way to resume a request later, so waiting ties up
+        // one of its threads; do not let the storage take all of them.
+        if (!parked.m_count) {
+            if (m_stalled_opens++ >= m_max_stalled_opens) {
+                m_stalled_opens--;
+                fh.error.setErrInfo(EBUSY, "Too many transfers waiting for the storage");
+                return SFS_ERROR;
+            }
+            parked.m_count = &m_stalled_opens;
+        }
+        // The storage says when to come back; should it keep putting us off,
+        // come back less and less often.
+        int secs_to_stall = fh.error.getErrInfo();
+        if (open_result == SFS_STARTED) {secs_to_stall = secs_to_stall/2 + 5;}
+        int wait = (2*last_wait > secs_to_stall) ? 2*last_wait : secs_to_stall;
+        wait = (wait > m_max_stall) ? m_max_stall : ((wait < 1) ? 1 : wait);
+        last_wait = wait;
+        time_t now = time(NULL);
+        if (now >= deadline) {
+            fh.error.setErrInfo(ETIMEDOUT, "Timed out waiting for the file to be staged");
+            return SFS_ERROR;
+        }
+        // Let queued transfers run meanwhile.
+        if (ticket) {ticket->Yield();}
+        // One last attempt right at the deadline.
+        time_t retry = (now + wait < deadline) ? (now + wait) : deadline;
+        while (now < retry) {
+#ifdef XRD_CHUNK_RESP
+            if (now >= next_marker) {
+                if (!started && req.StartChunkedResp(201, "Created", "Content-Type: text/plain")) {
+                    fh.error.setErrInfo(EIO, "Failed to respond to the client");
+                    return SFS_ERROR;
+                }
+                started = true;
+                if (SendWaitMarker(req, "staging")) {
+                    fh.error.setErrInfo(EIO, "Failed to update the client");
+                    return SFS_ERROR;
+                }
+                next_marker = now + m_marker_period;
+            }
+            sleep(((next_marker < retry) ? next_marker : retry) - now);
+#else
+            sleep(retry - now);
+#endif
+            now = time(NULL);
+        }
+        if (ticket) {
+#ifdef XRD_CHUNK_RESP
+            // The response was started for the first staging marker.
+            if (WaitForTurn(req, *ticket)) {
+                fh.error.setErrInfo(EIO, "Failed to update the client");
+                return SFS_ERROR;
+            }
+#else
+            ticket->Wait();
+#endif
         }
-        break;
     }
-    return open_result;
+}
+
+int TPCHandler::SendFailure(XrdHttpExtReq &req, bool started, int status_code, const char *msg) {
+#ifdef XRD_CHUNK_RESP
+    if (started) {
+        std::string failure = std::string("failure: ") + msg;
+        int retval = req.ChunkResp(failure.c_str(), 0);
+        return retval ? retval : req.ChunkResp(nullptr, 0);
+    }
+#endif
+    return req.SendSimpleResp(status_code, nullptr, nullptr, const_cast<char *>(msg), 0);
+}
+
+int TPCHandler::Admit(XrdHttpExtReq &req, Scheduler::Ticket &ticket, Trace *trace, bool &started) {
+    TraceSpan queued(trace, "queued");
+#ifdef XRD_CHUNK_RESP
+    if (ticket.WaitUntil(0)) {
+        return 0;
+    }
+    if (!started) {
+        int retval = req.StartChunkedResp(201, "Created", "Content-Type: text/plain");
+        if (retval) {return retval;}
+        started = true;
+    }
+    return WaitForTurn(req, ticket);
+#else
+    ticket.Wait();
+    return 0;
+#endif
+}
+
+bool TPCHandler::VerifyChecksum(Stream &stream, const std::string &digest,
+                                const char *log_prefix, std::string &message)
+{
+    Checksum *checksum = stream.GetChecksum();
+    if (!checksum) {
+        return true;
+    }
+    checksum->Final();
+    if (!checksum->Verify(digest, message)) {
+        m_log.Emsg(log_prefix, message.c_str());
+        return false;
+    }
+    if (digest.empty()) {
+        m_log.Emsg(log_prefix, "Remote side sent no Digest; unable to verify", checksum->Digest().c_str());
+    }
+    int fd = stream.Descriptor();
+    if ((fd < 0) || !checksum->Store(fd)) {
+        m_log.Emsg(log_prefix, "Unable to store checksum", checksum->Digest().c_str());
+    }
+    return true;
 }
 
 #ifdef XRD_CHUNK_RESP
@@ -179,175 +501,184 @@ int TPCHandler::DetermineXferSize(CURL *curl, XrdHttpExtReq &req, State &state,
     res = curl_easy_perform(curl);
     if (res == CURLE_HTTP_RETURNED_ERROR) {
         m_log.Emsg("DetermineXferSize", "Remote server failed request", curl_easy_strerror(res));
-        curl_easy_cleanup(curl);
-        return req.SendSimpleResp(500, nullptr, nullptr, const_cast<char *>(curl_easy_strerror(res)), 0);
+        m_pool->Put(curl);
+        return SendFailure(req, state.ResponseStarted(), 500, curl_easy_strerror(res));
     } else if (state.GetStatusCode() >= 400) {
         std::stringstream ss;
         ss << "Remote side failed with status code " << state.GetStatusCode();
         m_log.Emsg("DetermineXferSize", "Remote server failed request", ss.str().c_str());
-        curl_easy_cleanup(curl);
-        return req.SendSimpleResp(500, nullptr, nullptr, const_cast<char *>(ss.str().c_str()), 0);
+        m_pool->Put(curl);
+        return SendFailure(req, state.ResponseStarted(), 500, ss.str().c_str());
     } else if (res) {
         m_log.Emsg("DetermineXferSize", "Curl failed", curl_easy_strerror(res));
         char msg[] = "Unknown internal transfer failure";
-        curl_easy_cleanup(curl);
-        return req.SendSimpleResp(500, nullptr, nullptr, msg, 0);
+        m_pool->Put(curl);
+        return SendFailure(req, state.ResponseStarted(), 500, msg);
     }
     curl_easy_setopt(curl, CURLOPT_NOBODY, 0);
     success = true;
     return 0;
 }
 
-int TPCHandler::SendPerfMarker(XrdHttpExtReq &req, off_t bytes_transferred) {
+/**
+ * A destination that ignores Content-Range on PUT answers each range with a
+ * 201 yet keeps only one of them; its size gives it away.
+ */
+bool TPCHandler::VerifyRemoteSize(State &state, const std::string &url, off_t size,
+                                  const char *log_prefix, std::string &message) {
+    CURL *curl = state.GetHandle();
+    state.PrepareHead();
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    CURLcode res = curl_easy_perform(curl);
+    std::stringstream ss;
+    if (res != CURLE_OK) {
+        ss << "Unable to check the size of the uploaded file: " << curl_easy_strerror(res);
+    } else if (state.GetStatusCode() >= 400) {
+        ss << "Unable to check the size of the uploaded file: remote side failed with status code "
+           << state.GetStatusCode();
+    } else if (state.GetContentLength() < 0) {
+        ss << "Remote side did not report the size of the uploaded file";
+    } else if (state.GetContentLength() != size) {
+        ss << "Remote side holds " << state.GetContentLength() << " bytes instead of " << size
+           << " after the upload; it may not support Content-Range on PUT";
+    } else {
+        return true;
+    }
+    message = ss.str();
+    m_log.Emsg(log_prefix, message.c_str());
+    return false;
+}
+
+int TPCHandler::SendPerfMarker(XrdHttpExtReq &req, const std::vector<StripeProgress> &stripes) {
+    std::stringstream ss;
+    const std::string crlf = "\n";
+    std::string remotes;
+    for (const auto &stripe : stripes) {
+        if (stripe.m_remote.empty()) {continue;}
+        if (!remotes.empty()) {remotes += ",";}
+        remotes += "tcp:" + stripe.m_remote;
+    }
+    // Before the first sample, report a single idle stripe.
+    size_t count = stripes.empty() ? 1 : stripes.size();
+    time_t now = time(NULL);
+    for (size_t idx = 0; idx < count; idx++) {
+        ss << "Perf Marker" << crlf;
+        ss << "Timestamp: " << now << crlf;
+        ss << "Stripe Index: " << idx << crlf;
+        ss << "Stripe Bytes Transferred: " << (stripes.empty() ? 0 : stripes[idx].m_bytes) << crlf;
+        ss << "Stripe Throughput: " << (stripes.empty() ? 0 : stripes[idx].m_rate) << crlf;
+        ss << "Total Stripe Count: " << count << crlf;
+        if (!remotes.empty()) {
+            ss << "RemoteConnections: " << remotes << crlf;
+        }
+        ss << "End" << crlf;
+    }
+
+    return req.ChunkResp(ss.str().c_str(), 0);
+}
+
+int TPCHandler::SendWaitMarker(XrdHttpExtReq &req, const char *state, const std::string &extra) {
     std::stringstream ss;
     const std::string crlf = "\n";
     ss << "Perf Marker" << crlf;
     ss << "Timestamp: " << time(NULL) << crlf;
+    ss << "State: " << state << crlf;
+    ss << extra;
     ss << "Stripe Index: 0" << crlf;
-    ss << "Stripe Bytes Transferred: " << bytes_transferred << crlf;
+    ss << "Stripe Bytes Transferred: 0" << crlf;
     ss << "Total Stripe Count: 1" << crlf;
     ss << "End" << crlf;
-
     return req.ChunkResp(ss.str().c_str(), 0);
 }
 
-int TPCHandler::RunCurlWithUpdates(CURL *curl, XrdHttpExtReq &req, State &state,
-                                   const char *log_prefix)
-{
-    // Create the multi-handle and add in the current transfer to it.
-    CURLM *multi_handle = curl_multi_init();
-    if (!multi_handle) {
-        m_log.Emsg(log_prefix, "Failed to initialize a libcurl multi-handle");
-        char msg[] = "Failed to initialize internal server memory";
-        curl_easy_cleanup(curl);
-        return req.SendSimpleResp(500, nullptr, nullptr, msg, 0);
-    }
-
-    CURLMcode mres;
-    mres = curl_multi_add_handle(multi_handle, curl);
-    if (mres) {
-        m_log.Emsg(log_prefix, "Failed to add transfer to libcurl multi-handle",
-                   curl_multi_strerror(mres));
-        char msg[] = "Failed to initialize internal server handle";
-        curl_easy_cleanup(curl);
-        curl_multi_cleanup(multi_handle);
-        return req.SendSimpleResp(500, nullptr, nullptr, msg, 0);
-    }
-
-    // Start response to client prior to the first call to curl_multi_perform
-    int retval = req.StartChunkedResp(201, "Created", "Content-Type: text/plain");
-    if (retval) {
-        curl_easy_cleanup(curl);
-        curl_multi_cleanup(multi_handle);
-        return retval;
-    }
-
-    // Transfer loop: use curl to actually run the transfer, but periodically
-    // interrupt things to send back performance updates to the client.
-    int running_handles = 1;
+/**
+ * Wait for the engine to finish the transfer, periodically sending perf
+ * markers back to the client.  If the client cannot be updated, the
+ * transfer is cancelled and a non-zero value is returned.
+ */
+int TPCHandler::WaitForTransfer(XrdHttpExtReq &req, Transfer &xfer) {
     time_t last_marker = 0;
-    CURLcode res = static_cast<CURLcode>(-1);
-    do {
+    while (true) {
         time_t now = time(NULL);
         time_t next_marker = last_marker + m_marker_period;
         if (now >= next_marker) {
-            if (SendPerfMarker(req, state.BytesTransferred())) {
-                curl_multi_remove_handle(multi_handle, curl);
-                curl_easy_cleanup(curl);
-                curl_multi_cleanup(multi_handle);
+            if (SendPerfMarker(req, xfer.GetProgress())) {
+                xfer.Cancel();
+                xfer.Wait();
                 return -1;
             }
             last_marker = now;
+            next_marker = now + m_marker_period;
         }
-        mres = curl_multi_perform(multi_handle, &running_handles);
-        if (mres == CURLM_CALL_MULTI_PERFORM) {
-            // curl_multi_perform should be called again immediately.  On newer
-            // versions of curl, this is no longer used.
-            continue;
-        } else if (mres != CURLM_OK) {
-            break;
-        } else if (running_handles == 0) {
-            break;
-        }
-        //printf("There are %d running handles\n", running_handles);
-
-        // Harvest any messages, looking for CURLMSG_DONE.
-        CURLMsg *msg;
-        do {
-            int msgq = 0;
-            msg = curl_multi_info_read(multi_handle, &msgq);
-            if (msg && (msg->msg == CURLMSG_DONE)) {
-                CURL *easy_handle = msg->easy_handle;
-                res = msg->data.result;
-                curl_multi_remove_handle(multi_handle, easy_handle);
-                curl_easy_cleanup(easy_handle);
-            }
-        } while (msg);
-
-        int64_t max_sleep_time = next_marker - time(NULL);
-        if (max_sleep_time <= 0) {
-            continue;
-        }
-        int fd_count;
-        mres = curl_multi_wait(multi_handle, NULL, 0, max_sleep_time*1000, &fd_count);
-        if (mres != CURLM_OK) {
-            break;
-        }
-    } while (running_handles);
-
-    if (mres != CURLM_OK) {
-        m_log.Emsg(log_prefix, "Internal libcurl multi-handle error",
-                   curl_multi_strerror(mres));
-        char msg[] = "Internal server error due to libcurl";
-        curl_multi_remove_handle(multi_handle, curl);
-        curl_easy_cleanup(curl);
-
-        curl_multi_cleanup(multi_handle);
-        if ((retval = req.ChunkResp(msg, 0))) {
-            return retval;
+        if (xfer.WaitUntil(next_marker)) {
+            return 0;
         }
-        return req.ChunkResp(NULL, 0);
-
     }
+}
 
-    // Harvest any messages, looking for CURLMSG_DONE.
-    CURLMsg *msg;
-    do {
-        int msgq = 0;
-        msg = curl_multi_info_read(multi_handle, &msgq);
-        if (msg && (msg->msg == CURLMSG_DONE)) {
-            CURL *easy_handle = msg->easy_handle;
-            res = msg->data.result;
-            curl_multi_remove_handle(multi_handle, easy_handle);
-            curl_easy_cleanup(easy_handle);
+/**
+ * Wait for the scheduler to admit the transfer, telling the client where
+ * it stands meanwhile.  If the client cannot be updated, a non-zero value
+ * is returned (and the transfer gives up its place in the queue).
+ */
+int TPCHandler::WaitForTurn(XrdHttpExtReq &req, Scheduler::Ticket &ticket) {
+    time_t next_marker = 0;
+    while (!ticket.WaitUntil(next_marker)) {
+        std::stringstream ss;
+        ss << "Queue Position: " << ticket.Position() << "\n";
+        if (SendWaitMarker(req, "queued", ss.str())) {
+            return -1;
         }
-    } while (msg);
+        next_marker = time(NULL) + m_marker_period;
+    }
+    return 0;
+}
 
-    if (res == -1) { // No transfers returned?!?
-        curl_multi_remove_handle(multi_handle, curl);
-        curl_easy_cleanup(curl);
-        curl_multi_cleanup(multi_handle);
-        char msg[] = "Internal state error in libcurl";
-        m_log.Emsg(log_prefix, msg);
+int TPCHandler::RunCurlWithUpdates(CURL *curl, XrdHttpExtReq &req, State &state,
+                                   const char *log_prefix)
+{
+    // Start response to client prior to handing the transfer to the engine.
+    int retval = state.ResponseStarted() ? 0 : req.StartChunkedResp(201, "Created", "Content-Type: text/plain");
+    Trace *trace = state.GetStream().GetTrace();
+    if (retval) {
+        m_pool->Put(curl);
+        return retval;
+    }
 
-        if ((retval = req.ChunkResp(msg, 0))) {
-            return retval;
-        }
-        return req.ChunkResp(NULL, 0);
+    SingleTransfer xfer(curl, state);
+    xfer.SetMetrics(m_metrics.get(), state.IsPush());
+    xfer.SetTrace(trace);
+    m_engine->Submit(xfer, m_pool->Affinity(curl));
+    retval = WaitForTransfer(req, xfer);
+    m_pool->Put(curl);
+    if (retval) {
+        m_metrics->TransferResult(state.IsPush(), false);
+        return retval;
     }
-    curl_multi_cleanup(multi_handle);
+    CURLcode res = xfer.GetResult();
 
     // Generate the final response back to the client.
     std::stringstream ss;
+    std::string message;
+    bool success = false;
     if (res != CURLE_OK) {
-        m_log.Emsg(log_prefix, "Remote server failed request", curl_easy_strerror(res));
-        ss << "failure: " << curl_easy_strerror(res);
+        const char *msg = xfer.GetMessage().empty() ? curl_easy_strerror(res) : xfer.GetMessage().c_str();
+        m_log.Emsg(log_prefix, "Remote server failed request", msg);
+        ss << "failure: " << msg;
     } else if (state.GetStatusCode() >= 400) {
         ss << "failure: Remote side failed with status code " << state.GetStatusCode();
         m_log.Emsg(log_prefix, "Remote server failed request", ss.str().c_str());
+    } else if (!state.Finalize()) {
+        ss << "failure: Failed to write data to local storage";
+        m_log.Emsg(log_prefix, "Failed to write data to local storage");
+    } else if (!VerifyChecksum(state.GetStream(), state.GetDigest(), log_prefix, message)) {
+        ss << "failure: " << message;
     } else {
         ss << "success: Created";
+        success = true;
     }
+    m_metrics->TransferResult(state.IsPush(), success);
+    if (trace) {trace->SetResult(success);}
 
     if ((retval = req.ChunkResp(ss.str().c_str(), 0))) {
         return retval;
@@ -357,37 +688,74 @@ int TPCHandler::RunCurlWithUpdates(CURL *curl, XrdHttpExtReq &req, State &state,
 #else
 int TPCHandler::RunCurlBasic(CURL *curl, XrdHttpExtReq &req, State &state,
                              const char *log_prefix) {
-    CURLcode res;
-    res = curl_easy_perform(curl);
-    curl_easy_cleanup(curl);
+    Trace *trace = state.GetStream().GetTrace();
+    SingleTransfer xfer(curl, state);
+    xfer.SetMetrics(m_metrics.get(), state.IsPush());
+    xfer.SetTrace(trace);
+    m_engine->Submit(xfer, m_pool->Affinity(curl));
+    xfer.Wait();
+    m_pool->Put(curl);
+    CURLcode res = xfer.GetResult();
+    std::string message;
+    int retval;
+    bool success = false;
     if (res == CURLE_HTTP_RETURNED_ERROR) {
         m_log.Emsg(log_prefix, "Remote server failed request", curl_easy_strerror(res));
-        return req.SendSimpleResp(500, nullptr, nullptr,
-                                  const_cast<char *>(curl_easy_strerror(res)), 0);
+        retval = req.SendSimpleResp(500, nullptr, nullptr,
+                                    const_cast<char *>(curl_easy_strerror(res)), 0);
     } else if (state.GetStatusCode() >= 400) {
         std::stringstream ss;
         ss << "Remote side failed with status code " << state.GetStatusCode();
         m_log.Emsg(log_prefix, "Remote server failed request", ss.str().c_str());
-        return req.SendSimpleResp(500, nullptr, nullptr,
-                                  const_cast<char *>(ss.str().c_str()), 0);
+        retval = req.SendSimpleResp(500, nullptr, nullptr,
+                                    const_cast<char *>(ss.str().c_str()), 0);
     } else if (res) {
         m_log.Emsg(log_prefix, "Curl failed", curl_easy_strerror(res));
         char msg[] = "Unknown internal transfer failure";
-        return req.SendSimpleResp(500, nullptr, nullptr, msg, 0);
+        retval = req.SendSimpleResp(500, nullptr, nullptr, msg, 0);
+    } else if (!state.Finalize()) {
+        m_log.Emsg(log_prefix, "Failed to write data to local storage");
+        char msg[] = "Failed to write data to local storage";
+        retval = req.SendSimpleResp(500, nullptr, nullptr, msg, 0);
+    } else if (!VerifyChecksum(state.GetStream(), state.GetDigest(), log_prefix, message)) {
+        retval = req.SendSimpleResp(500, nullptr, nullptr, const_cast<char *>(message.c_str()), 0);
     } else {
         char msg[] = "Created";
-        return req.SendSimpleResp(201, nullptr, nullptr, msg, 0);
+        retval = req.SendSimpleResp(201, nullptr, nullptr, msg, 0);
+        success = true;
     }
+    m_metrics->TransferResult(state.IsPush(), success);
+    if (trace) {trace->SetResult(success);}
+    return retval;
 }
 #endif
 
-int TPCHandler::ProcessPushReq(const std::string & resource, XrdHttpExtReq &req) {
-    m_log.Emsg("ProcessPushReq", "Starting a push request for resource", resource.c_str());
-    CURL *curl = curl_easy_init();
-    if (!curl) {
-        char msg[] = "Failed to initialize internal transfer resources";
-        return req.SendSimpleResp(500, nullptr, nullptr, msg, 0);
+bool TPCHandler::PushStreamsAllowed(const std::string &url) const {
+    std::string host = Governor::Host(url);
+    for (const auto &pattern : m_push_stream_hosts) {
+        if (!fnmatch(pattern.c_str(), host.c_str(), 0)) {return true;}
     }
+    return false;
+}
+
+bool TPCHandler::ClientAllowed(XrdHttpExtReq &req, const std::vector<std::string> &hosts) {
+    static const std::vector<std::string> local_hosts =
+        {"localhost", "localhost.localdomain", "127.0.0.1", "[::1]", "[::ffff:127.0.0.1]"};
+    const char *client = req.GetSecEntity().host;
+    if (!client) {return false;}
+    std::string host = client;
+    for (auto &c : host) {c = tolower(c);}
+    for (const auto &pattern : hosts.empty() ? local_hosts : hosts) {
+        if (!fnmatch(pattern.c_str(), host.c_str(), 0)) {return true;}
+    }
+    return false;
+}
+
+int TPCHandler::ProcessPushReq(const std::string & resource, XrdHttpExtReq &req,
+                               Scheduler::Ticket &ticket) {
+    m_log.Emsg("ProcessPushReq", "Starting a push request for resource", resource.c_str());
+    // Declared ahead of the stream, which records its close in it.
+    std::unique_ptr<Trace> trace = StartTrace("push", req, resource);
     char *name = req.GetSecEntity().name;
     std::unique_ptr<XrdSfsFile> fh(m_sfs->newFile(name, m_monid++));
     if (!fh.get()) {
@@ -395,45 +763,86 @@ int TPCHandler::ProcessPushReq(const std::string & resource, XrdHttpExtReq &req)
         return req.SendSimpleResp(500, nullptr, nullptr, msg, 0);
     }
     std::string authz = GetAuthz(req);
+    int streams;
+    bool adaptive;
+    if (!parse_streams(req, m_max_auto_streams, streams, adaptive)) {
+        char msg[] = "Invalid request for number of streams";
+        m_log.Emsg("ProcessPushReq", msg);
+        return req.SendSimpleResp(500, nullptr, nullptr, msg, 0);
+    }
+    // Nothing tells whether a destination honors Content-Range on PUT (one
+    // that ignores it answers 201 and keeps a single range), so only those
+    // the administrator vouches for get more than one stream.
+    if ((streams > 1) && !PushStreamsAllowed(resource)) {
+        streams = 1;
+        adaptive = false;
+    }
 
-    int open_results = OpenWaitStall(*fh, req.resource, SFS_O_RDONLY, 0644,
-                                     req.GetSecEntity(), authz);
-    if (SFS_REDIRECT == open_results) {
+    bool started = false;
+    TraceSpan opening(trace.get(), "open");
+    int open_results = OpenWaitStall(*fh, req, SFS_O_RDONLY, 0644, authz, started);
+    opening.End();
+    if ((SFS_REDIRECT == open_results) && !started) {
         return RedirectTransfer(req, fh->error);
     } else if (SFS_OK != open_results) {
         int code;
         char msg_generic[] = "Failed to open local resource";
         const char *msg = fh->error.getErrText(code);
-        if (msg == nullptr) msg = msg_generic;
+        if ((msg == nullptr) || (SFS_REDIRECT == open_results)) msg = msg_generic;
         int status_code = 400;
         if (code == EACCES) status_code = 401;
-        int resp_result = req.SendSimpleResp(status_code, nullptr, nullptr,
-                                             const_cast<char *>(msg), 0);
+        if (code == EBUSY) status_code = 503;
+        int resp_result = SendFailure(req, started, status_code, msg);
         fh->close();
         return resp_result;
     }
+    // Reading the source changes nothing, so it is opened (and staged)
+    // before lining up for a slot, which a staging file would hold in vain.
+    int retval = Admit(req, ticket, trace.get(), started);
+    if (retval) {
+        fh->close();
+        return retval;
+    }
+    CURL *curl = m_pool->Get(resource);
+    if (!curl) {
+        char msg[] = "Failed to initialize internal transfer resources";
+        fh->close();
+        return SendFailure(req, started, 500, msg);
+    }
     if (!m_cadir.empty()) {
             curl_easy_setopt(curl, CURLOPT_CAPATH, m_cadir.c_str());
     }
     curl_easy_setopt(curl, CURLOPT_URL, resource.c_str());
 
-    Stream stream(std::move(fh), 0, 0);
+    // Each concurrent range needs a block of its own, on top of those read ahead.
+    size_t read_ahead = m_read_ahead ? (m_read_ahead + streams - 1) : 0;
+    Stream stream(std::move(fh), read_ahead, *m_buffer_pool, *m_io_pool, m_write_behind);
+    stream.SetAlignment(m_stripe_size);
+    stream.SetLimit(m_governor.ForPath(req.resource));
+    stream.SetTrace(trace.get());
+    if (m_mmap) {
+        stream.EnableMapping();
+    }
     State state(0, stream, curl, true);
+    state.SetResponseStarted(started);
+    state.SetLimit(m_governor.ForURL(resource));
     state.CopyHeaders(req);
 
 #ifdef XRD_CHUNK_RESP
-    return RunCurlWithUpdates(curl, req, state, "ProcessPushReq");
+    if (streams > 1) {
+        return RunCurlWithStreams(req, state, resource, "ProcessPushReq", streams, adaptive);
+    } else {
+        return RunCurlWithUpdates(curl, req, state, "ProcessPushReq");
+    }
 #else
     return RunCurlBasic(curl, req, state, "ProcessPushReq");
 #endif
 }
 
-int TPCHandler::ProcessPullReq(const std::string &resource, XrdHttpExtReq &req) {
-    CURL *curl = curl_easy_init();
-    if (!curl) {
-            char msg[] = "Failed to initialize internal transfer resources";
-            return req.SendSimpleResp(500, nullptr, nullptr, msg, 0);
-    }
+int TPCHandler::ProcessPullReq(const std::string &resource, XrdHttpExtReq &req,
+                               Scheduler::Ticket &ticket) {
+    // Declared ahead of the stream, which records its close in it.
+    std::unique_ptr<Trace> trace = StartTrace("pull", req, resource);
     char *name = req.GetSecEntity().name;
     std::unique_ptr<XrdSfsFile> fh(m_sfs->newFile(name, m_monid++));
     if (!fh.get()) {
@@ -446,52 +855,96 @@ int TPCHandler::ProcessPullReq(const std::string &resource, XrdHttpExtReq &req)
     if ((overwrite_header == req.headers.end()) || (overwrite_header->second == "T")) {
         mode = SFS_O_TRUNC;
     }
-    int streams = 1;
-    {
-        auto streams_header = req.headers.find("X-Number-Of-Streams");
-        if (streams_header != req.headers.end()) {
-            int stream_req = -1;
-            try {
-                stream_req = std::stol(streams_header->second);
-            } catch (...) { // Handled below
-            }
-            if (stream_req < 0 || stream_req > 100) {
-                char msg[] = "Invalid request for number of streams";
-                m_log.Emsg("ProcessPullReq", msg);
-                return req.SendSimpleResp(500, nullptr, nullptr, msg, 0);
-            }
-            streams = streams == 0 ? 1 : stream_req;
-        }
+    int streams;
+    bool adaptive;
+    if (!parse_streams(req, m_max_auto_streams, streams, adaptive)) {
+        char msg[] = "Invalid request for number of streams";
+        m_log.Emsg("ProcessPullReq", msg);
+        return req.SendSimpleResp(500, nullptr, nullptr, msg, 0);
     }
 
-    int open_result = OpenWaitStall(*fh, req.resource, mode|SFS_O_WRONLY, 0644,
-                                    req.GetSecEntity(), authz);
-    if (SFS_REDIRECT == open_result) {
+    // A multi-stream pull overwriting its destination may pick up where an
+    // earlier attempt left off; the journal decides how much is kept once
+    // the source has been checked, so the file must not be truncated now.
+    std::unique_ptr<Journal> journal;
+    if (!m_journal_dir.empty() && (streams > 1) && (mode == SFS_O_TRUNC)) {
+        journal.reset(new Journal(m_journal_dir, resource, req.resource));
+    }
+    bool resume = journal && journal->Exists();
+    // The part of the destination kept by a resumed pull is read back into
+    // the checksum.
+    int resume_mode = m_checksums ? SFS_O_RDWR : SFS_O_WRONLY;
+    bool started = false;
+    // Opening the destination truncates (or creates) it, so the transfer
+    // must be admitted first; otherwise a queued request would clobber the
+    // file it may never get to write.  The slot is yielded while the
+    // storage stalls the open.
+    int retval = Admit(req, ticket, trace.get(), started);
+    if (retval) {
+        return retval;
+    }
+    TraceSpan opening(trace.get(), "open");
+    int open_result = OpenWaitStall(*fh, req, resume ? resume_mode : (mode|SFS_O_WRONLY),
+                                    0644, authz, started, &ticket);
+    if (resume && (SFS_OK != open_result) && (SFS_REDIRECT != open_result)) {
+        // Most likely the destination is gone; start from scratch, which
+        // truncates whatever is left, so the journal no longer applies.
+        journal->Remove();
+        fh.reset(m_sfs->newFile(name, m_monid++));
+        if (!fh.get()) {
+            char msg[] = "Failed to initialize internal transfer file handle";
+            return SendFailure(req, started, 500, msg);
+        }
+        open_result = OpenWaitStall(*fh, req, mode|SFS_O_WRONLY, 0644, authz, started, &ticket);
+    }
+    opening.End();
+    if ((SFS_REDIRECT == open_result) && !started) {
         return RedirectTransfer(req, fh->error);
     } else if (SFS_OK != open_result) {
         int code;
         char msg_generic[] = "Failed to open local resource";
         const char *msg = fh->error.getErrText(code);
-        if ((msg == nullptr) || (*msg == '\0')) msg = msg_generic;
+        if ((msg == nullptr) || (*msg == '\0') || (SFS_REDIRECT == open_result)) msg = msg_generic;
         int status_code = 400;
         if (code == EACCES) status_code = 401;
+        if (code == EBUSY) status_code = 503;
         if (code == EEXIST) status_code = 412;
-        int resp_result = req.SendSimpleResp(status_code, nullptr, nullptr,
-                                             const_cast<char *>(msg), 0);
+        int resp_result = SendFailure(req, started, status_code, msg);
         fh->close();
         return resp_result;
     }
+    CURL *curl = m_pool->Get(resource);
+    if (!curl) {
+        char msg[] = "Failed to initialize internal transfer resources";
+        fh->close();
+        return SendFailure(req, started, 500, msg);
+    }
     if (!m_cadir.empty()) {
         curl_easy_setopt(curl, CURLOPT_CAPATH, m_cadir.c_str());
     }
     curl_easy_setopt(curl, CURLOPT_URL, resource.c_str());
-    Stream stream(std::move(fh), streams, m_block_size);
+    // Declared ahead of the stream, which feeds it until destroyed.
+    std::unique_ptr<Checksum> checksum;
+    if (m_checksums) {
+        checksum.reset(new Checksum(m_checksums));
+    }
+    Stream stream(std::move(fh), streams, *m_buffer_pool, *m_io_pool, m_write_behind);
+    stream.SetAlignment(m_stripe_size);
+    stream.SetChecksum(checksum.get());
+    stream.SetLimit(m_governor.ForPath(req.resource));
+    stream.SetTrace(trace.get());
     State state(0, stream, curl, false);
+    state.SetResponseStarted(started);
+    state.SetLimit(m_governor.ForURL(resource));
     state.CopyHeaders(req);
+    if (checksum) {
+        state.AddHeader("Want-Digest: " + Checksum::WantDigest(m_checksums));
+    }
 
 #ifdef XRD_CHUNK_RESP
     if (streams > 1) {
-        return RunCurlWithStreams(req, state, "ProcessPullReq", streams);
+        return RunCurlWithStreams(req, state, resource, "ProcessPullReq", streams,
+                                  adaptive, journal.get());
     } else {
         return RunCurlWithUpdates(curl, req, state, "ProcessPullReq");
     }
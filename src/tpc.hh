@@ -2,9 +2,14 @@
 #include <string>
 #include <memory>
 #include <atomic>
+#include <map>
+#include <vector>
 
 #include "XrdHttp/XrdHttpExtHandler.hh"
 
+#include "governor.hh"
+#include "scheduler.hh"
+
 class XrdOucErrInfo;
 class XrdOucStream;
 class XrdSfsFile;
@@ -12,7 +17,18 @@ class XrdSfsFileSystem;
 typedef void CURL;
 
 namespace TPC {
+class BufferPool;
+class CurlPool;
+class IOPool;
+class Journal;
+class Metrics;
 class State;
+class Stream;
+struct StripeProgress;
+class Trace;
+class Tracer;
+class Transfer;
+class TransferEngine;
 
 class TPCHandler : public XrdHttpExtHandler {
 public:
@@ -27,46 +43,163 @@ public:
 private:
     int ProcessOptionsReq(XrdHttpExtReq &req);
 
+    // Serve the metrics in the Prometheus text format.
+    int ProcessMetricsReq(XrdHttpExtReq &req);
+
+    // Serve the ring of recent transfer timelines as a Chrome trace.
+    int ProcessTraceReq(XrdHttpExtReq &req);
+
+    // The timeline of a new transfer, if it is sampled for tracing; the
+    // query string (which may carry credentials) is left out of `url`.
+    std::unique_ptr<Trace> StartTrace(const char *verb, XrdHttpExtReq &req, const std::string &url);
+
     static std::string GetAuthz(XrdHttpExtReq &req);
 
+    // The scheduler queues transfers by owner: the client's VO, or else its name.
+    static std::string GetOwner(XrdHttpExtReq &req);
+
+    // Priority among the owner's transfers (X-Transfer-Priority, -100 to 100).
+    static int GetPriority(XrdHttpExtReq &req);
+
     int RedirectTransfer(XrdHttpExtReq &req, XrdOucErrInfo &error);
 
-    int OpenWaitStall(XrdSfsFile &fh, const std::string &resource, int mode,
-                      int openMode, const XrdSecEntity &sec,
-                      const std::string &authz);
+    // Wait for the scheduler to admit the transfer.  The response is only
+    // started (to send "queued" perf markers) if it has to wait, so an
+    // admitted transfer can still be redirected; `started` tells whether it was.
+    int Admit(XrdHttpExtReq &req, Scheduler::Ticket &ticket, Trace *trace, bool &started);
+
+    // Open the local file of the request, retrying (with backoff, for up
+    // to tpc.stage_timeout seconds) while the storage stalls the client or
+    // stages the file.  Meanwhile the response may be started to send the
+    // client "staging" perf markers; `started` tells whether it was.  The
+    // wait holds the calling thread, so beyond tpc.max_stalled_opens such
+    // waits the open fails at once with EBUSY.  An admitted `ticket`, if
+    // any, is yielded while waiting and admitted again before each retry.
+    int OpenWaitStall(XrdSfsFile &fh, XrdHttpExtReq &req, int mode, int openMode,
+                      const std::string &authz, bool &started,
+                      Scheduler::Ticket *ticket=nullptr);
+
+    // Report a failure with a simple response or, once the response has
+    // been `started`, as its final chunk.
+    int SendFailure(XrdHttpExtReq &req, bool started, int status_code, const char *msg);
+
+    // Complete the checksum (if any) of the data a pull wrote through
+    // `stream`, compare it with the remote side's `digest` and store it for
+    // the checksum manager.  Returns false, with a description in
+    // `message`, if the checksums do not match.
+    bool VerifyChecksum(TPC::Stream &stream, const std::string &digest,
+                        const char *log_prefix, std::string &message);
 
 #ifdef XRD_CHUNK_RESP
     int DetermineXferSize(CURL *curl, XrdHttpExtReq &req, TPC::State &state,
                           bool &success);
 
-    int SendPerfMarker(XrdHttpExtReq &req, off_t bytes_transferred);
+    // Check, with a HEAD request through `state`, that the remote side of a
+    // push split into ranges now holds `size` bytes.  Returns false, with a
+    // description in `message`, if it does not (or cannot tell).
+    bool VerifyRemoteSize(TPC::State &state, const std::string &url, off_t size,
+                          const char *log_prefix, std::string &message);
+
+    // Send one perf marker per stream (stripe) of the transfer.
+    int SendPerfMarker(XrdHttpExtReq &req, const std::vector<StripeProgress> &stripes);
+
+    // Send a perf marker for a transfer that has not started yet, with its
+    // `state` ("queued", "staging") and any `extra` lines.
+    int SendWaitMarker(XrdHttpExtReq &req, const char *state, const std::string &extra = "");
+
+    // Wait for the transfer engine to finish a transfer, sending periodic
+    // perf markers back to the client.
+    int WaitForTransfer(XrdHttpExtReq &req, Transfer &xfer);
+
+    // Wait for the scheduler to admit a transfer, sending periodic "queued"
+    // perf markers back to the client.
+    int WaitForTurn(XrdHttpExtReq &req, Scheduler::Ticket &ticket);
 
     // Perform the libcurl transfer, periodically sending back chunked updates.
     int RunCurlWithUpdates(CURL *curl, XrdHttpExtReq &req, TPC::State &state,
                            const char *log_prefix);
 
-    // Experimental multi-stream version of RunCurlWithUpdates
+    // Experimental multi-stream version of RunCurlWithUpdates; pulls use
+    // Range GETs and pushes use Content-Range PUTs.  If `adaptive` is set,
+    // `streams` is only an upper bound and the count follows throughput.
+    // A pull with a `journal` resumes from, and records, its progress.
+    // `url` is the remote end, as set on the handle of `state`.
     int RunCurlWithStreams(XrdHttpExtReq &req, TPC::State &state,
-                           const char *log_prefix, size_t streams);
+                           const std::string &url, const char *log_prefix,
+                           size_t streams, bool adaptive=false,
+                           Journal *journal=nullptr);
 #else
     int RunCurlBasic(CURL *curl, XrdHttpExtReq &req, TPC::State &state,
                      const char *log_prefix);
 #endif
 
-    int ProcessPushReq(const std::string & resource, XrdHttpExtReq &req);
-    int ProcessPullReq(const std::string &resource, XrdHttpExtReq &req);
+    // Whether a push to `url` may be split into Content-Range PUTs.
+    bool PushStreamsAllowed(const std::string &url) const;
+
+    // Whether the client of `req` connects from a host matching one of
+    // `hosts`, or, if there are none, from the server host itself.
+    static bool ClientAllowed(XrdHttpExtReq &req, const std::vector<std::string> &hosts);
+
+    int ProcessPushReq(const std::string & resource, XrdHttpExtReq &req,
+                       Scheduler::Ticket &ticket);
+    int ProcessPullReq(const std::string &resource, XrdHttpExtReq &req,
+                       Scheduler::Ticket &ticket);
 
     bool ConfigureFSLib(XrdOucStream &Config, std::string &path1, bool &path1_alt,
                         std::string &path2, bool &path2_alt);
+    bool ConfigureLimit(XrdOucStream &Config);
+    bool ConfigureTrace(XrdOucStream &Config);
     bool Configure(const char *configfn, XrdOucEnv *myEnv);
 
     static constexpr int m_marker_period = 5;
+    // Seconds a client turned away by a full queue is asked to wait.
+    static constexpr int m_queue_retry_after = 30;
+    // Longest wait between attempts to open a file that is being staged.
+    static constexpr int m_max_stall = 5*60;
+    // Size of each transfer buffer, and hence the largest range of a
+    // multi-stream transfer.
     static constexpr size_t m_block_size = 16*1024*1024;
+    // Bytes written between updates of a resumable pull's journal.
+    static constexpr size_t m_checkpoint_interval = 256*1024*1024;
     bool m_desthttps{false};
+    unsigned m_engine_threads{2};
+    size_t m_buffer_memory{1024*1024*1024};
+    bool m_hugepages{false};
+    unsigned m_io_threads{4};
+    size_t m_write_behind{64*1024*1024};
+    unsigned m_read_ahead{4};
+    unsigned m_max_auto_streams{16};
+    size_t m_stripe_size{0};  // 0 means the file's preferred I/O size.
+    unsigned m_range_retries{3};
+    std::vector<std::string> m_push_stream_hosts;  // Host patterns pushes may be split for.
+    bool m_mmap{false};  // Whether pushes may read ahead through memory mappings of the file.
     std::string m_cadir;
+    std::string m_journal_dir;  // Empty unless pulls are resumable.
+    unsigned m_checksums{0};  // Checksum::Algorithm values to compute for pulls.
+    std::string m_metrics_path;  // Empty unless the metrics are served.
+    std::vector<std::string> m_metrics_hosts;  // Host patterns of clients allowed the metrics.
+    std::string m_trace_dir;  // Empty unless timelines are written to files.
+    std::string m_trace_path;  // Empty unless the timelines are served.
+    unsigned m_trace_ring{100};  // Timelines kept for m_trace_path.
+    std::vector<std::string> m_trace_hosts;  // Host patterns of clients allowed m_trace_path.
+    unsigned m_trace_sample{1};  // One in this many transfers is traced.
+    unsigned m_max_active_transfers{0};  // 0 means no limit.
+    unsigned m_max_queued_transfers{1000};
+    unsigned m_stage_timeout{4*3600};  // Seconds to wait for a file to come online.
+    unsigned m_max_stalled_opens{100};  // Opens that may wait for the storage at once.
+    std::atomic<unsigned> m_stalled_opens{0};
+    std::map<std::string, unsigned> m_fairshare;  // Scheduler weights, by owner.
+    Governor m_governor;  // Limits per remote host and local path (tpc.limit).
     static std::atomic<uint64_t> m_monid;
     XrdSysError &m_log;
+    std::unique_ptr<Metrics> m_metrics;  // Outlives the transfers referencing it.
     std::unique_ptr<XrdSfsFileSystem> m_sfs;
+    std::unique_ptr<CurlPool> m_pool;
+    std::unique_ptr<BufferPool> m_buffer_pool;
+    std::unique_ptr<IOPool> m_io_pool;
+    std::unique_ptr<TransferEngine> m_engine;
+    std::unique_ptr<Scheduler> m_scheduler;
+    std::unique_ptr<Tracer> m_tracer;  // Null unless tracing (tpc.trace).
     void *m_handle_base{nullptr};
     void *m_handle_chained{nullptr};
 };
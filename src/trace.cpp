@@ -0,0 +1,205 @@
+
+#include "trace.hh"
+
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace TPC;
+
+
+namespace {
+
+// The fine-grained timers appeared in libcurl 7.61; older versions only
+// report (less precise) seconds as doubles.
+#if LIBCURL_VERSION_NUM >= 0x073d00
+#define TPC_TIMER(name) CURLINFO_##name##_TIME_T
+#else
+#define TPC_TIMER(name) CURLINFO_##name##_TIME
+#endif
+
+// Microseconds reported by a libcurl timer.
+int64_t Elapsed(CURL *curl, CURLINFO info)
+{
+#if LIBCURL_VERSION_NUM >= 0x073d00
+    curl_off_t value = 0;
+    curl_easy_getinfo(curl, info, &value);
+    return value;
+#else
+    double value = 0;
+    curl_easy_getinfo(curl, info, &value);
+    return static_cast<int64_t>(value * 1e6);
+#endif
+}
+
+int64_t Microseconds(Trace::Clock::time_point tp)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(tp.time_since_epoch()).count();
+}
+
+std::string Escape(const std::string &value)
+{
+    std::string result;
+    for (char c : value) {
+        if ((c == '"') || (c == '\\')) {
+            result += '\\';
+            result += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            result += buf;
+        } else {
+            result += c;
+        }
+    }
+    return result;
+}
+
+std::string Document(const std::string &events)
+{
+    return "{\"traceEvents\":[" + events + "],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+bool WriteAll(int fd, const std::string &data)
+{
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t retval = write(fd, data.data() + written, data.size() - written);
+        if (retval < 0) {return false;}
+        written += retval;
+    }
+    return true;
+}
+
+}
+
+
+Trace::Trace(Tracer &tracer, uint64_t id, const std::string &name) :
+    m_tracer(tracer),
+    m_id(id),
+    m_name(name),
+    m_start(Clock::now())
+{}
+
+Trace::~Trace()
+{
+    Span("transfer", m_start, 0, std::string("\"result\":\"") + (m_success ? "success" : "failure") + "\"");
+    std::string pid = std::to_string(m_id);
+    std::string events = "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + pid +
+                         ",\"args\":{\"name\":\"" + Escape(m_name) + "\"}}";
+    std::unique_lock<std::mutex> guard(m_mutex);
+    for (unsigned thread : m_threads) {
+        std::string name = thread ? ("stream " + std::to_string(thread)) : std::string("transfer");
+        events += ",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" + pid +
+                  ",\"tid\":" + std::to_string(thread) + ",\"args\":{\"name\":\"" + name + "\"}}";
+    }
+    if (!m_events.empty()) {events += "," + m_events;}
+    m_tracer.Export(m_id, Clock::to_time_t(m_start), events);
+}
+
+void Trace::Span(const char *name, Clock::time_point start, unsigned thread, const std::string &args)
+{
+    int64_t begin = Microseconds(start);
+    Event(name, begin, Microseconds(Clock::now()) - begin, thread, args);
+}
+
+void Trace::Request(CURL *curl, unsigned thread, const std::string &args)
+{
+    int64_t end = Microseconds(Clock::now());
+    int64_t total = Elapsed(curl, TPC_TIMER(TOTAL));
+    int64_t begin = end - total;
+    Event("request", begin, total, thread, args);
+
+    // After redirects, the remaining timers restart with the final request.
+    int64_t redirect = Elapsed(curl, TPC_TIMER(REDIRECT));
+    if (redirect > 0) {
+        Event("redirect", begin, redirect, thread, "");
+    }
+    int64_t base = begin + redirect;
+    int64_t namelookup = Elapsed(curl, TPC_TIMER(NAMELOOKUP));
+    int64_t connect = Elapsed(curl, TPC_TIMER(CONNECT));
+    int64_t appconnect = Elapsed(curl, TPC_TIMER(APPCONNECT));
+    int64_t pretransfer = Elapsed(curl, TPC_TIMER(PRETRANSFER));
+    int64_t starttransfer = Elapsed(curl, TPC_TIMER(STARTTRANSFER));
+    if (namelookup > 0) {
+        Event("dns", base, namelookup, thread, "");
+    }
+    if (connect > namelookup) {
+        Event("connect", base + namelookup, connect - namelookup, thread, "");
+    }
+    if (appconnect > connect) {
+        Event("tls", base + connect, appconnect - connect, thread, "");
+    }
+    // For a push, the first byte is usually that of the "100 Continue".
+    if (starttransfer > pretransfer) {
+        Event("first byte", base + pretransfer, starttransfer - pretransfer, thread, "");
+    }
+    if ((starttransfer > 0) && (base + starttransfer < end)) {
+        Event("body", base + starttransfer, end - base - starttransfer, thread, "");
+    }
+}
+
+void Trace::Event(const char *name, int64_t start, int64_t duration, unsigned thread,
+                  const std::string &args)
+{
+    std::string event = std::string("{\"name\":\"") + name + "\",\"ph\":\"X\",\"ts\":" +
+                        std::to_string(start) + ",\"dur\":" + std::to_string(duration) +
+                        ",\"pid\":" + std::to_string(m_id) + ",\"tid\":" + std::to_string(thread);
+    if (!args.empty()) {event += ",\"args\":{" + args + "}";}
+    event += "}";
+    std::unique_lock<std::mutex> guard(m_mutex);
+    if (!m_events.empty()) {m_events += ",";}
+    m_events += event;
+    m_threads.insert(thread);
+}
+
+
+Tracer::Tracer(const std::string &dir, size_t ring, unsigned sample) :
+    m_dir(dir),
+    m_ring_size(ring),
+    m_sample(sample ? sample : 1)
+{}
+
+std::unique_ptr<Trace> Tracer::Start(const std::string &name)
+{
+    uint64_t sequence = m_sequence++;
+    if (sequence % m_sample) {return nullptr;}
+    // Viewers treat process 0 specially.
+    return std::unique_ptr<Trace>(new Trace(*this, sequence + 1, name));
+}
+
+std::string Tracer::Render() const
+{
+    std::string events;
+    std::unique_lock<std::mutex> guard(m_mutex);
+    for (const auto &entry : m_ring) {
+        if (!events.empty()) {events += ",";}
+        events += entry;
+    }
+    return Document(events);
+}
+
+void Tracer::Export(uint64_t id, time_t start, const std::string &events)
+{
+    if (!m_dir.empty()) {
+        // Sequence numbers restart with the server; the start time and
+        // process ID keep the file names unique.
+        std::string path = m_dir + "/tpc-" + std::to_string(start) + "-" + std::to_string(getpid()) +
+                           "-" + std::to_string(id) + ".json";
+        std::string tmp_path = path + ".tmp";
+        int fd = open(tmp_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (fd >= 0) {
+            bool ok = WriteAll(fd, Document(events));
+            close(fd);
+            if (!ok || rename(tmp_path.c_str(), path.c_str())) {
+                unlink(tmp_path.c_str());
+            }
+        }
+    }
+    if (m_ring_size) {
+        std::unique_lock<std::mutex> guard(m_mutex);
+        m_ring.push_back(events);
+        while (m_ring.size() > m_ring_size) {m_ring.pop_front();}
+    }
+}
@@ -0,0 +1,132 @@
+/**
+ * trace.hh:
+ *
+ * Timelines of individual transfers, to find out where the time of a slow
+ * one went: waiting in the queue, opening the local file, and, for each
+ * request sent to the remote side, DNS, connecting, TLS, waiting for the
+ * first byte and moving the body; finally, flushing and closing the file.
+ *
+ * Timelines are in the Chrome trace-event format, so they can be loaded in
+ * chrome://tracing or Perfetto: each transfer is a process, and each of its
+ * streams a thread.  A sample of the transfers is traced (tpc.trace), into
+ * one file per transfer in a directory, or into a ring of the most recent
+ * transfers that is served over HTTP.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include <cstdint>
+
+#include <curl/curl.h>
+
+namespace TPC {
+class Tracer;
+
+/**
+ * The timeline of one transfer.  Safe from any thread; handed over to the
+ * tracer when destroyed.
+ */
+class Trace {
+public:
+    typedef std::chrono::system_clock Clock;
+
+    Trace(Tracer &tracer, uint64_t id, const std::string &name);
+    ~Trace();
+
+    Trace(const Trace&) = delete;
+
+    // Record that `name` ran from `start` until now on `thread` (0 for the
+    // transfer as a whole; its streams count from 1).  `args`, if any, are
+    // the members of a JSON object, e.g. "\"offset\":0".
+    void Span(const char *name, Clock::time_point start, unsigned thread = 0,
+              const std::string &args = "");
+
+    // Record the phases of the request of `curl`, which just completed on
+    // stream `thread`: DNS, connect, TLS, first byte and body.
+    void Request(CURL *curl, unsigned thread, const std::string &args);
+
+    void SetResult(bool success) {m_success = success;}
+
+private:
+    void Event(const char *name, int64_t start, int64_t duration, unsigned thread,
+               const std::string &args);
+
+    Tracer &m_tracer;
+    const uint64_t m_id;
+    const std::string m_name;
+    const Clock::time_point m_start;
+    bool m_success{false};
+
+    std::mutex m_mutex;
+    std::string m_events;  // Comma-separated JSON objects.
+    std::set<unsigned> m_threads;
+};
+
+/**
+ * Times a span of a transfer from construction until End() (or
+ * destruction); does nothing for a transfer that is not traced.
+ */
+class TraceSpan {
+public:
+    TraceSpan(Trace *trace, const char *name, unsigned thread = 0) :
+        m_trace(trace),
+        m_name(name),
+        m_thread(thread),
+        m_start(Trace::Clock::now())
+    {}
+
+    ~TraceSpan() {End();}
+
+    TraceSpan(const TraceSpan&) = delete;
+
+    void End() {
+        if (m_trace) {m_trace->Span(m_name, m_start, m_thread);}
+        m_trace = nullptr;
+    }
+
+private:
+    Trace *m_trace;
+    const char *m_name;
+    const unsigned m_thread;
+    const Trace::Clock::time_point m_start;
+};
+
+class Tracer {
+public:
+    // Trace one in every `sample` transfers, writing each timeline into
+    // `dir` (unless empty) and keeping the last `ring` of them in memory.
+    Tracer(const std::string &dir, size_t ring, unsigned sample);
+
+    Tracer(const Tracer&) = delete;
+
+    // The timeline of a new transfer described by `name` (e.g. "pull
+    // /path from https://host/path"); nullptr if it is not sampled.
+    std::unique_ptr<Trace> Start(const std::string &name);
+
+    // The transfers in the ring, as a single trace document.
+    std::string Render() const;
+
+private:
+    friend class Trace;
+
+    // Called by each trace as it is destroyed.
+    void Export(uint64_t id, time_t start, const std::string &events);
+
+    const std::string m_dir;
+    const size_t m_ring_size;
+    const unsigned m_sample;
+    std::atomic<uint64_t> m_sequence{0};
+
+    mutable std::mutex m_mutex;
+    std::deque<std::string> m_ring;
+};
+
+}